@@ -0,0 +1,394 @@
+/*
+ * cfgwatch.h - Watch functions' config space for changes without much
+ * polling cost.
+ *
+ * The config space of every watched function is cut into 64 byte blocks.
+ * A block is polled if it was not all zero when the watch started, or if
+ * the block before it was not; the header block is always polled.  This
+ * covers a capability that starts in one block and runs into the next
+ * (AER status, PCIe link status) but skips the unimplemented rest of
+ * extended config space.  Each poll reads a function's polled blocks into
+ * one packed buffer, with dword loads from an ECAM mapping (pcicfg.h) or
+ * one pread(2) per run of blocks from its sysfs config file, and hashes
+ * it (xxh64.h).  Only when that hash moved are the per-block hashes
+ * recomputed, and only blocks whose hash moved are compared dword by
+ * dword with the last snapshot.
+ *
+ * Each changed dword is a diff: time, function, register, old and new
+ * value.  Diffs go into a ring of the last CFGW_RING and are printed as
+ * they come, with the register named: the header register, or the
+ * capability and the offset into it (pcicap_name_at(), pcicap.h).  SIGUSR1
+ * prints the whole ring to stderr, SIGINT/SIGTERM stop the watch.
+ *
+ * The poll period is the caller's, but after a poll that took c seconds
+ * of CPU the watcher sleeps at least 99c, so it never takes more than 1%
+ * of a core.  With many functions, or slow config reads, the period
+ * stretches instead, and the summary says how often it did.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef CFGWATCH_H
+#define CFGWATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "pcicfg.h"
+#include "pcicap.h"
+#include "xxh64.h"
+#include "memfault.h"
+
+#define CFGW_BLOCK	64
+#define CFGW_NBLOCKS	(ECAM_FN_SIZE / CFGW_BLOCK)
+#define CFGW_RING	4096		/* diffs kept */
+#define CFGW_MAXCPU	0.01		/* of a core */
+
+struct cfgwatch_fn {
+	char		name[16];
+	const unsigned char *cfg;	/* in an ECAM mapping, or NULL */
+	int		fd;		/* sysfs config file, or -1 */
+	unsigned	nblocks;
+	uint64_t	live;		/* blocks polled */
+	int		dead;
+	uint64_t	hash;		/* of the polled blocks, packed */
+	uint64_t	blkhash[CFGW_NBLOCKS];
+	unsigned char	snap[ECAM_FN_SIZE];
+};
+
+struct cfgdiff {
+	struct timespec	t;
+	uint32_t	fn;
+	uint16_t	reg;
+	uint32_t	old, new;
+};
+
+struct cfgwatch {
+	struct cfgwatch_fn	*fn;
+	size_t			n, cap;
+	size_t			cur;		/* function being polled */
+	unsigned long		blocks;		/* polled per poll */
+	struct cfgdiff		ring[CFGW_RING];
+	uint64_t		head, shown;	/* diffs recorded, printed */
+	int			json;
+	unsigned long		polls, stretched;
+	double			cpu;		/* seconds, all polls */
+};
+
+static volatile sig_atomic_t	cfgwatch_stop, cfgwatch_dump;
+
+static const char *const cfgwatch_hdr0[16] = {
+	"id", "command/status", "class/revision", "bist/header/latency/cacheline",
+	"bar0", "bar1", "bar2", "bar3", "bar4", "bar5", "cardbus_cis", "subsystem",
+	"rom", "cap_ptr", "reserved", "interrupt",
+};
+
+static const char *const cfgwatch_hdr1[16] = {
+	"id", "command/status", "class/revision", "bist/header/latency/cacheline",
+	"bar0", "bar1", "bus_numbers", "io/secondary_status", "memory", "prefetch_memory",
+	"prefetch_base_upper", "prefetch_limit_upper", "io_upper", "cap_ptr", "rom",
+	"interrupt/bridge_control",
+};
+
+/*
+ * Read the blocks of f in live, packed, into buf.  Returns the bytes
+ * read, or -1.
+ */
+static inline int cfgwatch_read(const struct cfgwatch_fn *f, uint64_t live, unsigned char *buf)
+{
+	unsigned	b, e, reg, k = 0;
+	uint32_t	v;
+
+	for (b = 0; b < f->nblocks; b = e) {
+		if (!(live >> b & 1)) {
+			e = b + 1;
+			continue;
+		}
+		for (e = b + 1; e < f->nblocks && live >> e & 1; e++)
+			;
+		if (f->cfg) {
+			for (reg = b * CFGW_BLOCK; reg < e * CFGW_BLOCK; reg += 4) {
+				v = cfg_read32(f->cfg, reg);
+				memcpy(buf + k + reg - b * CFGW_BLOCK, &v, sizeof(v));
+			}
+		} else if (pread(f->fd, buf + k, (e - b) * CFGW_BLOCK, b * CFGW_BLOCK) !=
+			   (ssize_t)((e - b) * CFGW_BLOCK))
+			return -1;
+		k += (e - b) * CFGW_BLOCK;
+	}
+	return k;
+}
+
+/*
+ * Watch len bytes of config space at cfg (an ECAM mapping), or from fd
+ * (a sysfs config file) if cfg is NULL.  Reads all of it once to pick the
+ * blocks to poll.  For ECAM, arm memfault.h around this like any access.
+ */
+static inline int cfgwatch_add(struct cfgwatch *w, const char *name, const unsigned char *cfg, int fd, unsigned len)
+{
+	struct cfgwatch_fn	*f;
+	unsigned char		buf[ECAM_FN_SIZE];
+	uint64_t		all, nz = 0;
+	unsigned		b, i;
+	int			k;
+
+	if (w->n == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 64;
+		if ((f = realloc(w->fn, w->cap * sizeof(*f))) == NULL) {
+			perror("realloc(3)");
+			return -1;
+		}
+		w->fn = f;
+	}
+	f = &w->fn[w->n];
+	memset(f, 0, sizeof(*f));
+	snprintf(f->name, sizeof(f->name), "%s", name);
+	f->cfg = cfg;
+	f->fd = fd;
+	if ((f->nblocks = (len > ECAM_FN_SIZE ? ECAM_FN_SIZE : len) / CFGW_BLOCK) == 0)
+		return -1;
+	all = f->nblocks == 64 ? ~0ULL : (1ULL << f->nblocks) - 1;
+	if (cfgwatch_read(f, all, f->snap) < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	for (b = 0; b < f->nblocks; b++) {
+		for (i = 0; i < CFGW_BLOCK && !f->snap[b * CFGW_BLOCK + i]; i++)
+			;
+		if (i < CFGW_BLOCK)
+			nz |= 1ULL << b;
+		f->blkhash[b] = xxh64(f->snap + b * CFGW_BLOCK, CFGW_BLOCK, 0);
+	}
+	f->live = (nz | nz << 1 | 1) & all;
+	for (b = 0, k = 0; b < f->nblocks; b++)
+		if (f->live >> b & 1) {
+			memcpy(buf + k, f->snap + b * CFGW_BLOCK, CFGW_BLOCK);
+			k += CFGW_BLOCK;
+		}
+	f->hash = xxh64(buf, k, 0);
+	w->blocks += k / CFGW_BLOCK;
+	w->n++;
+	return 0;
+}
+
+static inline void cfgwatch_fn_poll(struct cfgwatch *w, size_t i, const struct timespec *now)
+{
+	struct cfgwatch_fn	*f = &w->fn[i];
+	struct cfgdiff		*d;
+	unsigned char		buf[ECAM_FN_SIZE], *p;
+	unsigned		b, reg;
+	uint64_t		h;
+	uint32_t		o, v;
+	int			k;
+
+	if (f->dead)
+		return;
+	if ((k = cfgwatch_read(f, f->live, buf)) < 0) {
+		fprintf(stderr, "%s: %s, no longer watched\n", f->name, strerror(errno));
+		f->dead = 1;
+		return;
+	}
+	if ((h = xxh64(buf, k, 0)) == f->hash)
+		return;
+	f->hash = h;
+
+	for (b = 0, p = buf; b < f->nblocks; b++) {
+		if (!(f->live >> b & 1))
+			continue;
+		if ((h = xxh64(p, CFGW_BLOCK, 0)) != f->blkhash[b]) {
+			f->blkhash[b] = h;
+			for (reg = 0; reg < CFGW_BLOCK; reg += 4) {
+				memcpy(&o, f->snap + b * CFGW_BLOCK + reg, sizeof(o));
+				memcpy(&v, p + reg, sizeof(v));
+				if (o == v)
+					continue;
+				d = &w->ring[w->head++ % CFGW_RING];
+				d->t = *now;
+				d->fn = i;
+				d->reg = b * CFGW_BLOCK + reg;
+				d->old = o;
+				d->new = v;
+			}
+			memcpy(f->snap + b * CFGW_BLOCK, p, CFGW_BLOCK);
+		}
+		p += CFGW_BLOCK;
+	}
+}
+
+/*
+ * Poll from w->cur on.  Returns -1 if the function at w->cur faulted.
+ */
+static inline int cfgwatch_poll_armed(struct cfgwatch *w, const struct timespec *now)
+{
+	memfault_armed = 1;
+	if (sigsetjmp(memfault_jmp, 1) != 0)
+		return -1;
+	for (; w->cur < w->n; w->cur++)
+		cfgwatch_fn_poll(w, w->cur, now);
+	memfault_armed = 0;
+	return 0;
+}
+
+static inline void cfgwatch_poll(struct cfgwatch *w)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	for (w->cur = 0; cfgwatch_poll_armed(w, &now) < 0; w->cur++) {
+		fprintf(stderr, "%s: unreadable (fault at %p), no longer watched\n", w->fn[w->cur].name,
+			memfault_addr);
+		w->fn[w->cur].dead = 1;
+	}
+	w->polls++;
+}
+
+static inline void cfgwatch_print(FILE *fp, const struct cfgwatch *w, const struct cfgdiff *d)
+{
+	const struct cfgwatch_fn	*f = &w->fn[d->fn];
+	const char			*what = NULL;
+	char				ts[32], where[48];
+	unsigned			start = 0;
+	struct tm			tm;
+
+	localtime_r(&d->t.tv_sec, &tm);
+	strftime(ts, sizeof(ts), w->json ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %H:%M:%S", &tm);
+	if (d->reg < 0x40)
+		what = ((cfg_read8(f->snap, CFG_HEADER_TYPE) & 0x7f) == 1 ? cfgwatch_hdr1 : cfgwatch_hdr0)[d->reg >> 2];
+	else if ((what = pcicap_name_at(f->snap, f->nblocks * CFGW_BLOCK, d->reg, &start)) != NULL) {
+		snprintf(where, sizeof(where), "%s+%#x", what, d->reg - start);
+		what = where;
+	}
+	if (w->json)
+		fprintf(fp, "{ \"time\": \"%s.%06ld\", \"bdf\": \"%s\", \"reg\": \"0x%03x\", \"where\": \"%s\", "
+			"\"old\": \"0x%08x\", \"new\": \"0x%08x\" }\n", ts, d->t.tv_nsec / 1000, f->name, d->reg,
+			what ? what : "", d->old, d->new);
+	else
+		fprintf(fp, "%s.%06ld %s %03x %-24s %08x -> %08x\n", ts, d->t.tv_nsec / 1000, f->name, d->reg,
+			what ? what : "-", d->old, d->new);
+}
+
+/*
+ * Print the diffs recorded since the last call.
+ */
+static inline void cfgwatch_flush(FILE *fp, struct cfgwatch *w)
+{
+	if (w->head - w->shown > CFGW_RING) {
+		fprintf(stderr, "       %llu diffs dropped, more than %d in one poll.\n",
+			(unsigned long long)(w->head - w->shown - CFGW_RING), CFGW_RING);
+		w->shown = w->head - CFGW_RING;
+	}
+	for (; w->shown < w->head; w->shown++)
+		cfgwatch_print(fp, w, &w->ring[w->shown % CFGW_RING]);
+	fflush(fp);
+}
+
+/*
+ * Print everything still in the ring.
+ */
+static inline void cfgwatch_history(FILE *fp, const struct cfgwatch *w)
+{
+	uint64_t	i = w->head > CFGW_RING ? w->head - CFGW_RING : 0;
+
+	fprintf(fp, "       Last %llu of %llu diffs:\n", (unsigned long long)(w->head - i), (unsigned long long)w->head);
+	for (; i < w->head; i++)
+		cfgwatch_print(fp, w, &w->ring[i % CFGW_RING]);
+	fflush(fp);
+}
+
+static inline void cfgwatch_signal(int sig)
+{
+	if (sig == SIGUSR1)
+		cfgwatch_dump = 1;
+	else
+		cfgwatch_stop = 1;
+}
+
+static inline double cfgwatch_secs(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/*
+ * Poll every period seconds, count times (0 for until SIGINT/SIGTERM),
+ * printing diffs to fp as they are found.
+ */
+static inline void cfgwatch_run(struct cfgwatch *w, FILE *fp, double period, unsigned long count)
+{
+	struct sigaction	sa;
+	struct timespec		c0, c1, t0, next, now;
+	double			cpu, wait;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cfgwatch_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	fprintf(stderr, "       Watching %zu functions, %lu blocks of %d bytes, every %g s.\n", w->n, w->blocks,
+		CFGW_BLOCK, period);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	next = t0;
+	while (!cfgwatch_stop) {
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c0);
+		cfgwatch_poll(w);
+		cfgwatch_flush(fp, w);
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &c1);
+		cpu = cfgwatch_secs(&c0, &c1);
+		w->cpu += cpu;
+		if (count && w->polls >= count)
+			break;
+
+		wait = period;
+		if (wait < cpu * (1 - CFGW_MAXCPU) / CFGW_MAXCPU) {
+			wait = cpu * (1 - CFGW_MAXCPU) / CFGW_MAXCPU;
+			w->stretched++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (cfgwatch_secs(&now, &next) < -wait)
+			next = now;
+		next.tv_sec += (time_t)wait;
+		next.tv_nsec += (long)((wait - (time_t)wait) * 1e9);
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		/*
+		 * A SIGUSR1 that came during the poll is seen here, one during
+		 * the sleep cuts it short and is seen on the way round.
+		 */
+		do {
+			if (cfgwatch_dump) {
+				cfgwatch_dump = 0;
+				cfgwatch_history(stderr, w);
+			}
+		} while (!cfgwatch_stop && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "       %lu polls, %llu diffs, %.1f us CPU per poll, %.3f%% of a core over %.1f s",
+		w->polls, (unsigned long long)w->head, w->polls ? w->cpu / w->polls * 1e6 : 0.0,
+		100 * w->cpu / cfgwatch_secs(&t0, &now), cfgwatch_secs(&t0, &now));
+	if (w->stretched)
+		fprintf(stderr, "; the period stretched %lu times to stay under %g%%", w->stretched, 100 * CFGW_MAXCPU);
+	fprintf(stderr, ".\n");
+}
+
+static inline void cfgwatch_free(struct cfgwatch *w)
+{
+	size_t	i;
+
+	for (i = 0; i < w->n; i++)
+		if (w->fn[i].fd >= 0)
+			close(w->fn[i].fd);
+	free(w->fn);
+	w->fn = NULL;
+	w->n = w->cap = 0;
+}
+
+#endif /* CFGWATCH_H */
@@ -0,0 +1,319 @@
+/*
+ * dumpfile.h - One-file container for memory and ROM dumps.
+ *
+ * Layout, written front to back in one sequential stream:
+ *
+ *	header		one page: magic, version, page size, tool, host, time
+ *	payload		each extent's bytes, placed so that the file offset and
+ *			the physical address agree modulo the page size
+ *	extent table	struct dump_extent[n]: address, length, file offset,
+ *			source, flags, label
+ *	trailer		where the table is and how many entries it has
+ *
+ * Putting the table at the end is what lets a writer stream extents it
+ * only learns about as it goes.  A reader mmap(2)s the file, finds the
+ * trailer in the last bytes, and gets zero-copy access to every extent;
+ * because offsets and addresses share their page offset, any page-aligned
+ * physical range inside an extent can be mapped straight from the file.
+ *
+ * A writer given an outpipe (outpipe.h) queues its writes there instead of
+ * blocking in write(2); the pipe closes the file once it is all written.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef DUMPFILE_H
+#define DUMPFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "outpipe.h"
+
+#define DUMP_MAGIC		"PCIDUMP1"
+#define DUMP_TRAILER_MAGIC	"PCIDTAIL"
+#define DUMP_VERSION		1
+#define DUMP_HEADER_SIZE	4096
+
+/* where the bytes came from */
+#define DUMP_SRC_DEVMEM		1	/* /dev/mem */
+#define DUMP_SRC_ROM		2	/* a validated option ROM */
+#define DUMP_SRC_BAR		3	/* a sysfs resourceN mapping */
+#define DUMP_SRC_FILE		4	/* another image */
+
+/* extent flags */
+#define DUMP_F_ZEROFILL		0x01	/* unreadable pages were zero-filled */
+#define DUMP_F_SHORT		0x02	/* fewer bytes than were asked for */
+
+struct dump_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	pagesize;
+	int64_t		created;
+	char		tool[32];
+	char		host[64];
+};
+
+struct dump_extent {
+	uint64_t	addr;
+	uint64_t	len;
+	uint64_t	offset;		/* in the file */
+	uint32_t	source;
+	uint32_t	flags;
+	char		label[32];
+};
+
+struct dump_trailer {
+	char		magic[8];
+	uint64_t	table;		/* file offset of the extent table */
+	uint64_t	nextents;
+};
+
+struct dumpw {
+	int			fd;
+	struct outpipe		*pipe;		/* or NULL, write(2) */
+	uint64_t		off;
+	unsigned long		pagesize;
+	struct dump_extent	*ext;
+	size_t			n;
+	size_t			cap;
+};
+
+struct dumpr {
+	unsigned char			*map;
+	size_t				len;
+	const struct dump_header	*hdr;
+	const struct dump_extent	*ext;
+	size_t				n;
+};
+
+static inline int dump_write_all(int fd, const void *p, size_t len)
+{
+	const char	*c = p;
+	ssize_t		k;
+
+	while (len > 0) {
+		if ((k = write(fd, c, len)) <= 0) {
+			perror("write(2)");
+			return -1;
+		}
+		c += k;
+		len -= k;
+	}
+	return 0;
+}
+
+/*
+ * Append len bytes at the writer's offset.
+ */
+static inline int dumpw_emit(struct dumpw *w, const void *p, size_t len)
+{
+	if (w->pipe)
+		outpipe_write(w->pipe, w->fd, w->off, p, len, 0);
+	else if (dump_write_all(w->fd, p, len) < 0)
+		return -1;
+	w->off += len;
+	return 0;
+}
+
+static inline int dump_pad(struct dumpw *w, uint64_t to)
+{
+	static const char	zero[4096];
+	size_t			k;
+
+	while (w->off < to) {
+		k = to - w->off < sizeof(zero) ? to - w->off : sizeof(zero);
+		if (dumpw_emit(w, zero, k) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Start a container at path and write its header, through pipe if it is
+ * not NULL.
+ */
+static inline int dumpw_open(struct dumpw *w, const char *path, const char *tool, struct outpipe *pipe)
+{
+	struct dump_header	h;
+
+	memset(w, 0, sizeof(*w));
+	w->pipe = pipe;
+	w->pagesize = getpagesize();
+	if ((w->fd = open(path, O_CREAT|O_WRONLY|O_TRUNC, 0644)) < 0) {
+		perror("open(2)");
+		return -1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, DUMP_MAGIC, 8);
+	h.version = DUMP_VERSION;
+	h.pagesize = w->pagesize;
+	h.created = time(NULL);
+	snprintf(h.tool, sizeof(h.tool), "%s", tool);
+	if (gethostname(h.host, sizeof(h.host) - 1) < 0)
+		strcpy(h.host, "unknown");
+	if (dumpw_emit(w, &h, sizeof(h)) < 0)
+		return -1;
+	return dump_pad(w, DUMP_HEADER_SIZE);
+}
+
+/*
+ * Append len bytes seen at physical address addr.
+ */
+static inline int dumpw_add(struct dumpw *w, uint64_t addr, const void *p, size_t len,
+		     uint32_t source, uint32_t flags, const char *label)
+{
+	struct dump_extent	*e, *v;
+	uint64_t		start;
+
+	if (w->n == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 64;
+		if ((v = realloc(w->ext, w->cap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			return -1;
+		}
+		w->ext = v;
+	}
+
+	/* next page boundary, then on to addr's offset within its page */
+	start = (w->off + w->pagesize - 1) & ~(uint64_t)(w->pagesize - 1);
+	start += addr & (w->pagesize - 1);
+	if (dump_pad(w, start) < 0 || dumpw_emit(w, p, len) < 0)
+		return -1;
+
+	e = &w->ext[w->n++];
+	memset(e, 0, sizeof(*e));
+	e->addr = addr;
+	e->len = len;
+	e->offset = start;
+	e->source = source;
+	e->flags = flags;
+	if (label)
+		memcpy(e->label, label, strnlen(label, sizeof(e->label) - 1));
+	return 0;
+}
+
+/*
+ * Write the extent table and trailer.  No fsync(2); callers that want the
+ * container durable sync it themselves, once (outpipe_finish() does).
+ */
+static inline int dumpw_close(struct dumpw *w)
+{
+	struct dump_trailer	t;
+	int			error = 0;
+
+	memset(&t, 0, sizeof(t));
+	memcpy(t.magic, DUMP_TRAILER_MAGIC, 8);
+	if (dump_pad(w, (w->off + 7) & ~(uint64_t)7) < 0)
+		error = -1;
+	t.table = w->off;
+	t.nextents = w->n;
+	if (!error && dumpw_emit(w, w->ext, w->n * sizeof(*w->ext)) < 0)
+		error = -1;
+	if (w->pipe) {
+		outpipe_write(w->pipe, w->fd, w->off, &t, sizeof(t), 1);
+	} else if (!error && dump_write_all(w->fd, &t, sizeof(t)) < 0) {
+		error = -1;
+	}
+	if (!w->pipe && close(w->fd) < 0) {
+		perror("close(2)");
+		error = -1;
+	}
+	free(w->ext);
+	w->ext = NULL;
+	return error;
+}
+
+/*
+ * Is the open file fd a container?  Leaves the file offset alone.
+ */
+static inline int dump_is_container(int fd)
+{
+	char	magic[8];
+
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	       memcmp(magic, DUMP_MAGIC, 8) == 0;
+}
+
+/*
+ * Map a container read-only and check its table.
+ */
+static inline int dumpr_open(struct dumpr *r, const char *path)
+{
+	const struct dump_trailer	*t;
+	struct stat			sb;
+	size_t				i;
+	int				fd;
+
+	memset(r, 0, sizeof(*r));
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("open(2)");
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0) {
+		perror("fstat(2)");
+		close(fd);
+		return -1;
+	}
+	r->len = sb.st_size;
+	if (r->len < DUMP_HEADER_SIZE + sizeof(*t)) {
+		fprintf(stderr, "%s: not a dump container\n", path);
+		close(fd);
+		return -1;
+	}
+	if ((r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("mmap(2)");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	r->hdr = (const struct dump_header *)r->map;
+	t = (const struct dump_trailer *)(r->map + r->len - sizeof(*t));
+	if (memcmp(r->hdr->magic, DUMP_MAGIC, 8) != 0 || memcmp(t->magic, DUMP_TRAILER_MAGIC, 8) != 0 ||
+	    r->hdr->pagesize == 0 || (r->hdr->pagesize & (r->hdr->pagesize - 1)) != 0 ||
+	    t->table > r->len - sizeof(*t) ||
+	    t->nextents > (r->len - sizeof(*t) - t->table) / sizeof(struct dump_extent))
+		goto bad;
+	r->ext = (const struct dump_extent *)(r->map + t->table);
+	r->n = t->nextents;
+	for (i = 0; i < r->n; i++)
+		if (r->ext[i].offset > t->table || r->ext[i].len > t->table - r->ext[i].offset ||
+		    (r->ext[i].offset - r->ext[i].addr) % r->hdr->pagesize != 0)
+			goto bad;
+	return 0;
+bad:
+	fprintf(stderr, "%s: not a dump container, or a damaged one\n", path);
+	munmap(r->map, r->len);
+	memset(r, 0, sizeof(*r));
+	return -1;
+}
+
+/*
+ * The extent holding physical address addr, or NULL.
+ */
+static inline const struct dump_extent *dumpr_find(const struct dumpr *r, uint64_t addr)
+{
+	size_t	i;
+
+	for (i = 0; i < r->n; i++)
+		if (addr >= r->ext[i].addr && addr - r->ext[i].addr < r->ext[i].len)
+			return &r->ext[i];
+	return NULL;
+}
+
+static inline void dumpr_close(struct dumpr *r)
+{
+	if (r->map)
+		munmap(r->map, r->len);
+	memset(r, 0, sizeof(*r));
+}
+
+#endif /* DUMPFILE_H */
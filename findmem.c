@@ -1,12 +1,79 @@
-/* 
+/*
  * findmem(1)
  * - Rewritten to use mmap(2) instead of read(2), lseek(2), write(2)
  * - syncs PAGE_SIZE at a time
- * - Patch kernel to fix x86/mm/pat.c bug that breaks /dev/mem 
+ * - Patch kernel to fix x86/mm/pat.c bug that breaks /dev/mem
  *   (TODO: Get linux lkml to patch this and commit)
  * - Disable your kernel's STRICT_DEVMEM setting.
+ * - Multi-needle search: every -N needle (8/16/32/64-bit) and the packed
+ *   -0..-f needle are compiled into one Aho-Corasick automaton and matched
+ *   in a single pass.  Every hit is reported, not just the first.
+ * - Streams any size range through a fixed -W window of mappings, so memory
+ *   use stays bounded however large -L is.  Each window also maps the
+ *   needle-length overlap after it, so straddling needles are not lost.
+ * - -j N scans windows on N threads (-P pins them to CPUs); hits are merged
+ *   back into address order before they are printed.
+ * - SIGBUS/SIGSEGV on an unreadable page no longer kills the scan: the page
+ *   goes into the -S skip map and the scan carries on past it.  Pages
+ *   already in the skip map file are never touched.
+ * - -R /proc/iomem (or /sys/firmware/memmap, or a saved copy of either)
+ *   plans the scan: only the -T types (default ram,rom) inside -A/-L are
+ *   mapped, so holes and MMIO windows are never touched.
+ * - -p patterns: masked byte patterns with wildcards and alignment, e.g.
+ *	findmem -F /dev/mem -p "@512 55 AA ?? ?? ??{20} 'PCIR'"
+ *   Tokens are separated by blanks:
+ *	hh		exact byte (hex)
+ *	hh/mm		byte compared under mask mm
+ *	h? ?h		nibble wildcards
+ *	??		any byte
+ *	'text'		literal bytes
+ *	tok{n}		repeat the previous token n times
+ *	@n		matches must start on an n-byte aligned address
+ *   Each pattern is found by memchr(3) on its rarest fixed byte and then
+ *   verified a word at a time under the mask.
+ * - --align N (-g N): -N needles only match at N-byte aligned addresses.
+ *   Needles of up to 8 bytes are compared a vector of aligned words at a
+ *   time (AVX2 or SSE4.2 picked at run time by CPUID, scalar otherwise);
+ *   the packed -0..-f needle keeps the automaton and is filtered.
+ * - -I lo-hi (or lo+len, or @file of those): reverse pointer search.  Every
+ *   32/64-bit word (-w 32,64) that points into any target interval is
+ *   reported as: <referrer> -> <target> <width>.  Words are taken at their
+ *   natural alignment unless --align says otherwise.  A vector range
+ *   compare against the hull of all targets rejects most words, the rest
+ *   are looked up in the sorted interval list.
+ * - -H K: value histogram.  Counts every aligned dword, and every aligned
+ *   16-bit value that could be a vendor ID (not 0x0000/0xffff), plus how
+ *   many pages each appears in.  Each thread keeps bounded hash tables
+ *   (Misra-Gries: when full, every count drops by the smallest one, so
+ *   anything frequent survives); they are merged and the top K of each
+ *   are printed as CSV or JSON (-O csv|json).  Banners go to stderr.
+ * - -X index: a pageindex(1) file.  Hits are not looked for in pages that
+ *   cannot start one: all-zero pages unless something can start with 00,
+ *   all-0xff pages unless something can start with ff, and pages that
+ *   faulted.  -K zero,ff,rom,text,entropy,bad names the classes to skip
+ *   instead, for when you know better.  Bytes of skipped pages are still
+ *   read as the tail of a hit that starts before them.
+ * - -F also takes a dump container (see dumpfile.h) written by pcireadrom,
+ *   pcifindrom or pcimmap-ex -D.  Only its extents are scanned, each mapped
+ *   straight from the file, and hits keep their physical addresses.
+ *   Without -L the whole container is scanned.
+ * - -M rom ...: find copies of known ROM images even where firmware patched
+ *   them on the way into shadow RAM.  Each ROM is cut into content-defined
+ *   chunks (a Gear rolling hash over the last 64 bytes picks the cut
+ *   points, so a patch only disturbs the chunks around it), and the scan
+ *   cuts memory the same way in one linear pass.  Chunks found vote for
+ *   the address the ROM would start at; each address with votes is then
+ *   compared byte for byte and reported with its coverage and the number
+ *   of patched ranges, as CSV or JSON (-O csv|json).
  *
  * Usage: findmem -F /dev/mem -0 word1 -1 word2 -2 word3 -3 word4 -4 word5
+ *        findmem -F /dev/mem -N 0xaa55:16 -N 0x52494350 -N 0x8086:16 ...
+ *
+ * Hits are printed one per line as: <address> <needle-id>
+ * Needle 0 is the packed -0..-f needle (if given), -N needles follow in
+ * command line order, then -p patterns.
+ *
+ * Build: cc -O2 -o findmem findmem.c -lpthread
  *
  * -JS 2016
  */
@@ -14,46 +81,2020 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
 #include <string.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "memfault.h"
+#include "iomem.h"
+#include "pageindex.h"
+#include "dumpfile.h"
+#include "xxh64.h"
 
 #define PAGE_SIZE	 getpagesize()
 #define ROUND_PAGE(x)    ((void *)(((unsigned long)(x)) & ~((unsigned long)(PAGE_SIZE - 1))))
 
+#define DEFAULT_WINDOW	(16UL << 20)
+
+#define MAX_JOBS	1024
+#define CHUNKS_PER_JOB	4	/* windows in flight per worker */
+
+#define MAX_NEEDLES	256
+#define MAX_NEEDLE_LEN	(16 * sizeof(unsigned int))
+
+#define MAX_PATTERNS	64
+#define MAX_PATTERN_LEN	4096
+
+/*
+ * One independent needle.  Values are matched in memory (little endian)
+ * byte order, bits is the needle width (8, 16, 32, 64).
+ */
+struct needle {
+	unsigned char	bytes[MAX_NEEDLE_LEN];
+	int		len;
+	int		bits;
+	unsigned long	value;
+	int		strided;	/* matched by the --align kernel */
+};
+
+/*
+ * A compiled -p pattern.  bytes[] is already masked; anchor is the offset
+ * of the rarest fully fixed byte (-1 if every byte is partly wild).
+ */
+struct pattern {
+	unsigned char	bytes[MAX_PATTERN_LEN];
+	unsigned char	mask[MAX_PATTERN_LEN];
+	int		len;
+	int		anchor;
+	unsigned long	align;
+	char		*text;
+};
+
+/*
+ * Hits found in one window, kept until the window's turn to be printed.
+ */
+struct hit {
+	unsigned long	addr;
+	int		id;		/* -1 for a pointer hit */
+	int		width;		/* pointer width, bits */
+	unsigned long	target;		/* pointer value */
+};
+
+struct hitbuf {
+	struct hit	*v;
+	size_t		n;
+	size_t		cap;
+	int		done;
+	int		error;
+};
+
+/*
+ * One unit of work: own hits starting in [ws, we), read up to hi.  The
+ * bytes of address a are at file offset a + off (off is 0 unless -F is a
+ * dump container).
+ */
+struct window {
+	unsigned long	ws;
+	unsigned long	we;
+	unsigned long	hi;
+	unsigned long	off;
+};
+
+/*
+ * Aho-Corasick automaton, fully expanded into a DFA so the scan loop is
+ * one table lookup per byte.  out[s] is the first needle ending in state s
+ * (-1 if none), next[s] is the next state down the suffix chain that also
+ * ends a needle (0 if none).  Identical needles are chained through dup[].
+ */
+struct automaton {
+	unsigned int	(*delta)[256];
+	int		*out;
+	int		*dup;
+	unsigned int	*next;
+	unsigned int	*fail;
+	unsigned int	nstates;
+};
+
 unsigned int	value[16] = { 0 };
 int 		values = 0;
 
+struct needle	needles[MAX_NEEDLES];
+int		nneedles = 0;
+int		nacneedles = 0;
+struct automaton ac;
+struct pattern	patterns[MAX_PATTERNS];
+int		npatterns = 0;
+unsigned long	nhits = 0;
+unsigned long	window = DEFAULT_WINDOW;
+unsigned long	overlap = 0;
+int		jobs = 1;
+int		pflag = 0;
+
+/*
+ * --align: stride between candidate addresses, and the needles the
+ * stride kernel compares there (value and mask in a 64-bit lane).
+ */
+unsigned long	align = 1;
+int		nstrided = 0;
+int		strideid[MAX_NEEDLES];
+unsigned long	strideval[MAX_NEEDLES];
+unsigned long	stridemask[MAX_NEEDLES];
+int		stridewidth = 8;	/* widest strided needle, bytes */
+const char	*stridekind = "scalar";
+size_t		(*stride_kernel)(const unsigned char *, size_t, unsigned long, struct hitbuf *);
+
+int		alignset = 0;
+
+/*
+ * -H value histogram.  A count of 0 marks an empty slot.
+ */
+#define HIST_SLOTS	(1UL << 16)	/* per table, per thread */
+#define HIST_CHUNK	4096		/* bytes counted at a time, <= a page */
+
+struct hentry {
+	unsigned long	count;
+	unsigned long	pages;
+	unsigned long	lastpage;
+	unsigned int	key;
+};
+
+struct htable {
+	struct hentry	*e;
+	unsigned long	cap;
+	unsigned long	n;
+	unsigned long	dropped;	/* total subtracted by pruning */
+};
+
+struct histo {
+	struct htable	dword;
+	struct htable	vendor;
+	unsigned long	bytes;
+};
+
+int		histk = 0;
+int		jsonout = 0;
+struct histo	*histos[MAX_JOBS];
+static __thread struct histo *myhist;
+FILE		*info;
+
+/*
+ * -M fuzzy ROM location.  Cut points are where the top FUZZ_BITS bits of
+ * the Gear hash are zero, so chunks average 1 << FUZZ_BITS bytes.  Only
+ * chunks of FUZZ_MIN..FUZZ_MAX bytes are looked for: shorter ones are too
+ * common to mean anything, longer ones are fill.
+ */
+#define MAX_ROMS	64
+#define FUZZ_BITS	8
+#define FUZZ_MIN	64		/* the Gear window, so the hash covers it all */
+#define FUZZ_MAX	4096
+#define FUZZ_MINCHUNKS	2		/* votes before an address is verified */
+#define FUZZ_MINCOVER	25		/* percent, to be reported */
+
+struct fuzzrom {
+	char		*path;
+	unsigned char	*bytes;
+	size_t		len;
+	unsigned long	nchunks;
+	unsigned long	found;		/* addresses reported */
+};
+
+/*
+ * One indexed chunk.  gear (the hash at its cut) and len pick the slot,
+ * xxh confirms.
+ */
+struct fuzzchunk {
+	uint64_t	gear;
+	uint64_t	xxh;
+	unsigned int	len;
+	unsigned int	off;
+	int		rom;		/* -1 for an empty slot */
+};
+
+/*
+ * Chunks found at one candidate start address of one ROM.
+ */
+struct fuzzvote {
+	unsigned long	base;
+	unsigned long	bytes;
+	unsigned long	chunks;
+	int		rom;
+};
+
+struct fuzzrom	roms[MAX_ROMS];
+int		nroms = 0;
+uint64_t	gear[256];
+struct fuzzchunk *fuzztab;
+unsigned long	fuzzcap;
+unsigned char	fuzzlens[FUZZ_MAX / 8 + 1];	/* bitmap of indexed lengths */
+struct fuzzvote	*votes;
+unsigned long	nvotes, votecap;
+long		lastvote[MAX_ROMS];
+
+/*
+ * -I reverse pointer targets: sorted, merged [lo, hi) intervals, and
+ * their hull [tmin, tmax).
+ */
+struct target {
+	unsigned long	lo;
+	unsigned long	hi;
+};
+
+struct target	*targets = NULL;
+int		ntargets = 0;
+int		targetcap = 0;
+unsigned long	tmin, tmax;
+int		ptrwidths = 0;		/* bytes: 4, 8 or both (12) */
+
+static struct option longopts[] = {
+	{ "align",	required_argument,	NULL,	'g' },
+	{ NULL,		0,			NULL,	0 }
+};
+
+/*
+ * Window scheduler shared by the workers.  Window k lands in
+ * ring[k % nring]; workers may run at most nring windows ahead of the
+ * printer, which bounds the memory held by unprinted hits.
+ */
+int		scanfd;
+struct dumpr	dump;
+struct window	*windows;
+unsigned long	nwindows, nexttake = 0, nextprint = 0;
+struct hitbuf	*ring;
+unsigned long	nring;
+pthread_mutex_t	ringlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	ringcv = PTHREAD_COND_INITIALIZER;
+
+struct skipmap	skip;
+char		*skipfile = NULL;
+
+char		*regionfile = NULL;
+int		regionmask = REGION_DEFAULT;
+
+char		*indexfile = NULL;
+struct pageindex pidx;
+int		skipclasses = -1;	/* -K, -1 until worked out */
+
+/*
+ * Parse "value[:bits]" into a needle.
+ */
+static int needle_parse(struct needle *n, const char *arg)
+{
+	char	*end;
+	int	i;
+
+	n->value = strtoul(arg, &end, 0);
+	n->bits = 32;
+	if (*end == ':')
+		n->bits = strtoul(end + 1, &end, 0);
+	if (*end != '\0' || (n->bits != 8 && n->bits != 16 && n->bits != 32 && n->bits != 64))
+		return -1;
+	if (n->bits < 64 && (n->value >> n->bits) != 0)
+		return -1;
+
+	n->len = n->bits / 8;
+	for (i = 0; i < n->len; i++)
+		n->bytes[i] = (n->value >> (i * 8)) & 0xff;
+	return 0;
+}
+
+/*
+ * Build the goto trie, then fill in failure links breadth first and fold
+ * them into delta so every state has a transition on every byte.
+ */
+static int ac_build(struct automaton *a, struct needle *n, int count)
+{
+	unsigned int	maxstates = 1;
+	unsigned int	*queue;
+	unsigned int	head = 0, tail = 0;
+	unsigned int	s, t;
+	int		i, j, c;
+
+	for (i = 0; i < count; i++)
+		if (!n[i].strided)
+			maxstates += n[i].len;
+
+	a->delta = calloc(maxstates, sizeof(*a->delta));
+	a->out = malloc(maxstates * sizeof(*a->out));
+	a->dup = malloc((count + 1) * sizeof(*a->dup));
+	a->next = calloc(maxstates, sizeof(*a->next));
+	a->fail = calloc(maxstates, sizeof(*a->fail));
+	queue = malloc(maxstates * sizeof(*queue));
+	if (!a->delta || !a->out || !a->dup || !a->next || !a->fail || !queue)
+		return -1;
+
+	for (s = 0; s < maxstates; s++)
+		a->out[s] = -1;
+	a->nstates = 1;
+
+	/*
+	 * State 0 is the root; 0 also means "no transition yet" since nothing
+	 * in the trie points back at the root.
+	 */
+	for (i = 0; i < count; i++) {
+		if (n[i].strided)
+			continue;
+		s = 0;
+		for (j = 0; j < n[i].len; j++) {
+			c = n[i].bytes[j];
+			if (a->delta[s][c] == 0)
+				a->delta[s][c] = a->nstates++;
+			s = a->delta[s][c];
+		}
+		a->dup[i] = a->out[s];
+		a->out[s] = i;
+	}
+
+	for (c = 0; c < 256; c++)
+		if ((t = a->delta[0][c]) != 0)
+			queue[tail++] = t;
+
+	while (head < tail) {
+		s = queue[head++];
+		for (c = 0; c < 256; c++) {
+			t = a->delta[s][c];
+			if (t == 0) {
+				a->delta[s][c] = a->delta[a->fail[s]][c];
+				continue;
+			}
+			a->fail[t] = a->delta[a->fail[s]][c];
+			a->next[t] = a->out[a->fail[t]] >= 0 ? a->fail[t] : a->next[a->fail[t]];
+			queue[tail++] = t;
+		}
+	}
+
+	free(queue);
+	return 0;
+}
+
+static struct hit *hit_push(struct hitbuf *hb)
+{
+	struct hit	*v;
+
+	if (hb->n == hb->cap) {
+		hb->cap = hb->cap ? hb->cap * 2 : 256;
+		if ((v = realloc(hb->v, hb->cap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		hb->v = v;
+	}
+	return &hb->v[hb->n++];
+}
+
+static void report(struct hitbuf *hb, unsigned long addr, int id)
+{
+	struct hit	*h = hit_push(hb);
+
+	h->addr = addr;
+	h->id = id;
+	h->width = 0;
+	h->target = 0;
+}
+
+static void report_ptr(struct hitbuf *hb, unsigned long addr, unsigned long target, int width)
+{
+	struct hit	*h = hit_push(hb);
+
+	h->addr = addr;
+	h->id = -1;
+	h->width = width;
+	h->target = target;
+}
+
+static int hit_cmp(const void *a, const void *b)
+{
+	const struct hit *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+	if (x->id != y->id)
+		return x->id - y->id;
+	return x->width - y->width;
+}
+
+/*
+ * How common a byte value is in memory images, lower is rarer.  Zero and
+ * 0xff fill, small integers and ASCII text dominate; everything else is
+ * about equally rare.
+ */
+static int byte_rank(unsigned char c)
+{
+	if (c == 0x00)
+		return 100;
+	if (c == 0xff)
+		return 90;
+	if (c <= 0x10)
+		return 60;
+	if (c == ' ' || (c >= 'a' && c <= 'z'))
+		return 40;
+	if (c >= 0x20 && c < 0x7f)
+		return 30;
+	if (c >= 0xf0)
+		return 20;
+	return 10;
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Compile a -p pattern.  Returns -1 with a message on a syntax error.
+ */
+static int pattern_parse(struct pattern *pt, char *arg)
+{
+	const char	*p = arg;
+	char		*end;
+	int		last = -1;	/* first byte of the previous token */
+	int		lastlen = 0;
+	int		i, hi, lo, rank, best;
+	unsigned long	n;
+
+	memset(pt, 0, sizeof(*pt));
+	pt->align = 1;
+	pt->text = arg;
+
+	while (*p) {
+		if (*p == ' ' || *p == '\t' || *p == ',') {
+			p++;
+			continue;
+		}
+		if (*p == '@') {
+			pt->align = strtoul(p + 1, &end, 0);
+			if (end == p + 1 || pt->align == 0 || (pt->align & (pt->align - 1))) {
+				fprintf(stderr, "findmem: bad alignment in '%s'\n", arg);
+				return -1;
+			}
+			p = end;
+			continue;
+		}
+		if (*p == '{') {
+			errno = 0;
+			n = strtoul(p + 1, &end, 0);
+			if (last < 0 || errno || end == p + 1 || *end != '}' || n < 1 || n > MAX_PATTERN_LEN ||
+			    (n - 1) * lastlen > (unsigned long)(MAX_PATTERN_LEN - pt->len)) {
+				fprintf(stderr, "findmem: bad repeat in '%s'\n", arg);
+				return -1;
+			}
+			for (i = 1; i < (int)n; i++) {
+				memcpy(&pt->bytes[pt->len], &pt->bytes[last], lastlen);
+				memcpy(&pt->mask[pt->len], &pt->mask[last], lastlen);
+				pt->len += lastlen;
+			}
+			p = end + 1;
+			continue;
+		}
+
+		last = pt->len;
+		if (*p == '\'') {
+			for (p++; *p && *p != '\''; p++) {
+				if (pt->len == MAX_PATTERN_LEN)
+					goto toolong;
+				pt->bytes[pt->len] = *p;
+				pt->mask[pt->len++] = 0xff;
+			}
+			if (*p != '\'') {
+				fprintf(stderr, "findmem: unterminated string in '%s'\n", arg);
+				return -1;
+			}
+			p++;
+			lastlen = pt->len - last;
+			continue;
+		}
+
+		if (pt->len == MAX_PATTERN_LEN)
+			goto toolong;
+		hi = (p[0] == '?') ? -2 : hexval(p[0]);
+		lo = (p[0] && p[1] == '?') ? -2 : (p[0] ? hexval(p[1]) : -1);
+		if (hi == -1 || lo == -1) {
+			fprintf(stderr, "findmem: bad token at '%s'\n", p);
+			return -1;
+		}
+		pt->bytes[pt->len] = ((hi < 0 ? 0 : hi) << 4) | (lo < 0 ? 0 : lo);
+		pt->mask[pt->len] = (hi < 0 ? 0 : 0xf0) | (lo < 0 ? 0 : 0x0f);
+		p += 2;
+		if (*p == '/') {
+			if ((hi = hexval(p[1])) < 0 || (lo = hexval(p[2])) < 0) {
+				fprintf(stderr, "findmem: bad mask at '%s'\n", p);
+				return -1;
+			}
+			pt->mask[pt->len] &= (hi << 4) | lo;
+			p += 3;
+		}
+		pt->bytes[pt->len] &= pt->mask[pt->len];
+		pt->len++;
+		lastlen = 1;
+	}
+
+	if (pt->len == 0) {
+		fprintf(stderr, "findmem: empty pattern '%s'\n", arg);
+		return -1;
+	}
+
+	/*
+	 * Anchor on the rarest fully fixed byte; on a tie prefer the later
+	 * one, which fails verification sooner on text and fill.
+	 */
+	pt->anchor = -1;
+	best = 1 << 30;
+	for (i = 0; i < pt->len; i++) {
+		if (pt->mask[i] != 0xff)
+			continue;
+		rank = byte_rank(pt->bytes[i]);
+		if (rank <= best) {
+			best = rank;
+			pt->anchor = i;
+		}
+	}
+	return 0;
+
+toolong:
+	fprintf(stderr, "findmem: pattern longer than %d bytes\n", MAX_PATTERN_LEN);
+	return -1;
+}
+
+/*
+ * Masked compare of a candidate, eight bytes at a time.
+ */
+static int pattern_verify(const struct pattern *pt, const unsigned char *buf)
+{
+	unsigned long	x, v, m;
+	int		i;
+
+	for (i = 0; i + 8 <= pt->len; i += 8) {
+		memcpy(&x, buf + i, 8);
+		memcpy(&v, pt->bytes + i, 8);
+		memcpy(&m, pt->mask + i, 8);
+		if ((x & m) != v)
+			return 0;
+	}
+	for (; i < pt->len; i++)
+		if ((buf[i] & pt->mask[i]) != pt->bytes[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Find pattern id in len bytes at buf (address base), reporting matches
+ * that start in the first own bytes.
+ */
+static void pattern_scan(const struct pattern *pt, int id, const unsigned char *buf,
+			 size_t len, size_t own, unsigned long base, struct hitbuf *hb)
+{
+	const unsigned char	*p, *end;
+	size_t			start, last;
+
+	if (len < (size_t)pt->len)
+		return;
+	last = len - pt->len;		/* last start that fits */
+	if (last >= own)
+		last = own - 1;
+
+	if (pt->anchor < 0) {
+		for (start = (pt->align - (base & (pt->align - 1))) & (pt->align - 1);
+		     start <= last; start += pt->align)
+			if (pattern_verify(pt, buf + start))
+				report(hb, base + start, id);
+		return;
+	}
+
+	p = buf + pt->anchor;
+	end = buf + last + pt->anchor + 1;
+	while (p < end && (p = memchr(p, pt->bytes[pt->anchor], end - p)) != NULL) {
+		start = p - buf - pt->anchor;
+		if (((base + start) & (pt->align - 1)) == 0 && pattern_verify(pt, buf + start))
+			report(hb, base + start, id);
+		p++;
+	}
+}
+
+/*
+ * Run the automaton over len bytes at buf, the address of buf[0] being
+ * base.  Only hits starting in the first own bytes are reported; the rest
+ * of buf is the overlap into the next window, whose hits belong there.
+ */
+static void ac_scan(struct automaton *a, const unsigned char *buf, size_t len,
+		    size_t own, unsigned long base, struct hitbuf *hb)
+{
+	unsigned int	s = 0;
+	unsigned int	t;
+	size_t		i, start;
+	int		id;
+
+	for (i = 0; i < len; i++) {
+		s = a->delta[s][buf[i]];
+		if (a->out[s] < 0 && a->next[s] == 0)
+			continue;
+		for (t = a->out[s] >= 0 ? s : a->next[s]; t != 0; t = a->next[t])
+			for (id = a->out[t]; id >= 0; id = a->dup[id]) {
+				start = i + 1 - needles[id].len;
+				if (start < own && ((base + start) & (align - 1)) == 0)
+					report(hb, base + start, id);
+			}
+	}
+}
+
+/*
+ * --align kernels.  Each one compares nlanes aligned lanes starting at
+ * buf (address base, already aligned) against every strided needle, and
+ * returns how many lanes it did; the scalar loop finishes the rest.
+ */
+static void stride_lane(const unsigned char *p, unsigned long addr, size_t avail,
+			struct hitbuf *hb)
+{
+	unsigned long	x = 0;
+	int		j;
+
+	memcpy(&x, p, avail < 8 ? avail : 8);
+	for (j = 0; j < nstrided; j++)
+		if ((x & stridemask[j]) == strideval[j] &&
+		    (size_t)needles[strideid[j]].len <= avail)
+			report(hb, addr, strideid[j]);
+}
+
+static size_t stride_scalar(const unsigned char *buf, size_t nlanes, unsigned long base,
+			    struct hitbuf *hb)
+{
+	(void)buf; (void)nlanes; (void)base; (void)hb;
+	return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t stride_avx2_32(const unsigned char *buf, size_t nlanes, unsigned long base,
+			     struct hitbuf *hb)
+{
+	__m256i		v, c, m[MAX_NEEDLES], val[MAX_NEEDLES];
+	unsigned	bits;
+	size_t		i;
+	int		j;
+
+	for (j = 0; j < nstrided; j++) {
+		m[j] = _mm256_set1_epi32((int)stridemask[j]);
+		val[j] = _mm256_set1_epi32((int)strideval[j]);
+	}
+	for (i = 0; i + 8 <= nlanes; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i * 4));
+		for (j = 0; j < nstrided; j++) {
+			c = _mm256_cmpeq_epi32(_mm256_and_si256(v, m[j]), val[j]);
+			bits = _mm256_movemask_ps(_mm256_castsi256_ps(c));
+			for (; bits; bits &= bits - 1)
+				report(hb, base + (i + __builtin_ctz(bits)) * 4, strideid[j]);
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t stride_avx2_64(const unsigned char *buf, size_t nlanes, unsigned long base,
+			     struct hitbuf *hb)
+{
+	__m256i		v, c, m[MAX_NEEDLES], val[MAX_NEEDLES];
+	unsigned	bits;
+	size_t		i;
+	int		j;
+
+	for (j = 0; j < nstrided; j++) {
+		m[j] = _mm256_set1_epi64x((long long)stridemask[j]);
+		val[j] = _mm256_set1_epi64x((long long)strideval[j]);
+	}
+	for (i = 0; i + 4 <= nlanes; i += 4) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i * 8));
+		for (j = 0; j < nstrided; j++) {
+			c = _mm256_cmpeq_epi64(_mm256_and_si256(v, m[j]), val[j]);
+			bits = _mm256_movemask_pd(_mm256_castsi256_pd(c));
+			for (; bits; bits &= bits - 1)
+				report(hb, base + (i + __builtin_ctz(bits)) * 8, strideid[j]);
+		}
+	}
+	return i;
+}
+
+__attribute__((target("sse4.2")))
+static size_t stride_sse42_32(const unsigned char *buf, size_t nlanes, unsigned long base,
+			      struct hitbuf *hb)
+{
+	__m128i		v, c, m[MAX_NEEDLES], val[MAX_NEEDLES];
+	unsigned	bits;
+	size_t		i;
+	int		j;
+
+	for (j = 0; j < nstrided; j++) {
+		m[j] = _mm_set1_epi32((int)stridemask[j]);
+		val[j] = _mm_set1_epi32((int)strideval[j]);
+	}
+	for (i = 0; i + 4 <= nlanes; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i * 4));
+		for (j = 0; j < nstrided; j++) {
+			c = _mm_cmpeq_epi32(_mm_and_si128(v, m[j]), val[j]);
+			bits = _mm_movemask_ps(_mm_castsi128_ps(c));
+			for (; bits; bits &= bits - 1)
+				report(hb, base + (i + __builtin_ctz(bits)) * 4, strideid[j]);
+		}
+	}
+	return i;
+}
+
+__attribute__((target("sse4.2")))
+static size_t stride_sse42_64(const unsigned char *buf, size_t nlanes, unsigned long base,
+			      struct hitbuf *hb)
+{
+	__m128i		v, c, m[MAX_NEEDLES], val[MAX_NEEDLES];
+	unsigned	bits;
+	size_t		i;
+	int		j;
+
+	for (j = 0; j < nstrided; j++) {
+		m[j] = _mm_set1_epi64x((long long)stridemask[j]);
+		val[j] = _mm_set1_epi64x((long long)strideval[j]);
+	}
+	for (i = 0; i + 2 <= nlanes; i += 2) {
+		v = _mm_loadu_si128((const __m128i *)(buf + i * 8));
+		for (j = 0; j < nstrided; j++) {
+			c = _mm_cmpeq_epi64(_mm_and_si128(v, m[j]), val[j]);
+			bits = _mm_movemask_pd(_mm_castsi128_pd(c));
+			for (; bits; bits &= bits - 1)
+				report(hb, base + (i + __builtin_ctz(bits)) * 8, strideid[j]);
+		}
+	}
+	return i;
+}
+#endif
+
+/*
+ * Pick a kernel for the stride and the widest needle: lanes of 4 bytes
+ * when every needle fits a dword and the stride is 4, lanes of 8 when the
+ * stride is 8.  Anything else is the scalar loop.
+ */
+static void stride_select(void)
+{
+	stride_kernel = stride_scalar;
+	stridekind = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (align == 4 && stridewidth <= 4) {
+		if (__builtin_cpu_supports("avx2")) {
+			stride_kernel = stride_avx2_32;
+			stridekind = "avx2 8x32";
+		} else if (__builtin_cpu_supports("sse4.2")) {
+			stride_kernel = stride_sse42_32;
+			stridekind = "sse4.2 4x32";
+		}
+	} else if (align == 8) {
+		if (__builtin_cpu_supports("avx2")) {
+			stride_kernel = stride_avx2_64;
+			stridekind = "avx2 4x64";
+		} else if (__builtin_cpu_supports("sse4.2")) {
+			stride_kernel = stride_sse42_64;
+			stridekind = "sse4.2 2x64";
+		}
+	}
+#endif
+}
+
+/*
+ * Compare the strided needles at every aligned start in the first own
+ * bytes.  Vector lanes must lie wholly inside the run; lanes at the tail
+ * are done one at a time with whatever bytes are left.
+ */
+static void stride_scan(const unsigned char *buf, size_t len, size_t own,
+			unsigned long base, struct hitbuf *hb)
+{
+	size_t	first, start, nlanes, lane;
+
+	first = (align - (base & (align - 1))) & (align - 1);
+	if (first >= own || first >= len)
+		return;
+
+	lane = align < 8 ? align : 8;
+	nlanes = 0;
+	if (stride_kernel != stride_scalar && len - first >= lane) {
+		nlanes = (len - first - lane) / align + 1;
+		if (nlanes > (own - first + align - 1) / align)
+			nlanes = (own - first + align - 1) / align;
+		nlanes = stride_kernel(buf + first, nlanes, base + first, hb);
+	}
+
+	for (start = first + nlanes * align; start < own && start < len; start += align)
+		stride_lane(buf + start, base + start, len - start, hb);
+}
+
+/*
+ * Parse one -I target, "lo-hi" (inclusive), "lo+len" or "lo".
+ */
+static int target_parse(const char *arg)
+{
+	unsigned long	lo, hi;
+	char		*end;
+	struct target	*v;
+
+	lo = strtoul(arg, &end, 0);
+	if (end == arg)
+		return -1;
+	if (*end == '-')
+		hi = strtoul(end + 1, &end, 0) + 1;
+	else if (*end == '+')
+		hi = lo + strtoul(end + 1, &end, 0);
+	else
+		hi = lo + 1;
+	while (*end == ' ' || *end == '\t' || *end == '\n')
+		end++;
+	if (*end != '\0' || hi <= lo)
+		return -1;
+
+	if (ntargets == targetcap) {
+		targetcap = targetcap ? targetcap * 2 : 64;
+		if ((v = realloc(targets, targetcap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		targets = v;
+	}
+	targets[ntargets].lo = lo;
+	targets[ntargets].hi = hi;
+	ntargets++;
+	return 0;
+}
+
+/*
+ * -I @file: one target per line, '#' comments.
+ */
+static int target_load(const char *filename)
+{
+	FILE	*fp;
+	char	line[256];
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		perror("fopen(3)");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (target_parse(line) < 0) {
+			fprintf(stderr, "findmem: bad target '%s' in %s\n", line, filename);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+static int target_cmp(const void *a, const void *b)
+{
+	const struct target *x = a, *y = b;
+
+	if (x->lo != y->lo)
+		return x->lo < y->lo ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort and merge overlapping targets so lookups are one binary search.
+ */
+static void target_merge(void)
+{
+	int	i, j;
+
+	qsort(targets, ntargets, sizeof(*targets), target_cmp);
+	for (i = 0, j = 0; i < ntargets; i++) {
+		if (j && targets[i].lo <= targets[j - 1].hi) {
+			if (targets[i].hi > targets[j - 1].hi)
+				targets[j - 1].hi = targets[i].hi;
+			continue;
+		}
+		targets[j++] = targets[i];
+	}
+	ntargets = j;
+	tmin = targets[0].lo;
+	tmax = targets[ntargets - 1].hi;
+}
+
+static int target_hit(unsigned long x)
+{
+	int	lo = 0, hi = ntargets, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (targets[mid].hi <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < ntargets && targets[lo].lo <= x;
+}
+
+static void ptr_lane(const unsigned char *p, unsigned long addr, int w, struct hitbuf *hb)
+{
+	unsigned long	x = 0;
+
+	memcpy(&x, p, w);
+	if (x - tmin < tmax - tmin && target_hit(x))
+		report_ptr(hb, addr, x, w * 8);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Vector hull checks: a lane survives if lane - tmin < tmax - tmin,
+ * unsigned, done as a signed compare with the sign bits flipped.
+ * Returns the lanes done.
+ */
+__attribute__((target("avx2")))
+static size_t ptr_avx2_32(const unsigned char *buf, size_t nlanes, unsigned long base,
+			  struct hitbuf *hb)
+{
+	unsigned long	span = tmax - tmin;
+	__m256i		lo, sp, flip, v, d;
+	unsigned	bits;
+	size_t		i;
+	int		b;
+
+	if (span > 0xffffffffUL)
+		span = 0xffffffffUL;
+	lo = _mm256_set1_epi32((int)tmin);
+	flip = _mm256_set1_epi32((int)0x80000000);
+	sp = _mm256_xor_si256(_mm256_set1_epi32((int)span), flip);
+
+	for (i = 0; i + 8 <= nlanes; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i * 4));
+		d = _mm256_xor_si256(_mm256_sub_epi32(v, lo), flip);
+		bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sp, d)));
+		for (; bits; bits &= bits - 1) {
+			b = __builtin_ctz(bits);
+			ptr_lane(buf + (i + b) * 4, base + (i + b) * 4, 4, hb);
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t ptr_avx2_64(const unsigned char *buf, size_t nlanes, unsigned long base,
+			  struct hitbuf *hb)
+{
+	__m256i		lo, sp, flip, v, d;
+	unsigned	bits;
+	size_t		i;
+	int		b;
+
+	lo = _mm256_set1_epi64x((long long)tmin);
+	flip = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+	sp = _mm256_xor_si256(_mm256_set1_epi64x((long long)(tmax - tmin)), flip);
+
+	for (i = 0; i + 4 <= nlanes; i += 4) {
+		v = _mm256_loadu_si256((const __m256i *)(buf + i * 8));
+		d = _mm256_xor_si256(_mm256_sub_epi64(v, lo), flip);
+		bits = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(sp, d)));
+		for (; bits; bits &= bits - 1) {
+			b = __builtin_ctz(bits);
+			ptr_lane(buf + (i + b) * 8, base + (i + b) * 8, 8, hb);
+		}
+	}
+	return i;
+}
+#endif
+
+/*
+ * Look for pointers of width w (bytes) at every stride-aligned start in
+ * the first own bytes.
+ */
+static void ptr_scan_width(const unsigned char *buf, size_t len, size_t own,
+			   unsigned long base, int w, struct hitbuf *hb)
+{
+	unsigned long	stride = alignset ? align : (unsigned long)w;
+	size_t		first, start, nlanes = 0;
+
+	if (w == 4 && tmin > 0xffffffffUL)
+		return;
+
+	first = (stride - (base & (stride - 1))) & (stride - 1);
+	if (first >= own || first + w > len)
+		return;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (stride == (unsigned long)w && __builtin_cpu_supports("avx2")) {
+		nlanes = (len - first) / w;
+		if (nlanes > (own - first + w - 1) / w)
+			nlanes = (own - first + w - 1) / w;
+		nlanes = (w == 4 ? ptr_avx2_32 : ptr_avx2_64)(buf + first, nlanes, base + first, hb);
+	}
+#endif
+	for (start = first + nlanes * stride; start < own && start + w <= len; start += stride)
+		ptr_lane(buf + start, base + start, w, hb);
+}
+
+static int ht_init(struct htable *t, unsigned long cap)
+{
+	memset(t, 0, sizeof(*t));
+	t->cap = cap;
+	if ((t->e = calloc(cap, sizeof(*t->e))) == NULL) {
+		perror("calloc(3)");
+		return -1;
+	}
+	return 0;
+}
+
+static inline struct hentry *ht_slot(struct htable *t, unsigned int key)
+{
+	unsigned long	i = (key * 0x9e3779b1UL) & (t->cap - 1);
+
+	while (t->e[i].count && t->e[i].key != key)
+		i = (i + 1) & (t->cap - 1);
+	return &t->e[i];
+}
+
+/*
+ * Subtract the smallest count from every entry and drop the ones that hit
+ * zero, then rebuild the probe chains.  Page counts shrink with them so
+ * they stay lower bounds too.
+ */
+static void ht_prune(struct htable *t)
+{
+	struct hentry	*old = t->e, *h;
+	unsigned long	min = ~0UL, i;
+
+	for (i = 0; i < t->cap; i++)
+		if (old[i].count && old[i].count < min)
+			min = old[i].count;
+
+	if ((t->e = calloc(t->cap, sizeof(*t->e))) == NULL) {
+		perror("calloc(3)");
+		exit(1);
+	}
+	t->n = 0;
+	t->dropped += min;
+	for (i = 0; i < t->cap; i++) {
+		if (old[i].count <= min)
+			continue;
+		h = ht_slot(t, old[i].key);
+		*h = old[i];
+		h->count -= min;
+		h->pages = h->pages > min ? h->pages - min : 1;
+		t->n++;
+	}
+	free(old);
+}
+
+/*
+ * Count key at page.  Pages are walked in increasing order per thread,
+ * so a change of page is a new page for that value.
+ */
+static inline void ht_add(struct htable *t, unsigned int key, unsigned long count,
+			  unsigned long pages, unsigned long page)
+{
+	struct hentry	*h = ht_slot(t, key);
+
+	if (h->count == 0) {
+		if (t->n >= t->cap - t->cap / 4) {
+			ht_prune(t);
+			h = ht_slot(t, key);
+		}
+		h->key = key;
+		h->lastpage = ~0UL;
+		t->n++;
+	}
+	h->count += count;
+	if (page == ~0UL || page != h->lastpage) {
+		h->pages += pages;
+		h->lastpage = page;
+	}
+}
+
+/*
+ * Count run copies of dword x at page, and of each of its two halfwords
+ * that could be a vendor ID.
+ */
+static inline void hist_add(struct histo *hs, unsigned int x, unsigned long run, unsigned long page)
+{
+	ht_add(&hs->dword, x, run, 1, page);
+	if ((x & 0xffff) != 0 && (x & 0xffff) != 0xffff)
+		ht_add(&hs->vendor, x & 0xffff, run, 1, page);
+	if ((x >> 16) != 0 && (x >> 16) != 0xffff)
+		ht_add(&hs->vendor, x >> 16, run, 1, page);
+}
+
+/*
+ * Count aligned dwords and vendor-ID-shaped halfwords starting in the
+ * first own bytes.  Runs of the same dword (zero fill) are counted in one
+ * go.
+ */
+static void hist_scan(const unsigned char *buf, size_t len, size_t own,
+		      unsigned long base, struct histo *hs)
+{
+	unsigned long	pageshift = __builtin_ctzl(PAGE_SIZE);
+	unsigned long	page, lastpage = ~0UL;
+	unsigned int	x, last = 0;
+	unsigned long	run = 0;
+	size_t		start, first;
+
+	first = (4 - (base & 3)) & 3;
+	for (start = first; start < own && start + 4 <= len; start += 4) {
+		memcpy(&x, buf + start, 4);
+		page = (base + start) >> pageshift;
+
+		if (run && x == last && page == lastpage) {
+			run++;
+			continue;
+		}
+		if (run)
+			hist_add(hs, last, run, lastpage);
+		last = x;
+		lastpage = page;
+		run = 1;
+	}
+	if (run)
+		hist_add(hs, last, run, lastpage);
+	hs->bytes += own;
+}
+
+static int hentry_cmp(const void *a, const void *b)
+{
+	const struct hentry *x = a, *y = b;
+
+	if (x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/*
+ * Merge every thread's table of one kind and print its top K.
+ */
+static void hist_print(const char *kind, size_t off, int width, int lastkind)
+{
+	struct htable	all, *t;
+	struct hentry	*top;
+	unsigned long	i, n, dropped = 0;
+	int		j;
+
+	if (ht_init(&all, HIST_SLOTS * 4) < 0)
+		exit(1);
+	for (j = 0; j < jobs; j++) {
+		if (!histos[j])
+			continue;
+		t = (struct htable *)((char *)histos[j] + off);
+		dropped += t->dropped;
+		for (i = 0; i < t->cap; i++)
+			if (t->e[i].count)
+				ht_add(&all, t->e[i].key, t->e[i].count, t->e[i].pages, ~0UL);
+	}
+	dropped += all.dropped;
+
+	top = all.e;
+	for (i = n = 0; i < all.cap; i++)
+		if (all.e[i].count)
+			top[n++] = all.e[i];
+	qsort(top, n, sizeof(*top), hentry_cmp);
+	if (n > (unsigned long)histk)
+		n = histk;
+
+	if (jsonout) {
+		printf("  \"%s\": {\n    \"max_error\": %lu,\n    \"top\": [", kind, dropped);
+		for (i = 0; i < n; i++)
+			printf("%s\n      { \"value\": \"0x%0*x\", \"count\": %lu, \"pages\": %lu }",
+					i ? "," : "", width, top[i].key, top[i].count, top[i].pages);
+		printf("\n    ]\n  }%s\n", lastkind ? "" : ",");
+	} else {
+		for (i = 0; i < n; i++)
+			printf("%s,0x%0*x,%lu,%lu\n", kind, width, top[i].key, top[i].count, top[i].pages);
+	}
+	free(all.e);
+}
+
+static void hist_report(void)
+{
+	unsigned long	bytes = 0;
+	int		j;
+
+	for (j = 0; j < jobs; j++)
+		if (histos[j])
+			bytes += histos[j]->bytes;
+
+	if (jsonout) {
+		printf("{\n  \"bytes\": %lu,\n", bytes);
+		hist_print("dwords", offsetof(struct histo, dword), 8, 0);
+		hist_print("vendor_ids", offsetof(struct histo, vendor), 4, 1);
+		printf("}\n");
+	} else {
+		printf("kind,value,count,pages\n");
+		hist_print("dword", offsetof(struct histo, dword), 8, 0);
+		hist_print("vendor_id", offsetof(struct histo, vendor), 4, 1);
+	}
+}
+
+/*
+ * Fixed pseudo-random Gear table (splitmix64), so ROMs and memory are cut
+ * alike from run to run.
+ */
+static void gear_init(void)
+{
+	uint64_t	x = 0x70636974;
+	uint64_t	z;
+	int		i;
+
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+static inline unsigned long fuzz_slot(uint64_t g, unsigned int len)
+{
+	return ((g ^ len * XXH_P3) * XXH_P1 >> 20) & (fuzzcap - 1);
+}
+
+static inline int fuzz_haslen(size_t len)
+{
+	return len >= FUZZ_MIN && len <= FUZZ_MAX && (fuzzlens[len >> 3] & (1 << (len & 7)));
+}
+
+/*
+ * Read a ROM image for -M.
+ */
+static int fuzz_load(const char *path)
+{
+	struct fuzzrom	*fr = &roms[nroms];
+	size_t		cap = 0;
+	ssize_t		k;
+	int		fd;
+
+	if (nroms == MAX_ROMS) {
+		fprintf(stderr, "findmem: at most %d -M ROMs\n", MAX_ROMS);
+		return -1;
+	}
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "findmem: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(fr, 0, sizeof(*fr));
+	for (;;) {
+		if (fr->len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			if ((fr->bytes = realloc(fr->bytes, cap)) == NULL) {
+				perror("realloc(3)");
+				exit(1);
+			}
+		}
+		if ((k = read(fd, fr->bytes + fr->len, cap - fr->len)) < 0) {
+			perror("read(2)");
+			close(fd);
+			return -1;
+		}
+		if (k == 0)
+			break;
+		fr->len += k;
+	}
+	close(fd);
+	if (fr->len < FUZZ_MIN) {
+		fprintf(stderr, "findmem: %s: too short to look for\n", path);
+		return -1;
+	}
+	fr->path = (char *)path;
+	nroms++;
+	return 0;
+}
+
+/*
+ * Cut every -M ROM into chunks and index them.  A cut after byte p is
+ * decided by bytes p-63..p alone, wherever the scan started, which is what
+ * lets memory be cut the same way without knowing where a copy begins.
+ */
+static int fuzz_build(void)
+{
+	unsigned long	total = 0, i, slot;
+	uint64_t	h;
+	size_t		p, cut;
+	int		j;
+
+	gear_init();
+	for (j = 0; j < nroms; j++)
+		total += roms[j].len / FUZZ_MIN;
+	for (fuzzcap = 1024; fuzzcap < total * 2; fuzzcap <<= 1)
+		;
+	if ((fuzztab = malloc(fuzzcap * sizeof(*fuzztab))) == NULL) {
+		perror("malloc(3)");
+		return -1;
+	}
+	for (i = 0; i < fuzzcap; i++)
+		fuzztab[i].rom = -1;
+
+	for (j = 0; j < nroms; j++) {
+		for (h = 0, cut = 0, p = 0; p < roms[j].len; p++) {
+			h = (h << 1) + gear[roms[j].bytes[p]];
+			if (p + 1 < FUZZ_MIN || (h >> (64 - FUZZ_BITS)) != 0)
+				continue;
+			if (cut && p + 1 - cut >= FUZZ_MIN && p + 1 - cut <= FUZZ_MAX) {
+				for (slot = fuzz_slot(h, p + 1 - cut); fuzztab[slot].rom >= 0;
+				     slot = (slot + 1) & (fuzzcap - 1))
+					;
+				fuzztab[slot].gear = h;
+				fuzztab[slot].len = p + 1 - cut;
+				fuzztab[slot].off = cut;
+				fuzztab[slot].rom = j;
+				fuzztab[slot].xxh = xxh64(roms[j].bytes + cut, p + 1 - cut, 0);
+				fuzzlens[(p + 1 - cut) >> 3] |= 1 << ((p + 1 - cut) & 7);
+				roms[j].nchunks++;
+			}
+			cut = p + 1;
+		}
+		lastvote[j] = -1;
+	}
+	return 0;
+}
+
+/*
+ * Cut len bytes at base and look every chunk up.  A cut is only known
+ * FUZZ_MIN bytes in, so this run owns the chunks that start in
+ * [base + FUZZ_MIN, base + own + FUZZ_MIN); the run before it saw the
+ * ones starting earlier in its overlap.  A found chunk becomes a hit at
+ * the address its ROM would start at.
+ */
+static void fuzz_scan(const unsigned char *buf, size_t len, size_t own,
+		      unsigned long base, struct hitbuf *hb)
+{
+	struct fuzzchunk *c;
+	struct hit	*hit;
+	unsigned long	slot;
+	uint64_t	h = 0, x;
+	size_t		p, n, cut = 0, ownend = own + FUZZ_MIN;
+	int		havex;
+
+	for (p = 0; p < len; p++) {
+		h = (h << 1) + gear[buf[p]];
+		if (p + 1 < FUZZ_MIN || (h >> (64 - FUZZ_BITS)) != 0)
+			continue;
+		n = p + 1 - cut;
+		if (cut && fuzz_haslen(n)) {
+			havex = 0;
+			x = 0;
+			for (slot = fuzz_slot(h, n); (c = &fuzztab[slot])->rom >= 0;
+			     slot = (slot + 1) & (fuzzcap - 1)) {
+				if (c->gear != h || c->len != n || base + cut < c->off)
+					continue;
+				if (!havex) {
+					x = xxh64(buf + cut, n, 0);
+					havex = 1;
+				}
+				if (x != c->xxh)
+					continue;
+				hit = hit_push(hb);
+				hit->addr = base + cut - c->off;
+				hit->id = -2;
+				hit->width = c->rom;
+				hit->target = n;
+			}
+		}
+		cut = p + 1;
+		if (cut >= ownend)
+			break;
+	}
+}
+
+/*
+ * Count a found chunk.  Chunks of one copy arrive in address order, so
+ * one open vote per ROM collects them.
+ */
+static void fuzz_vote(const struct hit *hit)
+{
+	struct fuzzvote	*v;
+	long		k = lastvote[hit->width];
+
+	if (k < 0 || votes[k].base != hit->addr) {
+		if (nvotes == votecap) {
+			votecap = votecap ? votecap * 2 : 256;
+			if ((v = realloc(votes, votecap * sizeof(*v))) == NULL) {
+				perror("realloc(3)");
+				exit(1);
+			}
+			votes = v;
+		}
+		k = lastvote[hit->width] = nvotes++;
+		memset(&votes[k], 0, sizeof(votes[k]));
+		votes[k].base = hit->addr;
+		votes[k].rom = hit->width;
+	}
+	votes[k].bytes += hit->target;
+	votes[k].chunks++;
+}
+
+static int fuzzvote_cmp(const void *a, const void *b)
+{
+	const struct fuzzvote *x = a, *y = b;
+
+	if (x->rom != y->rom)
+		return x->rom - y->rom;
+	if (x->base != y->base)
+		return x->base < y->base ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Compare ROM j with what is at base, a page at a time.  Returns the
+ * matching bytes; *patches counts the runs of differing bytes.
+ */
+static unsigned long fuzz_verify(int fd, int j, unsigned long base, unsigned long *patches)
+{
+	const struct dump_extent *e = NULL;
+	unsigned char	page[4096];
+	unsigned long	same = 0, off, avail, k;
+	ssize_t		got;
+	int		differing = 0;
+
+	*patches = 0;
+	for (off = 0; off < roms[j].len; off += sizeof(page)) {
+		avail = roms[j].len - off < sizeof(page) ? roms[j].len - off : sizeof(page);
+		got = -1;
+		if (!dump.map)
+			got = pread(fd, page, avail, base + off);
+		else if ((e = dumpr_find(&dump, base + off)) != NULL)
+			got = pread(fd, page, e->addr + e->len - (base + off) < avail ?
+					e->addr + e->len - (base + off) : avail,
+					e->offset + (base + off - e->addr));
+		if (got < 0)
+			got = 0;
+		for (k = 0; k < avail; k++) {
+			if (k < (unsigned long)got && page[k] == roms[j].bytes[off + k]) {
+				same++;
+				differing = 0;
+			} else if (!differing) {
+				differing = 1;
+				(*patches)++;
+			}
+		}
+	}
+	return same;
+}
+
+/*
+ * Verify every address enough chunks voted for and print the copies
+ * found, best first per ROM.
+ */
+static void fuzz_report(int fd)
+{
+	unsigned long	i, same, patches;
+	int		j, first = 1;
+
+	qsort(votes, nvotes, sizeof(*votes), fuzzvote_cmp);
+	if (jsonout)
+		printf("[");
+	else
+		printf("rom,address,matched,length,coverage,chunks,patches\n");
+	for (i = 0; i < nvotes; i++) {
+		if (i && votes[i].rom == votes[i - 1].rom && votes[i].base == votes[i - 1].base) {
+			votes[i].chunks += votes[i - 1].chunks;
+			votes[i].bytes += votes[i - 1].bytes;
+		}
+		if (i + 1 < nvotes && votes[i + 1].rom == votes[i].rom && votes[i + 1].base == votes[i].base)
+			continue;
+		if (votes[i].chunks < FUZZ_MINCHUNKS)
+			continue;
+		j = votes[i].rom;
+		same = fuzz_verify(fd, j, votes[i].base, &patches);
+		if (same * 100 < roms[j].len * FUZZ_MINCOVER)
+			continue;
+		roms[j].found++;
+		nhits++;
+		if (jsonout)
+			printf("%s\n  { \"rom\": \"%s\", \"address\": \"0x%016lx\", \"matched\": %lu, \"length\": %zu, "
+			       "\"coverage\": %.1f, \"chunks\": \"%lu/%lu\", \"patches\": %lu }",
+			       first ? "" : ",", roms[j].path, votes[i].base, same, roms[j].len,
+			       100.0 * same / roms[j].len, votes[i].chunks, roms[j].nchunks, patches);
+		else
+			printf("%s,0x%016lx,%lu,%zu,%.1f,%lu/%lu,%lu\n", roms[j].path, votes[i].base, same,
+			       roms[j].len, 100.0 * same / roms[j].len, votes[i].chunks, roms[j].nchunks, patches);
+		first = 0;
+	}
+	if (jsonout)
+		printf("\n]\n");
+	for (j = 0; j < nroms; j++)
+		if (!roms[j].found)
+			fprintf(info, "       %s: no copy found.\n", roms[j].path);
+}
+
+/*
+ * Run every matcher over one run of readable bytes.
+ */
+static void scan_run(const unsigned char *buf, size_t len, size_t own,
+		     unsigned long base, struct hitbuf *hb)
+{
+	int	j;
+
+	if (nacneedles)
+		ac_scan(&ac, buf, len, own, base, hb);
+	if (nstrided)
+		stride_scan(buf, len, own, base, hb);
+	for (j = 0; j < npatterns; j++)
+		pattern_scan(&patterns[j], nneedles + j, buf, len, own, base, hb);
+	if (ntargets) {
+		if (ptrwidths & 4)
+			ptr_scan_width(buf, len, own, base, 4, hb);
+		if (ptrwidths & 8)
+			ptr_scan_width(buf, len, own, base, 8, hb);
+	}
+	if (nroms)
+		fuzz_scan(buf, len, own, base, hb);
+}
+
+/*
+ * -H over the run at buf: [base, base + len) readable so far, counts for
+ * [*done, end).  A chunk is copied out before any of it is counted, so a
+ * fault leaves it uncounted, and *done is where the rescan of the run
+ * picks up: the hit buffer can be rolled back, the tables can't.
+ */
+static void hist_run(const unsigned char *buf, size_t len, unsigned long base, unsigned long end,
+		     unsigned long *done)
+{
+	unsigned char	chunk[HIST_CHUNK];
+	unsigned long	a, next, stop;
+
+	for (a = *done > base ? *done : base; a < end; a = next) {
+		stop = (a | (HIST_CHUNK - 1)) + 1;
+		next = stop < end ? stop : end;
+		if (stop > base + len)
+			stop = base + len;
+		memcpy(chunk, buf + (a - base), stop - a);
+		hist_scan(chunk, stop - a, next - a, a, myhist);
+		*done = next;
+	}
+}
+
+/*
+ * Scan the run [base, base + len) of buf, owning the hits that start
+ * before end, under the fault guard.  Nothing here is live across the
+ * jump.  Returns -1 if the run faulted.
+ */
+static int scan_guarded(const unsigned char *buf, size_t len, unsigned long base, unsigned long end,
+			struct hitbuf *hb, unsigned long *histed)
+{
+	memfault_armed = 1;
+	if (sigsetjmp(memfault_jmp, 1) != 0)
+		return -1;
+	scan_run(buf, len, end - base, base, hb);
+	if (myhist)
+		hist_run(buf, len, base, end, histed);
+	memfault_armed = 0;
+	return 0;
+}
+
+/*
+ * Scan window k, [ws, we).  The mmap(2) also covers up to overlap bytes
+ * after we (but not past the end of the planned region), and starts on
+ * the page holding ws.
+ *
+ * The window is scanned as runs of pages between bad pages.  A fault in a
+ * run adds its page to the skip map, drops the run's hits and rescans it
+ * up to the new bad page; no needle can match across a bad page.
+ */
+static int scan_window(unsigned long k, struct hitbuf *hb)
+{
+	unsigned long	ws = windows[k].ws;
+	unsigned long	we = windows[k].we;
+	unsigned long	hi = windows[k].hi;
+	unsigned long	pagesize = PAGE_SIZE;
+	unsigned long	mapaddr, maplen;
+	unsigned long	pos, bad, runend, fault, histed = ws;
+	size_t		runhits;
+	char		*mem;
+
+	/*
+	 * Reasons mmap(2) returns EINVAL:
+	 * The first reason is because offset is not on a page boundary, and is what is happening.
+	 * EINVAL We don't like addr, length, or offset (e.g., they are too large, or not aligned on a page boundary).
+	 * EINVAL (since Linux 2.6.12) length was 0.
+	 * EINVAL flags contained neither MAP_PRIVATE or MAP_SHARED, or contained both of these values.
+	 */
+	mapaddr = (unsigned long)ROUND_PAGE(ws);
+	maplen = hi - mapaddr;
+
+	if ((mem = mmap(NULL, (size_t)maplen, PROT_READ, MAP_SHARED,
+			scanfd, (off_t)(mapaddr + windows[k].off))) == MAP_FAILED) {
+		perror("mmap(2)");
+		return -1;
+	}
+	(void)madvise(mem, maplen, MADV_SEQUENTIAL);
+
+	pos = ws;
+	while (pos < we) {
+		bad = skipmap_next(&skip, pos);
+		if (bad <= pos) {
+			pos = bad + pagesize;
+			continue;
+		}
+		runend = bad < hi ? bad : hi;
+		runhits = hb->n;
+
+		if (scan_guarded((unsigned char *)mem + (pos - mapaddr), runend - pos, pos,
+				 bad < we ? bad : we, hb, &histed) == 0) {
+			pos = bad < we ? bad + pagesize : we;
+			continue;
+		}
+
+		fault = (unsigned long)memfault_addr;
+		if (fault < (unsigned long)mem || fault >= (unsigned long)mem + maplen) {
+			fprintf(stderr, "findmem: fault at %p outside the window\n", (void *)fault);
+			abort();
+		}
+		fault = mapaddr + (fault - (unsigned long)mem);
+		hb->n = runhits;
+		if (skipmap_add(&skip, fault))
+			fprintf(stderr, "       Unreadable page at %#lx, added to skip map.\n",
+					fault & ~(pagesize - 1));
+	}
+
+	munmap(mem, maplen);
+
+	/*
+	 * Needles of different lengths end in order, not start in order.
+	 * Every hit in window k starts before every hit in window k + 1.
+	 */
+	qsort(hb->v, hb->n, sizeof(*hb->v), hit_cmp);
+	return 0;
+}
+
+long		workercpu[MAX_JOBS];
+
+static void *worker(void *arg)
+{
+	long		id = (long)arg;
+	long		cpu = workercpu[id];
+	unsigned long	k;
+	cpu_set_t	set;
+	struct hitbuf	*hb;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+			perror("pthread_setaffinity_np(3)");
+	}
+
+	if (histk) {
+		if ((myhist = calloc(1, sizeof(*myhist))) == NULL ||
+		    ht_init(&myhist->dword, HIST_SLOTS) < 0 ||
+		    ht_init(&myhist->vendor, HIST_SLOTS) < 0) {
+			perror("calloc(3)");
+			exit(1);
+		}
+		histos[id] = myhist;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&ringlock);
+		while (nexttake < nwindows && nexttake - nextprint >= nring)
+			pthread_cond_wait(&ringcv, &ringlock);
+		if (nexttake == nwindows) {
+			pthread_mutex_unlock(&ringlock);
+			return NULL;
+		}
+		k = nexttake++;
+		pthread_mutex_unlock(&ringlock);
+
+		hb = &ring[k % nring];
+		hb->error = scan_window(k, hb) < 0;
+
+		pthread_mutex_lock(&ringlock);
+		hb->done = 1;
+		pthread_cond_broadcast(&ringcv);
+		pthread_mutex_unlock(&ringlock);
+	}
+}
+
+/*
+ * Could any needle, pattern, pointer or the histogram start on byte b?
+ */
+static int starts_with(int b)
+{
+	unsigned long	v;
+	int		i;
+
+	if (histk || nroms)
+		return 1;
+	for (i = 0; i < nneedles; i++)
+		if (needles[i].bytes[0] == b)
+			return 1;
+	for (i = 0; i < npatterns; i++)
+		if ((b & patterns[i].mask[0]) == patterns[i].bytes[0])
+			return 1;
+	for (i = 0; i < ntargets; i++)
+		for (v = targets[i].lo; v < targets[i].hi && v < targets[i].lo + 256; v++)
+			if ((v & 0xff) == (unsigned long)b)
+				return 1;
+	return 0;
+}
+
+/*
+ * Page classes no hit can start in, unless -K said otherwise.
+ */
+static int index_skipmask(void)
+{
+	int	mask = PAGE_BAD;
+
+	if (skipclasses >= 0)
+		return skipclasses | PAGE_BAD;
+	if (!starts_with(0x00))
+		mask |= PAGE_ZERO;
+	if (!starts_with(0xff))
+		mask |= PAGE_FF;
+	return mask;
+}
+
+/*
+ * Clip the plan to the extents of the dump container.  Extents are painted
+ * last to first, so where two overlap the one dumpr_find() returns wins
+ * and every region lies inside the extent its windows are mapped from.
+ */
+static int dump_plan(struct regions *plan)
+{
+	struct regions	out = { 0 };
+	unsigned long	lo, hi;
+	size_t		i, k;
+
+	for (k = dump.n; k-- > 0; )
+		for (i = 0; i < plan->n; i++) {
+			lo = plan->r[i].start > dump.ext[k].addr ? plan->r[i].start : dump.ext[k].addr;
+			hi = plan->r[i].end < dump.ext[k].addr + dump.ext[k].len ? plan->r[i].end :
+				dump.ext[k].addr + dump.ext[k].len;
+			if (lo < hi && regions_paint(&out, lo, hi, plan->r[i].type) < 0)
+				return -1;
+		}
+	free(plan->r);
+	*plan = out;
+	return 0;
+}
+
+/*
+ * Cut every planned region into windows.  Runs of pages the index says
+ * to skip are left out; a window ending at one still maps the overlap
+ * into it.
+ */
+static int plan_windows(struct regions *plan)
+{
+	const struct dump_extent *e;
+	unsigned long	ws, we, end;
+	size_t		i;
+	int		pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		nwindows = 0;
+		for (i = 0; i < plan->n; i++) {
+			end = plan->r[i].end;
+			for (ws = plan->r[i].start; ws < end; ws = we) {
+				ws = pageindex_next(&pidx, ws, end, skipclasses, 0);
+				if (ws == end)
+					break;
+				we = (end - ws > window) ? ws + window : end;
+				we = pageindex_runend(&pidx, ws, we, skipclasses, 0);
+				if (pass) {
+					windows[nwindows].ws = ws;
+					windows[nwindows].we = we;
+					windows[nwindows].hi = (end - we > overlap) ? we + overlap : end;
+					if ((e = dumpr_find(&dump, ws)) != NULL)
+						windows[nwindows].off = e->offset - e->addr;
+				}
+				nwindows++;
+			}
+		}
+		if (!pass && (windows = calloc(nwindows ? nwindows : 1, sizeof(*windows))) == NULL) {
+			perror("calloc(3)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Walk the planned regions one window at a time on jobs threads, printing
+ * each window's hits in address order as soon as it and all windows
+ * before it are done.
+ */
+static int scan_range(int fd, struct regions *plan)
+{
+	pthread_t	tid[MAX_JOBS];
+	cpu_set_t	online;
+	struct hitbuf	*hb;
+	unsigned long	k;
+	size_t		h;
+	long		cpu = -1;
+	int		error = 0;
+	int		i;
+
+	scanfd = fd;
+	if (plan_windows(plan) < 0)
+		return -1;
+	nring = jobs * CHUNKS_PER_JOB;
+	if ((ring = calloc(nring, sizeof(*ring))) == NULL) {
+		perror("calloc(3)");
+		return -1;
+	}
+
+	CPU_ZERO(&online);
+	if (pflag && sched_getaffinity(0, sizeof(online), &online) < 0) {
+		perror("sched_getaffinity(2)");
+		pflag = 0;
+	}
+
+	for (i = 0; i < jobs; i++) {
+		if (pflag)
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while (!CPU_ISSET(cpu, &online));
+		workercpu[i] = cpu;
+		if ((errno = pthread_create(&tid[i], NULL, worker, (void *)(long)i)) != 0) {
+			perror("pthread_create(3)");
+			exit(1);
+		}
+	}
+
+	for (k = 0; k < nwindows; k++) {
+		hb = &ring[k % nring];
+
+		pthread_mutex_lock(&ringlock);
+		while (!hb->done)
+			pthread_cond_wait(&ringcv, &ringlock);
+		pthread_mutex_unlock(&ringlock);
+
+		error |= hb->error;
+		for (h = 0; h < hb->n; h++)
+			if (hb->v[h].id == -2)
+				fuzz_vote(&hb->v[h]);
+			else if (hb->v[h].id < 0)
+				printf("0x%016lx -> 0x%016lx %d\n", hb->v[h].addr, hb->v[h].target,
+						hb->v[h].width);
+			else
+				printf("0x%016lx %d\n", hb->v[h].addr, hb->v[h].id);
+		if (!nroms)
+			nhits += hb->n;
+		hb->n = 0;
+
+		pthread_mutex_lock(&ringlock);
+		hb->done = 0;
+		nextprint++;
+		pthread_cond_broadcast(&ringcv);
+		pthread_mutex_unlock(&ringlock);
+	}
+
+	for (i = 0; i < jobs; i++)
+		pthread_join(tid[i], NULL);
+
+	for (k = 0; k < nring; k++)
+		free(ring[k].v);
+	free(ring);
+	free(windows);
+	return error ? -1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	int		i;
 	int		opt;
 	int 		fd;
-	unsigned int	*loc = NULL;
-	char   		 *mem;
 	char 		*filename = NULL;
-	unsigned long	mapaddr = 0;
-	unsigned long   offset;
 	unsigned long	addr = 0;
 	unsigned long	limit = 0x10000;
+	int		lflag = 0;
+	struct needle	extra[MAX_NEEDLES];
+	int		nextra = 0;
+	struct regions	iomem = { 0 };
+	struct regions	plan = { 0 };
+	size_t		r;
 
-	while ((opt = getopt(argc, argv, "A:L:F:0:1:2:3:4:5:6:7:8:9:a:b:c:d:e:f")) != -1) switch (opt) {
+	while ((opt = getopt_long(argc, argv, "A:L:F:H:I:K:M:N:O:R:S:T:W:X:g:j:Pp:w:0:1:2:3:4:5:6:7:8:9:a:b:c:d:e:f:",
+				  longopts, NULL)) != -1) switch (opt) {
 		case 'A':
 			addr = strtoul(optarg, NULL, 0);
 			break;
 		case 'L':
 			limit = strtoul(optarg, NULL, 0);
+			lflag = 1;
 			break;
 		case 'F':
 			filename = optarg;
 			break;
+		case 'R':
+			regionfile = optarg;
+			break;
+		case 'p':
+			if (npatterns == MAX_PATTERNS) {
+				fprintf(stderr, "findmem: at most %d -p patterns\n", MAX_PATTERNS);
+				exit(1);
+			}
+			if (pattern_parse(&patterns[npatterns], optarg) < 0)
+				exit(1);
+			npatterns++;
+			break;
+		case 'S':
+			skipfile = optarg;
+			break;
+		case 'X':
+			indexfile = optarg;
+			break;
+		case 'K':
+			if ((skipclasses = page_classes_parse(optarg)) < 0) {
+				fprintf(stderr, "findmem: bad -K '%s' (want zero,ff,rom,text,entropy,bad)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			if ((regionmask = region_types_parse(optarg)) <= 0) {
+				fprintf(stderr, "findmem: bad -T '%s' (want ram,reserved,rom,acpi,pci,bar,other,all)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'W':
+			window = strtoul(optarg, NULL, 0);
+			break;
+		case 'I':
+			if (optarg[0] == '@') {
+				if (target_load(optarg + 1) < 0)
+					exit(1);
+			} else if (target_parse(optarg) < 0) {
+				fprintf(stderr, "findmem: bad target '%s' (want lo-hi, lo+len or lo)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'H':
+			histk = strtoul(optarg, NULL, 0);
+			if (histk < 1) {
+				fprintf(stderr, "findmem: -H wants the number of top values to print\n");
+				exit(1);
+			}
+			break;
+		case 'M':
+			if (fuzz_load(optarg) < 0)
+				exit(1);
+			break;
+		case 'O':
+			if (strcmp(optarg, "json") == 0)
+				jsonout = 1;
+			else if (strcmp(optarg, "csv") == 0)
+				jsonout = 0;
+			else {
+				fprintf(stderr, "findmem: -O wants csv or json\n");
+				exit(1);
+			}
+			break;
+		case 'w':
+			if (strstr(optarg, "32"))
+				ptrwidths |= 4;
+			if (strstr(optarg, "64"))
+				ptrwidths |= 8;
+			if (!ptrwidths) {
+				fprintf(stderr, "findmem: -w wants 32, 64 or 32,64\n");
+				exit(1);
+			}
+			break;
+		case 'g':
+			alignset++;
+			align = strtoul(optarg, NULL, 0);
+			if (align == 0 || (align & (align - 1))) {
+				fprintf(stderr, "findmem: --align wants a power of two\n");
+				exit(1);
+			}
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			if (jobs < 1 || jobs > MAX_JOBS) {
+				fprintf(stderr, "findmem: -j wants 1..%d\n", MAX_JOBS);
+				exit(1);
+			}
+			break;
+		case 'P':
+			pflag++;
+			break;
+		case 'N':
+			if (nextra == MAX_NEEDLES - 1) {
+				fprintf(stderr, "findmem: at most %d -N needles\n", MAX_NEEDLES - 1);
+				exit(1);
+			}
+			if (needle_parse(&extra[nextra], optarg) < 0) {
+				fprintf(stderr, "findmem: bad needle '%s' (want value[:8|16|32|64])\n", optarg);
+				exit(1);
+			}
+			nextra++;
+			break;
 		case '0':
 			value[0] = strtoul(optarg, NULL, 0);
 			values++;
 			break;
-		case '1':	
+		case '1':
 			value[1] = strtoul(optarg, NULL, 0);
 			values++;
 			break;
@@ -115,70 +2156,242 @@ int main(int argc, char **argv)
 			break;
 	}
 
-	if (!filename || !values) {
-		fprintf(stderr, "Usage: findmem [ -A base ] [ -F filename ] [ -0123456789abcdef longword ]\n");
+	if (!filename || (!values && !nextra && !npatterns && !ntargets && !histk && !nroms) || limit == 0) {
+		fprintf(stderr, "Usage: findmem [ -A base ] [ -L limit ] [ -F filename ] [ -0123456789abcdef longword ]\n");
+		fprintf(stderr, "               [ -N value[:8|16|32|64] ... ] [ -W window ] [ -j jobs [ -P ] ]\n");
+		fprintf(stderr, "               [ -S skipmap ] [ -R /proc/iomem [ -T ram,rom,... ] ]\n");
+		fprintf(stderr, "               [ -p \"@align hh hh/mm ?? h? 'text' tok{n} ...\" ] [ --align N ]\n");
+		fprintf(stderr, "               [ -I lo-hi|lo+len|@file ... [ -w 32,64 ] ] [ -H topk [ -O csv|json ] ]\n");
+		fprintf(stderr, "               [ -X pageindex [ -K zero,ff,rom,text,entropy,bad ] ]\n");
+		fprintf(stderr, "               [ -M romfile ... [ -O csv|json ] ]\n");
 		exit(0);
 	}
-			
+
+	/*
+	 * The packed -0..-f words are needle 0, -N needles follow.
+	 */
+	if (values) {
+		memcpy(needles[0].bytes, value, values * sizeof(value)[0]);
+		needles[0].len = values * sizeof(value)[0];
+		needles[0].bits = needles[0].len * 8;
+		nneedles++;
+	}
+	for (i = 0; i < nextra; i++)
+		needles[nneedles++] = extra[i];
+
+	/*
+	 * With --align every -N needle of up to 8 bytes goes to the stride
+	 * kernel; the packed -0..-f needle and longer ones stay in the
+	 * automaton, whose hits are filtered on alignment.
+	 */
+	stridewidth = 0;
+	for (i = 0; i < nneedles; i++) {
+		if (align > 1 && needles[i].len <= 8 && !(i == 0 && values)) {
+			needles[i].strided = 1;
+			strideid[nstrided] = i;
+			strideval[nstrided] = 0;
+			memcpy(&strideval[nstrided], needles[i].bytes, needles[i].len);
+			stridemask[nstrided] = needles[i].len == 8 ? ~0UL :
+						(1UL << (needles[i].len * 8)) - 1;
+			if (needles[i].len > stridewidth)
+				stridewidth = needles[i].len;
+			nstrided++;
+		} else {
+			nacneedles++;
+		}
+	}
+	if (nstrided)
+		stride_select();
+
+	for (i = 0; i < nneedles; i++)
+		if (needles[i].len > 0 && (unsigned long)needles[i].len - 1 > overlap)
+			overlap = needles[i].len - 1;
+	for (i = 0; i < npatterns; i++)
+		if (patterns[i].len > 0 && (unsigned long)patterns[i].len - 1 > overlap)
+			overlap = patterns[i].len - 1;
+	/*
+	 * The histogram and the ROM report own stdout; everything else is
+	 * commentary.
+	 */
+	info = histk || nroms ? stderr : stdout;
+	if (histk && overlap < 3)
+		overlap = 3;
+	if (nroms) {
+		if (fuzz_build() < 0)
+			exit(1);
+		if (overlap < FUZZ_MIN + FUZZ_MAX)
+			overlap = FUZZ_MIN + FUZZ_MAX;
+	}
+
+	if (ntargets) {
+		target_merge();
+		if (!ptrwidths)
+			ptrwidths = 4 | 8;
+		if ((ptrwidths & 8) && overlap < 7)
+			overlap = 7;
+		else if (overlap < 3)
+			overlap = 3;
+	}
+
+	/*
+	 * Windows are whole pages and must be larger than the overlap.
+	 */
+	window = (window + PAGE_SIZE - 1) & ~((unsigned long)PAGE_SIZE - 1);
+	if (window <= overlap)
+		window = (overlap + PAGE_SIZE) & ~((unsigned long)PAGE_SIZE - 1);
+
+	if (ac_build(&ac, needles, nneedles) < 0) {
+		perror("malloc(3)");
+		exit(1);
+	}
+
 	/*
 	 * Open file or device (/dev/mem usually).
 	 */
-		
+
 	if ((fd = open(filename, O_RDONLY)) < 0) {
 		perror("open(2)");
 		exit(1);
 	}
-		
+	if (dump_is_container(fd)) {
+		if (dumpr_open(&dump, filename) < 0)
+			exit(1);
+		if (!lflag)
+			limit = ~0UL - addr;
+	}
+
 	/*
- 	 * Reasons mmap(2) returns EINVAL:
-	 * The first reason is because offset is not on a page boundary, and is what is happening. 
-         * EINVAL We don't like addr, length, or offset (e.g., they are too large, or not aligned on a page boundary).
-         * EINVAL (since Linux 2.6.12) length was 0.
-         * EINVAL flags contained neither MAP_PRIVATE or MAP_SHARED, or contained both of these values.
+	 * Plan which parts of [addr, addr + limit) to scan.
 	 */
+	if (regionfile) {
+		if (regions_load(&iomem, regionfile) < 0 ||
+		    regions_plan(&iomem, regionmask, addr, limit, &plan) < 0)
+			exit(1);
+	} else if (regions_paint(&plan, addr, addr + limit, REGION_ALL) < 0) {
+		exit(1);
+	}
+	if (dump.map && dump_plan(&plan) < 0)
+		exit(1);
+
+	skipmap_init(&skip, PAGE_SIZE);
+	if (skipfile)
+		skipmap_load(&skip, skipfile);
+	if (memfault_install() < 0)
+		exit(1);
+
+	/*
+	 * Pages that faulted while indexing are as good as in the skip map.
+	 */
+	if (indexfile) {
+		unsigned long	n;
+
+		if (pageindex_open(&pidx, indexfile) < 0)
+			exit(1);
+		skipclasses = index_skipmask();
+		for (n = 0; n < pidx.npages; n++)
+			if (pidx.class[n] & PAGE_BAD)
+				skipmap_add(&skip, pidx.base + n * pidx.pagesize);
+		skip.dirty = 0;
+	}
 
-	mapaddr = (long)ROUND_PAGE(addr);
+	fprintf(info, "\n");
+	fprintf(info, "       Opened %s for read.  File desc=%d\n", filename, fd);
+	if (dump.map) {
+		fprintf(info, "       Dump container from %.32s on %.64s, %zu extents, scanning %zu ranges:\n",
+				dump.hdr->tool, dump.hdr->host, dump.n, plan.n);
+		for (r = 0; r < plan.n; r++)
+			fprintf(info, "                0x%016lx-0x%016lx  %s\n", plan.r[r].start, plan.r[r].end - 1,
+					dumpr_find(&dump, plan.r[r].start)->label);
+	}
+	if (dump.map) {
+		for (limit = 0, r = 0; r < plan.n; r++)
+			limit += plan.r[r].end - plan.r[r].start;
+		fprintf(info, "       Streaming %#lx bytes of extents through mmap(2) windows of %#lx bytes (%ld pages).\n",
+					limit, window, window / getpagesize());
+	} else {
+		fprintf(info, "       Streaming %#lx bytes from address %#lx through mmap(2) windows of %#lx bytes (%ld pages).\n",
+					limit, addr, window, window / getpagesize());
+	}
+	fprintf(info, "       Scanning on %d thread%s%s.\n", jobs, jobs == 1 ? "" : "s", pflag ? " pinned to CPUs" : "");
+	if (regionfile) {
+		fprintf(info, "       Region plan from %s (%zu regions):\n", regionfile, plan.n);
+		for (r = 0; r < plan.n; r++)
+			fprintf(info, "                0x%016lx-0x%016lx  %s\n", plan.r[r].start, plan.r[r].end - 1,
+					region_name(plan.r[r].type));
+	}
+	fprintf(info, "\n");
 
-	printf("\n");
-	printf("       Opened %s for read.  File desc=%d\n", filename, fd);
-	printf("       Calling mmap(2) to map limit bytes (%ld pages) from address: %#lx.\n", limit / getpagesize(),
-					mapaddr);
-        if ((mem = 
-                mmap(NULL, 
-                (size_t)ROUND_PAGE(limit), 
-                PROT_READ, 
-                MAP_SHARED, 
-                fd, (off_t)mapaddr)) == MAP_FAILED) {
-                perror("mmap(2)");
-                exit(1);
-        }
+	if (nacneedles)
+		fprintf(info, "       Aho-Corasick automaton (%u states) finding %d needles:\n", ac.nstates, nacneedles);
+	if (nstrided)
+		fprintf(info, "       Aligned stride kernel (%s) comparing %d needles every %lu bytes:\n",
+				stridekind, nstrided, align);
 
-	printf("       mmap(2) gave address range %p->%p\n", mem, mem + limit);
-	printf("\n");
+        for (i = 0; i < nneedles; i++)
+		if (i == 0 && values)
+			fprintf(info, "                Needle 0: %d packed longwords (%d bytes)\n", values, needles[0].len);
+		else
+			fprintf(info, "                Needle %d: %d-bit  Decimal: %lu    Hexadecimal: %#lx\n",
+					i, needles[i].bits, needles[i].value, needles[i].value);
 
-        printf("       Performing memmem(3) to find %d values:\n", values);
+	if (ntargets)
+		fprintf(info, "       Reverse pointer search: %s%s%s words into %d target intervals (%#lx-%#lx).\n",
+				ptrwidths & 4 ? "32" : "", ptrwidths == 12 ? "/" : "",
+				ptrwidths & 8 ? "64-bit" : "-bit", ntargets, tmin, tmax - 1);
 
-        for (i = 0; i < values; i++)
-                printf("                Decimal: %d    Hexadecimal: %#x\n", value[i], value[i]);
+	for (i = 0; i < nroms; i++)
+		fprintf(info, "       ROM %s: %zu bytes in %lu chunks.\n", roms[i].path, roms[i].len, roms[i].nchunks);
 
-	(void)mprotect(mem, limit, PROT_READ);
+	for (i = 0; i < npatterns; i++)
+		fprintf(info, "                Needle %d: pattern \"%s\" (%d bytes, align %lu, anchor +%d)\n",
+				nneedles + i, patterns[i].text, patterns[i].len, patterns[i].align,
+				patterns[i].anchor);
 
-	printf("       Memmem(3) finding needles in haystack...");
+	fprintf(info, "\n");
 	fflush(stdout);
 
-	if ((loc = memmem(mem, limit, 
-			  value, values * sizeof(value)[0])) == NULL) { 
-		printf("\n                Found none!\n");
-		munmap(mem, limit);
+	if (skip.n)
+		fprintf(info, "       Skipping %zu unreadable pages from %s.\n\n", skip.n,
+				skipfile ? skipfile : indexfile);
+	if (indexfile) {
+		fprintf(info, "       Page index %s (%lu pages from %#lx), not starting hits in:", indexfile,
+				pidx.npages, pidx.base);
+		for (r = 0; r < sizeof(page_class_names) / sizeof(page_class_names[0]); r++)
+			if (skipclasses & page_class_names[r].class)
+				fprintf(info, " %s", page_class_names[r].name);
+		fprintf(info, "\n\n");
+	}
+
+	fflush(info);
+	i = scan_range(fd, &plan);
+	if (histk && i == 0)
+		hist_report();
+	if (nroms && i == 0)
+		fuzz_report(fd);
+
+	if (skipfile)
+		skipmap_save(&skip, skipfile);
+	else if (skip.n)
+		fprintf(stderr, "       %zu unreadable pages skipped (use -S to keep a skip map).\n", skip.n);
+
+	if (i < 0) {
+		close(fd);
+		exit(1);
+	}
+
+	if (histk) {
+		close(fd);
+		exit(0);
+	}
+
+	if (nhits == 0) {
+		fprintf(info, "\n                Found none!\n");
 		close(fd);
 		exit(1);
 	}
 
-	offset = (long)loc - (long)mem;
-	printf("\n              Found values! At Offset=%#lx (mmap(2) pointer %p)\n", offset, loc);
-	printf("              Offset from mapaddr: %#lx\n", (long)mapaddr + offset);
+	fprintf(info, "\n              Found %lu hits.\n", nhits);
 
-	munmap(mem, limit);
 	close(fd);
 	exit(0);
 }
@@ -10,6 +10,26 @@
  * structure, starting with 'PCIR') -                The above should help
  * locate ROMs throughout system memory, using memmem(3).
  * 
+ * - SIGBUS/SIGSEGV on an unreadable page no longer kills the search: the
+ * page goes into the -S skip map and the search resumes past it.  Known bad
+ * pages are never touched.
+ * 
+ * - -R /proc/iomem (or /sys/firmware/memmap, or a saved copy) limits the
+ * search to the -T region types (default ram,rom); holes and MMIO windows
+ * are skipped.
+ * 
+ * - -X index from pageindex(1): only pages that held a 55 aa are searched.
+ * 
+ * - Only -g aligned (default 2KB) candidates are looked at, and the whole
+ * header is validated (pcirom.h): PCIR via the +0x18 pointer, PDS length
+ * and revision, image length, checksum.  ROMs are saved as <physical
+ * address>.rom.
+ * 
+ * - The whole image chain is walked up to the last-image bit.  Each image
+ * is saved as <address>.<n>.<code type> (x86, openfirmware, hppa, efi) and
+ * described in <address>.catalog, EFI images with their subsystem,
+ * machine, compression and PE offset.
+ * 
  */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -21,6 +41,11 @@
 #include <strings.h>
 #include <sys/mman.h>
 
+#include "memfault.h"
+#include "iomem.h"
+#include "pageindex.h"
+#include "pcirom.h"
+
 /*
  * PCI bit encodings of pci_phys_hi of PCI 1275 address cell.
  */
@@ -73,7 +98,73 @@
 int		iflag = 0;
 int		aflag = 0;
 unsigned	flataddr = 0;
-unsigned long	haystacklen = 0;
+char           *skipfile = NULL;
+struct skipmap	skip;
+char           *regionfile = NULL;
+int		regionmask = REGION_DEFAULT;
+char           *indexfile = NULL;
+struct pageindex pidx;
+unsigned long	align = PCIROM_ALIGN;
+
+/*
+ * Write len bytes at p to filename.
+ */
+static void 
+save_file(const char *filename, const char *p, unsigned long len)
+{
+	int	fd;
+
+	if ((fd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0600)) < 0) {
+		perror("open(2)");
+		exit(1);
+	}
+	if (write(fd, p, len) < 0)
+		perror("write(2)");
+	close(fd);
+}
+
+/*
+ * Save the ROM at physical addr as <addr>.rom, every image of its chain
+ * as <addr>.<n>.<code type>, and what each image is in <addr>.catalog.
+ * Only the avail readable bytes are written.  Returns the chain length.
+ */
+static unsigned long 
+save_rom(unsigned long addr, const char *loc, unsigned long avail,
+	 struct pcirom *img, int nimg)
+{
+	char		filename[512];
+	unsigned long	total, len;
+	FILE		*cat;
+	int		i;
+
+	total = img[nimg - 1].offset + img[nimg - 1].length;
+	snprintf(filename, sizeof(filename), "%lx.rom", addr);
+	save_file(filename, loc, total < avail ? total : avail);
+	fprintf(stderr, "     Found PCI Option ROM!! Loc @ %#lx, %d image%s, %#lx bytes.  Saved to %s.\n",
+		addr, nimg, nimg == 1 ? "" : "s", total, filename);
+
+	snprintf(filename, sizeof(filename), "%lx.catalog", addr);
+	if ((cat = fopen(filename, "w")) == NULL) {
+		perror("fopen(3)");
+		exit(1);
+	}
+	fprintf(cat, "# PCI option ROM at %#lx, %d images, %#lx bytes\n", addr, nimg, total);
+
+	for (i = 0; i < nimg; i++) {
+		fprintf(stderr, "       ");
+		pcirom_catalog(stderr, &img[i], i);
+		pcirom_catalog(cat, &img[i], i);
+
+		if (img[i].offset >= avail)
+			continue;
+		len = avail - img[i].offset;
+		snprintf(filename, sizeof(filename), "%lx.%d.%s", addr, i,
+			 PCIROM_NAME(pcirom_codetypes, img[i].codetype));
+		save_file(filename, loc + img[i].offset, img[i].length < len ? img[i].length : len);
+	}
+	fclose(cat);
+	return total;
+}
 
 int 
 main(int argc, char **argv)
@@ -81,11 +172,15 @@ main(int argc, char **argv)
 	int		opt;
 	int		fd;
 	int		i;
-	char           *rmem, *mem, *loc;
+	char           *rmem, *mem, *loc, *end, *runend;
+	char * volatile	stop, * volatile resume, * volatile availend;	/* live across the sigsetjmp() */
 	unsigned	ofs;
-	unsigned short	hdr = 0xAA55;
+	unsigned long	pagesize = getpagesize();
+	unsigned long	bad, fault, idxstop, n;
+	struct regions	iomem = {0}, plan = {0};
+	volatile size_t	r = 0;
 
-	while ((opt = getopt(argc, argv, "i:a:")) != -1)
+	while ((opt = getopt(argc, argv, "i:a:g:R:S:T:X:")) != -1)
 		switch (opt) {
 		case 'i':
 			iflag++;/* Iterate through all ROM memory. */
@@ -94,11 +189,57 @@ main(int argc, char **argv)
 			aflag++;
 			flataddr = strtoul(optarg, NULL, 0);
 			break;
+		case 'R':
+			regionfile = optarg;
+			break;
+		case 'S':
+			skipfile = optarg;
+			break;
+		case 'X':
+			indexfile = optarg;
+			break;
+		case 'g':
+			align = strtoul(optarg, NULL, 0);
+			if (align < 2 || (align & (align - 1))) {
+				fprintf(stderr, "findrom: -g wants a power of two (512, 2048)\n");
+				exit(1);
+			}
+			break;
+		case 'T':
+			if ((regionmask = region_types_parse(optarg)) <= 0) {
+				fprintf(stderr, "findrom: bad -T '%s'\n", optarg);
+				exit(1);
+			}
+			break;
 		}
 
 	if (!aflag)
 		flataddr = 0;
 
+	/*
+	 * Plan which parts of the search area hold RAM/ROM worth searching.
+	 */
+	if (regionfile) {
+		if (regions_load(&iomem, regionfile) < 0 ||
+		    regions_plan(&iomem, regionmask, 0, PCI_MEMORY_ROM_SIZE, &plan) < 0)
+			exit(1);
+	} else if (regions_paint(&plan, 0, PCI_MEMORY_ROM_SIZE, REGION_ALL) < 0) {
+		exit(1);
+	}
+	skipmap_init(&skip, pagesize);
+	if (skipfile)
+		skipmap_load(&skip, skipfile);
+	if (memfault_install() < 0)
+		exit(1);
+	if (indexfile) {
+		if (pageindex_open(&pidx, indexfile) < 0)
+			exit(1);
+		for (n = 0; n < pidx.npages; n++)
+			if (pidx.class[n] & PAGE_BAD)
+				skipmap_add(&skip, pidx.base + n * pidx.pagesize);
+		skip.dirty = 0;
+	}
+
 	/*
 	 * Open /dev/mem cdev.
 	 */
@@ -127,76 +268,92 @@ main(int argc, char **argv)
 
 	fprintf(stderr, "      Page Size = %d bytes (%#x).\n", getpagesize(), getpagesize());
 	fprintf(stderr, "      Mmap(2) of /dev/mem 4GB (%#x bytes) @ %p.  File desc = %d, PROT_READ|PROT_WRITE\n", PCI_MEMORY_ROM_SIZE, mem, fd);
-	fprintf(stderr, "           Searching for PCI Option ROM / Expansion ROM header (0xAA55)\n");
+	fprintf(stderr, "           Searching for PCI Option ROM / Expansion ROM header (0xAA55) every %#lx bytes\n", align);
 
-	haystacklen = PCI_MEMORY_ROM_SIZE;
 	rmem = mem;
+	end = rmem + PCI_MEMORY_ROM_SIZE;
 
 	for (;;) {
-		int		romfd;
-		char		filename  [512], *ptr;
-		unsigned short *shptr;
-		unsigned       *pds;
-		unsigned	totalsz;
-		unsigned short	units;
-
-		hdr = 0xAA55;
+		struct pcirom	rom, img[PCIROM_MAX_IMAGES];
+		int		nimg;
 
-		printf("Calling memmem(%p, %zu, %p, %zu)...\n", mem, haystacklen, &hdr, sizeof(hdr));;
-		if ((loc = memmem(mem, haystacklen, &hdr, sizeof(hdr))) == NULL) {
+		if (mem >= end) {
 			fprintf(stderr, "\n     Finished search!\n");
 			munmap(rmem, PCI_MEMORY_ROM_SIZE);
 			close(fd);
+			break;
 		}
-		shptr = (unsigned short *)(loc + PCI_ROM_PCI_DATA_STRUCT_PTR);
-		pds = (unsigned *)shptr;
-		fprintf(stderr, "      PDS = loc + 0x18 (%p = %p + 0x18)\n", pds, loc);
-		fprintf(stderr, "      PDS dereferenced = %#x\n", *pds);
-
 		/*
-		 * Validate the PCI Data Structure Signature. 0x52494350 =
-		 * "PCIR"
+		 * Stay inside the planned region holding mem, or hop to the
+		 * next. The mapping starts at physical 0, so offsets are
+		 * addresses.
 		 */
-
-		if (strncmp((char *)pds, "PCIR", 4) != 0) {
-			mem = loc + sizeof(hdr);
+		while (r < plan.n && rmem + plan.r[r].end <= mem)
+			r++;
+		if (r == plan.n) {
+			mem = end;
 			continue;
 		}
-		printf("     PCIR at %p (offset %p)!\n", ptr, ptr - rmem);
+		if (mem < rmem + plan.r[r].start)
+			mem = rmem + plan.r[r].start;
+		runend = rmem + plan.r[r].end;
 
 		/*
-		 * Found a 0xAA55 where 0x18 bytes past is a pointer to a PDS
-		 * struct starting with 'PCIR'. 0x10 bytes later is the
-		 * length of the ROM in 512 byte units.
+		 * Search only up to the next known bad page, then hop over
+		 * it. Headers may be read up to the bad page even past the
+		 * region.
 		 */
-		ptr += 0x10;
-		units = *(unsigned short *)&ptr[0];
-		totalsz = units * 512;
-		fprintf(stderr, "     PCIR PDS String Located at offset 0x0 from pointer at offset 0x18.\n");
-		fprintf(stderr, "     Units = %d * 512 byte blocks.  Total size = %d.\n", units, totalsz);
-
-		sprintf(filename, "%x.rom", loc);
-		if ((romfd = open(filename, O_RDWR)) < 0) {
-			perror("open(2)");
-			exit(1);
+		bad = skipmap_next(&skip, mem - rmem);
+		if (bad <= (unsigned long)(mem - rmem)) {
+			mem = rmem + bad + pagesize;
+			continue;
 		}
+		stop = bad < (unsigned long)(runend - rmem) ? rmem + bad : runend;
+		resume = (stop == runend) ? runend : stop + pagesize;
+		availend = bad < (unsigned long)(end - rmem) ? rmem + bad : end;
+
 		/*
-		 * Write out (unsigned)units * 512 of data at 'loc' to ROM
-		 * file descriptor.
+		 * Hop over indexed pages without a signature.  Aligned
+		 * candidates never straddle a page.
 		 */
-		(void)write(romfd, loc, totalsz);
-		close(romfd);
+		n = pageindex_next(&pidx, mem - rmem, stop - rmem, 0, PAGE_ROMSIG);
+		if (rmem + n != mem) {
+			mem = rmem + n;
+			continue;
+		}
+		idxstop = pageindex_runend(&pidx, mem - rmem, stop - rmem, 0, PAGE_ROMSIG);
+		if (rmem + idxstop < stop)
+			stop = resume = rmem + idxstop;
+
+		memfault_armed = 1;
+		if (sigsetjmp(memfault_jmp, 1) != 0) {
+			fault = (unsigned long)memfault_addr;
+			if (fault < (unsigned long)rmem || fault >= (unsigned long)end) {
+				fprintf(stderr, "findrom: fault at %p outside the mapping\n", (void *)fault);
+				abort();
+			}
+			fault -= (unsigned long)rmem;
+			if (skipmap_add(&skip, fault))
+				fprintf(stderr, "      Unreadable page at %#lx, added to skip map.\n", fault & ~(pagesize - 1));
+			continue;
+		}
+		if ((loc = (char *)pcirom_find((unsigned char *)mem, (unsigned char *)stop,
+				       (unsigned char *)availend, mem - rmem, align, &rom)) == NULL) {
+			memfault_armed = 0;
+			mem = resume;
+			continue;
+		}
+		nimg = pcirom_walk((unsigned char *)loc, availend - loc, img, PCIROM_MAX_IMAGES);
+		memfault_armed = 0;
 
 		/*
-		 * Increment mem, decrement haystacklen.
+		 * A 0xAA55 on an aligned address whose pointer at 0x18 leads
+		 * to a sane 'PCIR' PDS, and the chain of images behind it.
 		 */
-		unsigned long	tmp = (unsigned long)(loc + totalsz) - (unsigned long)rmem;
-
-		fprintf(stderr, "     Found PCI Option ROM!! Loc @ %p (Offset = %lu).  Saved to %s.\n", loc, (unsigned long)loc - (unsigned long)mem, filename);
-		mem = loc + totalsz;
-		haystacklen -= tmp;
+		mem = loc + save_rom(loc - rmem, loc, availend - loc, img, nimg);
 	}
 
-	close(fd);
+	if (skipfile)
+		skipmap_save(&skip, skipfile);
 	exit(0);
 }
@@ -0,0 +1,376 @@
+/*
+ * iomem.h - Region planner: which physical ranges are worth scanning.
+ *
+ * Parses /proc/iomem (or any file in the same format, for offline runs)
+ * or the /sys/firmware/memmap directory into a flat list of typed,
+ * disjoint, sorted intervals.  Nested /proc/iomem entries override their
+ * parent when they name something we know (e.g. "System ROM" inside
+ * "Reserved"); anything else ("Kernel code", driver names) inherits the
+ * parent's type.  Addresses not listed at all are holes.
+ *
+ * Scanners intersect their -A/-L range with the types they want (-T) so
+ * that holes and MMIO windows are never touched.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef IOMEM_H
+#define IOMEM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define REGION_RAM	0x01	/* System RAM */
+#define REGION_RESERVED	0x02	/* Reserved, E820 holes */
+#define REGION_ROM	0x04	/* System/Video/Adapter ROM */
+#define REGION_ACPI	0x08	/* ACPI Tables, ACPI NVS */
+#define REGION_PCI	0x10	/* PCI bus windows, ECAM/MMCONFIG */
+#define REGION_BAR	0x20	/* PCI device BARs (dddd:bb:dd.f) */
+#define REGION_OTHER	0x40	/* IOAPIC, HPET, anything else */
+#define REGION_ALL	0x7f
+
+#define REGION_DEFAULT	(REGION_RAM | REGION_ROM)
+
+/*
+ * One interval, [start, end).
+ */
+struct region {
+	unsigned long	start;
+	unsigned long	end;
+	int		type;
+};
+
+struct regions {
+	struct region	*r;
+	size_t		n;
+	size_t		cap;
+};
+
+static const struct {
+	const char	*name;
+	int		type;
+} region_names[] = {
+	{ "ram",	REGION_RAM },
+	{ "reserved",	REGION_RESERVED },
+	{ "rom",	REGION_ROM },
+	{ "acpi",	REGION_ACPI },
+	{ "pci",	REGION_PCI },
+	{ "bar",	REGION_BAR },
+	{ "other",	REGION_OTHER },
+	{ "all",	REGION_ALL },
+};
+
+/*
+ * The name of a type, or of each type set in a mask that regions_plan()
+ * merged, joined with '+' ("ram+rom").  Returns a static buffer.
+ */
+static inline const char *region_name(int type)
+{
+	static char	buf[64];
+	size_t		i, n = 0;
+
+	for (i = 0; i < sizeof(region_names) / sizeof(region_names[0]); i++)
+		if (region_names[i].type == type)
+			return region_names[i].name;
+	buf[0] = '\0';
+	for (i = 0; i < sizeof(region_names) / sizeof(region_names[0]); i++)
+		if (region_names[i].type != REGION_ALL && (type & region_names[i].type))
+			n += snprintf(buf + n, sizeof(buf) - n, "%s%s", n ? "+" : "", region_names[i].name);
+	return n ? buf : "?";
+}
+
+/*
+ * Parse "ram,rom,..." into a type mask.  Returns -1 on an unknown name.
+ */
+static inline int region_types_parse(const char *spec)
+{
+	char	buf[256], *tok, *save;
+	int	mask = 0;
+	size_t	i;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(region_names) / sizeof(region_names[0]); i++)
+			if (strcasecmp(tok, region_names[i].name) == 0)
+				break;
+		if (i == sizeof(region_names) / sizeof(region_names[0]))
+			return -1;
+		mask |= region_names[i].type;
+	}
+	return mask;
+}
+
+/*
+ * Classify a /proc/iomem or memmap name.  0 means "not ours, inherit".
+ */
+static inline int region_classify(const char *name)
+{
+	unsigned	d, b, s, f;
+
+	if (strcasecmp(name, "System RAM") == 0 || strcasecmp(name, "Persistent Memory") == 0)
+		return REGION_RAM;
+	if (strncasecmp(name, "Reserved", 8) == 0 || strcasecmp(name, "Unknown E820 type") == 0)
+		return REGION_RESERVED;
+	if (strstr(name, "ROM") != NULL)
+		return REGION_ROM;
+	if (strncmp(name, "ACPI", 4) == 0)
+		return REGION_ACPI;
+	if (strncmp(name, "PCI Bus", 7) == 0 || strncmp(name, "PCI ECAM", 8) == 0 ||
+	    strncmp(name, "PCI MMCONFIG", 12) == 0)
+		return REGION_PCI;
+	if (sscanf(name, "%x:%x:%x.%x", &d, &b, &s, &f) == 4)
+		return REGION_BAR;
+	return 0;
+}
+
+/*
+ * Paint [start, end) with type over whatever was there.
+ */
+static inline int regions_paint(struct regions *rl, unsigned long start, unsigned long end, int type)
+{
+	struct region	*v;
+	size_t		i, j, n;
+
+	if (start >= end)
+		return 0;
+
+	/* Worst case every interval splits in two, plus the new one. */
+	if (rl->n * 2 + 1 > rl->cap) {
+		rl->cap = rl->n * 2 + 64;
+		if ((v = realloc(rl->r, rl->cap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			return -1;
+		}
+		rl->r = v;
+	}
+
+	n = rl->n;
+	for (i = 0; i < n; i++) {
+		struct region r = rl->r[i];
+
+		if (r.end <= start || r.start >= end)
+			continue;
+		if (r.start < start && r.end > end) {
+			rl->r[i].end = start;
+			rl->r[rl->n].start = end;
+			rl->r[rl->n].end = r.end;
+			rl->r[rl->n].type = r.type;
+			rl->n++;
+		} else if (r.start < start) {
+			rl->r[i].end = start;
+		} else if (r.end > end) {
+			rl->r[i].start = end;
+		} else {
+			rl->r[i].end = rl->r[i].start;	/* swallowed, dropped below */
+		}
+	}
+	rl->r[rl->n].start = start;
+	rl->r[rl->n].end = end;
+	rl->r[rl->n].type = type;
+	rl->n++;
+
+	for (i = j = 0; i < rl->n; i++)
+		if (rl->r[i].start < rl->r[i].end)
+			rl->r[j++] = rl->r[i];
+	rl->n = j;
+
+	/* Few entries; insertion sort keeps this simple. */
+	for (i = 1; i < rl->n; i++) {
+		struct region r = rl->r[i];
+
+		for (j = i; j > 0 && rl->r[j - 1].start > r.start; j--)
+			rl->r[j] = rl->r[j - 1];
+		rl->r[j] = r;
+	}
+	return 0;
+}
+
+/*
+ * Read one line of "start-end : name" with its nesting depth (two spaces
+ * per level).  end is inclusive, as printed by the kernel.
+ */
+static inline int iomem_parse_line(const char *line, unsigned long *start, unsigned long *end,
+			    int *depth, char *name, size_t namelen)
+{
+	const char	*p = line;
+	char		*q;
+	size_t		len;
+
+	for (*depth = 0; p[0] == ' ' && p[1] == ' '; p += 2)
+		(*depth)++;
+
+	*start = strtoul(p, &q, 16);
+	if (q == p || *q != '-')
+		return -1;
+	p = q + 1;
+	*end = strtoul(p, &q, 16);
+	if (q == p)
+		return -1;
+	p = q;
+	while (*p == ' ' || *p == ':')
+		p++;
+
+	len = strcspn(p, "\n");
+	if (len >= namelen)
+		len = namelen - 1;
+	memcpy(name, p, len);
+	name[len] = '\0';
+	return 0;
+}
+
+static inline int iomem_load_file(struct regions *rl, const char *filename)
+{
+	FILE		*fp;
+	char		line[512], name[256];
+	unsigned long	start, end;
+	int		depth, type, allzero = 1;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		perror("fopen(3)");
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (iomem_parse_line(line, &start, &end, &depth, name, sizeof(name)) < 0)
+			continue;
+		if (start || end)
+			allzero = 0;
+		type = region_classify(name);
+		if (type == 0) {
+			if (depth > 0)
+				continue;
+			type = REGION_OTHER;
+		}
+		if (regions_paint(rl, start, end + 1, type) < 0) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+
+	if (allzero && rl->n) {
+		fprintf(stderr, "%s: all addresses are zero, run as root\n", filename);
+		rl->n = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * /sys/firmware/memmap/N/{start,end,type}, one flat entry per directory.
+ */
+static inline int memmap_load_dir(struct regions *rl, const char *dirname)
+{
+	DIR		*dir;
+	struct dirent	*de;
+	FILE		*fp;
+	char		path[1024], name[256];
+	unsigned long	start, end;
+	int		type, ok;
+
+	if ((dir = opendir(dirname)) == NULL) {
+		perror("opendir(3)");
+		return -1;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!isdigit((unsigned char)de->d_name[0]))
+			continue;
+
+		ok = 1;
+		snprintf(path, sizeof(path), "%s/%s/start", dirname, de->d_name);
+		if ((fp = fopen(path, "r")) == NULL || fscanf(fp, "%lx", &start) != 1)
+			ok = 0;
+		if (fp)
+			fclose(fp);
+		snprintf(path, sizeof(path), "%s/%s/end", dirname, de->d_name);
+		if ((fp = fopen(path, "r")) == NULL || fscanf(fp, "%lx", &end) != 1)
+			ok = 0;
+		if (fp)
+			fclose(fp);
+		snprintf(path, sizeof(path), "%s/%s/type", dirname, de->d_name);
+		if ((fp = fopen(path, "r")) == NULL || fgets(name, sizeof(name), fp) == NULL)
+			ok = 0;
+		if (fp)
+			fclose(fp);
+		if (!ok)
+			continue;
+
+		name[strcspn(name, "\n")] = '\0';
+		if ((type = region_classify(name)) == 0)
+			type = REGION_OTHER;
+		if (regions_paint(rl, start, end + 1, type) < 0) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+/*
+ * Load /proc/iomem-format files or a memmap directory.
+ */
+static inline int regions_load(struct regions *rl, const char *path)
+{
+	struct stat	sb;
+
+	if (stat(path, &sb) < 0) {
+		perror("stat(2)");
+		return -1;
+	}
+	if (S_ISDIR(sb.st_mode))
+		return memmap_load_dir(rl, path);
+	return iomem_load_file(rl, path);
+}
+
+/*
+ * The parts of [addr, addr + limit) whose type is in mask, as sorted
+ * disjoint intervals in out.  Touching intervals are merged so a needle can
+ * still match across, say, the end of RAM and the start of a ROM.
+ */
+static inline int regions_plan(struct regions *rl, int mask, unsigned long addr,
+			unsigned long limit, struct regions *out)
+{
+	unsigned long	end = addr + limit;
+	unsigned long	s, e;
+	struct region	*v;
+	size_t		i;
+
+	out->n = 0;
+	for (i = 0; i < rl->n; i++) {
+		if (!(rl->r[i].type & mask))
+			continue;
+		s = rl->r[i].start > addr ? rl->r[i].start : addr;
+		e = rl->r[i].end < end ? rl->r[i].end : end;
+		if (s >= e)
+			continue;
+
+		if (out->n && out->r[out->n - 1].end == s) {
+			out->r[out->n - 1].end = e;
+			out->r[out->n - 1].type |= rl->r[i].type;
+			continue;
+		}
+		if (out->n == out->cap) {
+			out->cap = out->cap ? out->cap * 2 : 64;
+			if ((v = realloc(out->r, out->cap * sizeof(*v))) == NULL) {
+				perror("realloc(3)");
+				return -1;
+			}
+			out->r = v;
+		}
+		out->r[out->n].start = s;
+		out->r[out->n].end = e;
+		out->r[out->n].type = rl->r[i].type;
+		out->n++;
+	}
+	return 0;
+}
+
+#endif /* IOMEM_H */
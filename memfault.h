@@ -0,0 +1,207 @@
+/*
+ * memfault.h - Survive SIGBUS/SIGSEGV on unreadable /dev/mem pages.
+ *
+ * Touching a reserved or MMIO-backed page through a /dev/mem mapping can
+ * raise SIGBUS or SIGSEGV.  A scanner arms the guard around its accesses:
+ *
+ *	memfault_armed = 1;
+ *	if (sigsetjmp(memfault_jmp, 1) == 0) {
+ *		... touch the mapping ...
+ *		memfault_armed = 0;
+ *	} else {
+ *		... memfault_addr is the faulting (virtual) address ...
+ *	}
+ *
+ * A local that changes after the sigsetjmp() and is read after the jump
+ * must be volatile; simplest is to keep the guarded access in a small
+ * function of its own that returns -1 on a fault.
+ *
+ * The handler only jumps when the faulting thread is armed; any other fault
+ * is a real bug and aborts the process.  It does not reset the signal to
+ * SIG_DFL and re-fault, as a disposition is process-wide: an armed -j
+ * worker faulting at the same moment would be killed rather than skip its
+ * page.  The price is that the core shows SIGABRT from the handler, with
+ * the faulting frame below it, instead of the SIGSEGV or SIGBUS itself.
+ *
+ * Bad pages go into a skip map: a sorted list of physical page addresses,
+ * kept in a text file (one address per line, '#' comments) so later runs
+ * avoid those pages up front.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef MEMFAULT_H
+#define MEMFAULT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+static __thread sigjmp_buf		memfault_jmp;
+static __thread volatile sig_atomic_t	memfault_armed = 0;
+static __thread void * volatile		memfault_addr;
+
+struct skipmap {
+	unsigned long	*page;
+	size_t		n;
+	size_t		cap;
+	int		dirty;
+	unsigned long	pagesize;
+	pthread_mutex_t	lock;
+};
+
+static inline void memfault_handler(int sig, siginfo_t *si, void *uc)
+{
+	(void)sig;
+	(void)uc;
+
+	if (!memfault_armed)
+		abort();
+	memfault_armed = 0;
+	memfault_addr = si->si_addr;
+	siglongjmp(memfault_jmp, 1);
+}
+
+static inline int memfault_install(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = memfault_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGBUS, &sa, NULL) < 0 || sigaction(SIGSEGV, &sa, NULL) < 0) {
+		perror("sigaction(2)");
+		return -1;
+	}
+	return 0;
+}
+
+static inline void skipmap_init(struct skipmap *sm, unsigned long pagesize)
+{
+	memset(sm, 0, sizeof(*sm));
+	sm->pagesize = pagesize;
+	pthread_mutex_init(&sm->lock, NULL);
+}
+
+/*
+ * Index of the first bad page >= page.  Caller holds the lock.
+ */
+static inline size_t skipmap_search(struct skipmap *sm, unsigned long page)
+{
+	size_t	lo = 0, hi = sm->n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sm->page[mid] < page)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Record the page holding addr.  Returns 1 if it was new.
+ */
+static inline int skipmap_add(struct skipmap *sm, unsigned long addr)
+{
+	unsigned long	page = addr & ~(sm->pagesize - 1);
+	unsigned long	*v;
+	size_t		i;
+
+	pthread_mutex_lock(&sm->lock);
+	i = skipmap_search(sm, page);
+	if (i < sm->n && sm->page[i] == page) {
+		pthread_mutex_unlock(&sm->lock);
+		return 0;
+	}
+	if (sm->n == sm->cap) {
+		sm->cap = sm->cap ? sm->cap * 2 : 64;
+		if ((v = realloc(sm->page, sm->cap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		sm->page = v;
+	}
+	memmove(&sm->page[i + 1], &sm->page[i], (sm->n - i) * sizeof(*sm->page));
+	sm->page[i] = page;
+	sm->n++;
+	sm->dirty = 1;
+	pthread_mutex_unlock(&sm->lock);
+	return 1;
+}
+
+/*
+ * First bad page that overlaps [addr, ...), or ~0UL if there is none.
+ */
+static inline unsigned long skipmap_next(struct skipmap *sm, unsigned long addr)
+{
+	unsigned long	page = addr & ~(sm->pagesize - 1);
+	unsigned long	bad = ~0UL;
+	size_t		i;
+
+	pthread_mutex_lock(&sm->lock);
+	i = skipmap_search(sm, page);
+	if (i < sm->n)
+		bad = sm->page[i];
+	pthread_mutex_unlock(&sm->lock);
+	return bad;
+}
+
+/*
+ * Load a skip map file.  A missing file is an empty map.
+ */
+static inline int skipmap_load(struct skipmap *sm, const char *filename)
+{
+	FILE	*fp;
+	char	line[128];
+	char	*end;
+	unsigned long	addr;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		addr = strtoul(line, &end, 0);
+		if (end == line)
+			continue;
+		skipmap_add(sm, addr);
+	}
+	fclose(fp);
+	sm->dirty = 0;
+	return 0;
+}
+
+/*
+ * Rewrite the skip map file if pages were added since it was loaded.
+ */
+static inline int skipmap_save(struct skipmap *sm, const char *filename)
+{
+	FILE	*fp;
+	size_t	i;
+
+	if (!sm->dirty)
+		return 0;
+
+	if ((fp = fopen(filename, "w")) == NULL) {
+		perror("fopen(3)");
+		return -1;
+	}
+	fprintf(fp, "# skip map: unreadable physical pages (%lu bytes each)\n", sm->pagesize);
+	for (i = 0; i < sm->n; i++)
+		fprintf(fp, "%#lx\n", sm->page[i]);
+	if (fclose(fp) != 0) {
+		perror("fclose(3)");
+		return -1;
+	}
+	sm->dirty = 0;
+	return 0;
+}
+
+#endif /* MEMFAULT_H */
@@ -0,0 +1,359 @@
+/*
+ * outpipe.h - Overlap reading /dev/mem with writing the dump.
+ *
+ * The reading thread fills buffers from a small ring and hands them to a
+ * writer thread, which drains whatever has queued up as one batch:
+ *
+ *	b = outpipe_get(&out);		wait for a free buffer
+ *	... fill b->data, set b->len ...
+ *	outpipe_put(&out, fd, off, 1);	queue it; 1 = close fd once written
+ *	...
+ *	outpipe_finish(&out, 1);	drain, then one syncfs(2) at the end
+ *
+ * A batch goes to the kernel as one io_uring_enter(2) when the kernel has
+ * io_uring (set up with raw system calls, no liburing), otherwise as a
+ * pwrite(2) per buffer.  Either way the reader carries on filling the
+ * rest of the ring meanwhile.  Nothing is fsync(2)ed per file: the only
+ * durability barrier is the one syncfs(2) in outpipe_finish().
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef OUTPIPE_H
+#define OUTPIPE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#define OUTPIPE_BUFS	16	/* power of two */
+
+struct outbuf {
+	char		*data;
+	size_t		len;
+	int		fd;
+	off_t		off;
+	int		closefd;	/* close fd once this is written */
+	struct iovec	iov;
+};
+
+struct outpipe {
+	struct outbuf	buf[OUTPIPE_BUFS];
+	size_t		bufsize;
+	unsigned long	head;		/* buffers queued */
+	unsigned long	tail;		/* buffers written */
+	int		done;
+	int		error;
+	int		syncfd;		/* dup of the first fd queued */
+	unsigned long	bytes;
+	unsigned long	batches;
+	const char	*engine;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	pthread_t	tid;
+	/* io_uring, ringfd < 0 if not in use */
+	int		ringfd;
+	unsigned	*sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned	*cqhead, *cqtail, *cqmask;
+	void		*sqring, *cqring;
+	size_t		sqringlen, cqringlen, sqeslen;
+#ifdef __NR_io_uring_setup
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+#endif
+};
+
+static inline int outpipe_pwrite(struct outpipe *p, int fd, const char *data, size_t len, off_t off)
+{
+	ssize_t	k;
+
+	while (len > 0) {
+		if ((k = pwrite(fd, data, len, off)) < 0 && errno == EINTR)
+			continue;
+		if (k <= 0) {
+			perror("pwrite(2)");
+			p->error = -1;
+			return -1;
+		}
+		data += k;
+		len -= k;
+		off += k;
+	}
+	return 0;
+}
+
+#ifdef __NR_io_uring_setup
+/*
+ * One submission and completion ring, big enough for a whole batch.
+ */
+static inline int outpipe_uring_setup(struct outpipe *p)
+{
+	struct io_uring_params	par;
+	char			*sq, *cq;
+
+	memset(&par, 0, sizeof(par));
+	if ((p->ringfd = syscall(__NR_io_uring_setup, OUTPIPE_BUFS, &par)) < 0)
+		return -1;
+
+	p->sqringlen = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+	p->cqringlen = par.cq_off.cqes + par.cq_entries * sizeof(struct io_uring_cqe);
+	p->sqring = mmap(NULL, p->sqringlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			 p->ringfd, IORING_OFF_SQ_RING);
+	p->cqring = mmap(NULL, p->cqringlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			 p->ringfd, IORING_OFF_CQ_RING);
+	p->sqeslen = par.sq_entries * sizeof(struct io_uring_sqe);
+	p->sqes = mmap(NULL, p->sqeslen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		       p->ringfd, IORING_OFF_SQES);
+	if (p->sqring == MAP_FAILED || p->cqring == MAP_FAILED || p->sqes == MAP_FAILED) {
+		close(p->ringfd);
+		p->ringfd = -1;
+		return -1;
+	}
+
+	sq = p->sqring;
+	cq = p->cqring;
+	p->sqhead = (unsigned *)(sq + par.sq_off.head);
+	p->sqtail = (unsigned *)(sq + par.sq_off.tail);
+	p->sqmask = (unsigned *)(sq + par.sq_off.ring_mask);
+	p->sqarray = (unsigned *)(sq + par.sq_off.array);
+	p->cqhead = (unsigned *)(cq + par.cq_off.head);
+	p->cqtail = (unsigned *)(cq + par.cq_off.tail);
+	p->cqmask = (unsigned *)(cq + par.cq_off.ring_mask);
+	p->cqes = (struct io_uring_cqe *)(cq + par.cq_off.cqes);
+	return 0;
+}
+
+/*
+ * Write buffers [first, first + n) with one io_uring_enter(2).  Short
+ * writes are finished with pwrite(2).
+ */
+static inline void outpipe_uring_batch(struct outpipe *p, unsigned long first, unsigned long n)
+{
+	struct io_uring_sqe	*sqe;
+	struct io_uring_cqe	*cqe;
+	struct outbuf		*b;
+	unsigned		tail, head, idx;
+	unsigned long		i, submitted, reaped;
+	int			k;
+
+	tail = *p->sqtail;
+	for (i = 0; i < n; i++) {
+		b = &p->buf[(first + i) % OUTPIPE_BUFS];
+		b->iov.iov_base = b->data;
+		b->iov.iov_len = b->len;
+		idx = tail & *p->sqmask;
+		sqe = &p->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = b->fd;
+		sqe->addr = (unsigned long)&b->iov;
+		sqe->len = 1;
+		sqe->off = b->off;
+		sqe->user_data = first + i;
+		p->sqarray[idx] = idx;
+		tail++;
+	}
+	__atomic_store_n(p->sqtail, tail, __ATOMIC_RELEASE);
+
+	for (submitted = reaped = 0; reaped < n; ) {
+		k = syscall(__NR_io_uring_enter, p->ringfd, n - submitted, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0);
+		if (k < 0 && errno == EINTR)
+			continue;
+		if (k < 0) {
+			perror("io_uring_enter(2)");
+			p->error = -1;
+			return;
+		}
+		submitted += k;
+		head = *p->cqhead;
+		while (head != __atomic_load_n(p->cqtail, __ATOMIC_ACQUIRE)) {
+			cqe = &p->cqes[head & *p->cqmask];
+			b = &p->buf[cqe->user_data % OUTPIPE_BUFS];
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror("io_uring write");
+				p->error = -1;
+			} else if ((size_t)cqe->res < b->len) {
+				outpipe_pwrite(p, b->fd, b->data + cqe->res, b->len - cqe->res,
+					       b->off + cqe->res);
+			}
+			head++;
+			reaped++;
+		}
+		__atomic_store_n(p->cqhead, head, __ATOMIC_RELEASE);
+	}
+}
+#endif
+
+static inline void *outpipe_writer(void *arg)
+{
+	struct outpipe	*p = arg;
+	unsigned long	first, n, i;
+	struct outbuf	*b;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->tail == p->head && !p->done)
+			pthread_cond_wait(&p->cv, &p->lock);
+		first = p->tail;
+		n = p->head - p->tail;
+		pthread_mutex_unlock(&p->lock);
+		if (n == 0)
+			break;
+
+#ifdef __NR_io_uring_setup
+		if (p->ringfd >= 0)
+			outpipe_uring_batch(p, first, n);
+		else
+#endif
+		for (i = 0; i < n; i++) {
+			b = &p->buf[(first + i) % OUTPIPE_BUFS];
+			outpipe_pwrite(p, b->fd, b->data, b->len, b->off);
+		}
+
+		for (i = 0; i < n; i++) {
+			b = &p->buf[(first + i) % OUTPIPE_BUFS];
+			p->bytes += b->len;
+			if (b->closefd)
+				close(b->fd);
+		}
+		p->batches++;
+
+		pthread_mutex_lock(&p->lock);
+		p->tail += n;
+		pthread_cond_broadcast(&p->cv);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Allocate OUTPIPE_BUFS buffers of bufsize bytes and start the writer.
+ */
+static inline int outpipe_start(struct outpipe *p, size_t bufsize)
+{
+	int	i;
+
+	memset(p, 0, sizeof(*p));
+	p->bufsize = bufsize;
+	p->syncfd = -1;
+	p->ringfd = -1;
+	for (i = 0; i < OUTPIPE_BUFS; i++)
+		if ((p->buf[i].data = malloc(bufsize)) == NULL) {
+			perror("malloc(3)");
+			return -1;
+		}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cv, NULL);
+
+	p->engine = "pwrite(2)";
+#ifdef __NR_io_uring_setup
+	if (outpipe_uring_setup(p) == 0)
+		p->engine = "io_uring";
+#endif
+	if ((errno = pthread_create(&p->tid, NULL, outpipe_writer, p)) != 0) {
+		perror("pthread_create(3)");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Next free buffer, waiting for the writer if the ring is full.
+ */
+static inline struct outbuf *outpipe_get(struct outpipe *p)
+{
+	struct outbuf	*b;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->head - p->tail == OUTPIPE_BUFS)
+		pthread_cond_wait(&p->cv, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	b = &p->buf[p->head % OUTPIPE_BUFS];
+	b->len = 0;
+	return b;
+}
+
+/*
+ * Queue the buffer outpipe_get() returned: b->len bytes to fd at off.
+ */
+static inline void outpipe_put(struct outpipe *p, int fd, off_t off, int closefd)
+{
+	struct outbuf	*b = &p->buf[p->head % OUTPIPE_BUFS];
+
+	if (p->syncfd < 0)
+		p->syncfd = dup(fd);
+	b->fd = fd;
+	b->off = off;
+	b->closefd = closefd;
+	pthread_mutex_lock(&p->lock);
+	p->head++;
+	pthread_cond_signal(&p->cv);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Queue a copy of len bytes at src, a buffer at a time.  closefd goes
+ * with the last one.
+ */
+static inline void outpipe_write(struct outpipe *p, int fd, off_t off, const void *src, size_t len,
+			  int closefd)
+{
+	const char	*s = src;
+	struct outbuf	*b;
+
+	do {
+		b = outpipe_get(p);
+		b->len = len < p->bufsize ? len : p->bufsize;
+		memcpy(b->data, s, b->len);
+		s += b->len;
+		len -= b->len;
+		outpipe_put(p, fd, off, closefd && len == 0);
+		off += b->len;
+	} while (len > 0);
+}
+
+/*
+ * Drain the ring and stop the writer.  With durable, one syncfs(2) on the
+ * filesystem written to stands in for an fsync(2) per file.
+ */
+static inline int outpipe_finish(struct outpipe *p, int durable)
+{
+	int	i;
+
+	pthread_mutex_lock(&p->lock);
+	p->done = 1;
+	pthread_cond_broadcast(&p->cv);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(p->tid, NULL);
+
+	if (p->syncfd >= 0) {
+		if (durable && syscall(__NR_syncfs, p->syncfd) < 0) {
+			perror("syncfs(2)");
+			p->error = -1;
+		}
+		close(p->syncfd);
+	}
+#ifdef __NR_io_uring_setup
+	if (p->ringfd >= 0) {
+		munmap(p->sqring, p->sqringlen);
+		munmap(p->cqring, p->cqringlen);
+		munmap(p->sqes, p->sqeslen);
+		close(p->ringfd);
+	}
+#endif
+	for (i = 0; i < OUTPIPE_BUFS; i++)
+		free(p->buf[i].data);
+	return p->error;
+}
+
+#endif /* OUTPIPE_H */
@@ -0,0 +1,351 @@
+/*
+ * pageindex(1) - Classify every page of a range once, for the scanners.
+ *
+ * - One parallel pass (-j N threads, -P pins them) over -A/-L of /dev/mem
+ *   or any -F file.  Every page is put in classes: all-zero, all-0xff,
+ *   holds a 55 aa ROM signature, text-like, high-entropy (see pageindex.h).
+ * - The index is written to -o as a small mmap(2)-able file: a header and
+ *   one byte per page.  findmem -X, pcifindrom -X and pcireadrom -X read it
+ *   and leave alone pages that cannot hold what they look for.
+ * - -R /proc/iomem / -T types plan the pass like findmem; pages outside
+ *   the plan stay unindexed and are always scanned.
+ * - SIGBUS/SIGSEGV pages are marked bad and go into the -S skip map.
+ *
+ * Usage: pageindex -F /dev/mem -A 0 -L 0x100000000 -R /proc/iomem -j 8 -o mem.idx
+ *
+ * Build: cc -O2 -o pageindex pageindex.c -lpthread
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memfault.h"
+#include "iomem.h"
+#include "pageindex.h"
+
+#define MAX_JOBS	1024
+#define CHUNK_PAGES	256	/* pages mapped per work item */
+
+/*
+ * Text: at least TEXT_PCT% printable ASCII or whitespace.
+ * Entropy: Renyi (collision) entropy of the byte histogram above 7.5
+ * bits/byte, i.e. sum(c^2) * 2^7.5 <= n^2.  Random data sits near 7.9
+ * bits/byte for a 4KB page, x86 code around 6, text around 4.5.
+ */
+#define TEXT_PCT	90
+#define ENTROPY_DIV	181	/* 2^7.5 */
+
+struct chunk {
+	unsigned long	start;
+	unsigned long	end;
+};
+
+int		scanfd;
+unsigned long	pagesize;
+unsigned long	base;
+unsigned char	*class;
+struct chunk	*chunks;
+unsigned long	nchunks;
+unsigned long	nexttake = 0;
+int		jobs = 1;
+int		pflag = 0;
+long		workercpu[MAX_JOBS];
+
+struct skipmap	skip;
+char		*skipfile = NULL;
+char		*regionfile = NULL;
+int		regionmask = REGION_DEFAULT;
+
+static int classify(const unsigned char *p, unsigned long len)
+{
+	const unsigned long	*w = (const unsigned long *)p;
+	unsigned long		or = 0, and = ~0UL, sumsq = 0;
+	unsigned long		count[256] = { 0 };
+	unsigned long		i, text = 0;
+	int			c = PAGE_SEEN;
+
+	for (i = 0; i < len / sizeof(*w); i++) {
+		or |= w[i];
+		and &= w[i];
+	}
+	if (or == 0)
+		return c | PAGE_ZERO;
+	if (and == ~0UL)
+		return c | PAGE_FF;
+
+	for (i = 0; i < len; i++)
+		count[p[i]]++;
+	for (i = 0x20; i < 0x7f; i++)
+		text += count[i];
+	text += count['\t'] + count['\n'] + count['\r'];
+	if (text * 100 >= len * TEXT_PCT)
+		c |= PAGE_TEXT;
+
+	for (i = 0; i < 256; i++)
+		sumsq += count[i] * count[i];
+	if (sumsq * ENTROPY_DIV <= len * len)
+		c |= PAGE_ENTROPY;
+
+	if ((count[0x55] && count[0xaa] && memmem(p, len, "\x55\xaa", 2)) || p[len - 1] == 0x55)
+		c |= PAGE_ROMSIG;
+	return c;
+}
+
+static void index_chunk(struct chunk *ck)
+{
+	unsigned long	mapaddr = ck->start;
+	unsigned long	maplen = ck->end - ck->start;
+	unsigned long	page, fault;
+	unsigned char	*mem;
+
+	if ((mem = mmap(NULL, maplen, PROT_READ, MAP_SHARED, scanfd,
+			(off_t)mapaddr)) == MAP_FAILED) {
+		perror("mmap(2)");
+		return;		/* left unindexed, so always scanned */
+	}
+	(void)madvise(mem, maplen, MADV_SEQUENTIAL);
+
+	for (page = ck->start; page < ck->end; page += pagesize) {
+		if (skipmap_next(&skip, page) == page) {
+			class[(page - base) / pagesize] = PAGE_SEEN | PAGE_BAD;
+			continue;
+		}
+		memfault_armed = 1;
+		if (sigsetjmp(memfault_jmp, 1) == 0) {
+			class[(page - base) / pagesize] = classify(mem + (page - mapaddr), pagesize);
+			memfault_armed = 0;
+			continue;
+		}
+		fault = mapaddr + ((unsigned long)memfault_addr - (unsigned long)mem);
+		if (skipmap_add(&skip, fault))
+			fprintf(stderr, "       Unreadable page at %#lx, added to skip map.\n", page);
+		class[(page - base) / pagesize] = PAGE_SEEN | PAGE_BAD;
+	}
+	munmap(mem, maplen);
+}
+
+static void *worker(void *arg)
+{
+	long		cpu = workercpu[(long)arg];
+	cpu_set_t	set;
+	unsigned long	k;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+			perror("pthread_setaffinity_np(3)");
+	}
+
+	while ((k = __sync_fetch_and_add(&nexttake, 1)) < nchunks)
+		index_chunk(&chunks[k]);
+	return NULL;
+}
+
+/*
+ * Cut the planned regions, widened to whole pages, into chunks.
+ */
+static int plan_chunks(struct regions *plan)
+{
+	unsigned long	s, e, cs, ce, last = 0;
+	size_t		i;
+	int		pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		nchunks = 0;
+		last = 0;
+		for (i = 0; i < plan->n; i++) {
+			s = plan->r[i].start & ~(pagesize - 1);
+			e = (plan->r[i].end + pagesize - 1) & ~(pagesize - 1);
+			if (s < last)
+				s = last;	/* page shared with the previous region */
+			for (cs = s; cs < e; cs = ce) {
+				ce = (e - cs > CHUNK_PAGES * pagesize) ? cs + CHUNK_PAGES * pagesize : e;
+				if (pass) {
+					chunks[nchunks].start = cs;
+					chunks[nchunks].end = ce;
+				}
+				nchunks++;
+			}
+			if (e > last)
+				last = e;
+		}
+		if (!pass && (chunks = calloc(nchunks ? nchunks : 1, sizeof(*chunks))) == NULL) {
+			perror("calloc(3)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int			opt, outfd, i;
+	char			*filename = "/dev/mem";
+	char			*outfile = NULL;
+	unsigned long		addr = 0, limit = 0, npages, n;
+	unsigned long		counts[8] = { 0 };
+	struct regions		iomem = { 0 }, plan = { 0 };
+	struct pageindex_hdr	*hdr;
+	struct stat		sb;
+	pthread_t		tid[MAX_JOBS];
+	cpu_set_t		online;
+	long			cpu = -1;
+	size_t			outlen, k;
+
+	while ((opt = getopt(argc, argv, "A:L:F:R:S:T:j:Po:")) != -1) switch (opt) {
+		case 'A':
+			addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			limit = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			filename = optarg;
+			break;
+		case 'R':
+			regionfile = optarg;
+			break;
+		case 'S':
+			skipfile = optarg;
+			break;
+		case 'T':
+			if ((regionmask = region_types_parse(optarg)) <= 0) {
+				fprintf(stderr, "pageindex: bad -T '%s' (want ram,reserved,rom,acpi,pci,bar,other,all)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			if (jobs < 1 || jobs > MAX_JOBS) {
+				fprintf(stderr, "pageindex: -j wants 1..%d\n", MAX_JOBS);
+				exit(1);
+			}
+			break;
+		case 'P':
+			pflag++;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+	}
+
+	if (!outfile) {
+		fprintf(stderr, "Usage: pageindex -o index [ -F /dev/mem ] [ -A base ] [ -L limit ]\n");
+		fprintf(stderr, "                 [ -R /proc/iomem [ -T ram,rom,... ] ] [ -S skipmap ] [ -j jobs [ -P ] ]\n");
+		exit(1);
+	}
+
+	pagesize = getpagesize();
+	if ((scanfd = open(filename, O_RDONLY)) < 0) {
+		perror("open(2)");
+		exit(1);
+	}
+	if (fstat(scanfd, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		if (addr >= (unsigned long)sb.st_size) {
+			fprintf(stderr, "pageindex: -A is past the end of %s\n", filename);
+			exit(1);
+		}
+		if (limit == 0 || addr + limit > (unsigned long)sb.st_size)
+			limit = sb.st_size - addr;
+	}
+	if (limit == 0) {
+		fprintf(stderr, "pageindex: -L is needed for %s\n", filename);
+		exit(1);
+	}
+
+	if (regionfile) {
+		if (regions_load(&iomem, regionfile) < 0 ||
+		    regions_plan(&iomem, regionmask, addr, limit, &plan) < 0)
+			exit(1);
+	} else if (regions_paint(&plan, addr, addr + limit, REGION_ALL) < 0) {
+		exit(1);
+	}
+
+	skipmap_init(&skip, pagesize);
+	if (skipfile)
+		skipmap_load(&skip, skipfile);
+	if (memfault_install() < 0)
+		exit(1);
+
+	/*
+	 * The index file is written in place through a shared mapping.
+	 */
+	base = addr & ~(pagesize - 1);
+	npages = (addr + limit - base + pagesize - 1) / pagesize;
+	outlen = sizeof(*hdr) + npages;
+	if ((outfd = open(outfile, O_CREAT|O_RDWR|O_TRUNC, 0644)) < 0) {
+		perror("open(2)");
+		exit(1);
+	}
+	if (ftruncate(outfd, outlen) < 0) {
+		perror("ftruncate(2)");
+		exit(1);
+	}
+	if ((hdr = mmap(NULL, outlen, PROT_READ|PROT_WRITE, MAP_SHARED, outfd, 0)) == MAP_FAILED) {
+		perror("mmap(2)");
+		exit(1);
+	}
+	memcpy(hdr->magic, PAGEINDEX_MAGIC, 8);
+	hdr->pagesize = pagesize;
+	hdr->flags = 0;
+	hdr->base = base;
+	hdr->npages = npages;
+	class = (unsigned char *)(hdr + 1);
+
+	if (plan_chunks(&plan) < 0)
+		exit(1);
+
+	fprintf(stderr, "       Indexing %s %#lx-%#lx: %lu pages in %zu regions, %d jobs.\n",
+			filename, base, base + npages * pagesize - 1, npages, plan.n, jobs);
+
+	CPU_ZERO(&online);
+	if (pflag && sched_getaffinity(0, sizeof(online), &online) < 0) {
+		perror("sched_getaffinity(2)");
+		pflag = 0;
+	}
+	for (i = 0; i < jobs; i++) {
+		if (pflag)
+			do
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			while (!CPU_ISSET(cpu, &online));
+		workercpu[i] = cpu;
+		if ((errno = pthread_create(&tid[i], NULL, worker, (void *)(long)i)) != 0) {
+			perror("pthread_create(3)");
+			exit(1);
+		}
+	}
+	for (i = 0; i < jobs; i++)
+		pthread_join(tid[i], NULL);
+
+	for (n = 0; n < npages; n++) {
+		if (!(class[n] & PAGE_SEEN))
+			counts[7]++;
+		for (k = 0; k < sizeof(page_class_names) / sizeof(page_class_names[0]); k++)
+			if (class[n] & page_class_names[k].class)
+				counts[k]++;
+	}
+	for (k = 0; k < sizeof(page_class_names) / sizeof(page_class_names[0]); k++)
+		fprintf(stderr, "       %-8s %lu pages\n", page_class_names[k].name, counts[k]);
+	fprintf(stderr, "       %-8s %lu pages\n", "unseen", counts[7]);
+
+	if (msync(hdr, outlen, MS_SYNC) < 0)
+		perror("msync(2)");
+	munmap(hdr, outlen);
+	close(outfd);
+	close(scanfd);
+
+	if (skipfile)
+		skipmap_save(&skip, skipfile);
+	else if (skip.n)
+		fprintf(stderr, "       %zu unreadable pages (use -S to keep a skip map).\n", skip.n);
+	exit(0);
+}
@@ -0,0 +1,197 @@
+/*
+ * pageindex.h - Per-page class index, built once by pageindex(1).
+ *
+ * One byte per page says what the page held when it was indexed:
+ *
+ *	PAGE_SEEN	the page was classified (0 means "not indexed, scan it")
+ *	PAGE_ZERO	every byte 0x00
+ *	PAGE_FF		every byte 0xff (typical of MMIO holes)
+ *	PAGE_ROMSIG	55 aa somewhere in it (last byte 0x55 counts too, the
+ *			signature may straddle into the next page)
+ *	PAGE_TEXT	mostly printable ASCII
+ *	PAGE_ENTROPY	high collision entropy (compressed, encrypted, random)
+ *	PAGE_BAD	faulted while indexing
+ *
+ * The file is a fixed header followed by the class bytes, so a scanner
+ * just mmap(2)s it and looks pages up in place.  It describes memory as it
+ * was, so RAM pages may have changed since; keep skip classes to what the
+ * search cannot possibly match.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef PAGEINDEX_H
+#define PAGEINDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PAGEINDEX_MAGIC		"PGINDEX1"
+
+#define PAGE_SEEN	0x01
+#define PAGE_ZERO	0x02
+#define PAGE_FF		0x04
+#define PAGE_ROMSIG	0x08
+#define PAGE_TEXT	0x10
+#define PAGE_ENTROPY	0x20
+#define PAGE_BAD	0x40
+
+struct pageindex_hdr {
+	char		magic[8];
+	uint32_t	pagesize;
+	uint32_t	flags;		/* reserved, 0 */
+	uint64_t	base;		/* address of class[0]'s page */
+	uint64_t	npages;
+};
+
+struct pageindex {
+	struct pageindex_hdr	*hdr;
+	const unsigned char	*class;
+	unsigned long		pagesize;
+	unsigned long		base;
+	unsigned long		npages;
+	size_t			maplen;
+};
+
+static const struct {
+	const char	*name;
+	int		class;
+} page_class_names[] = {
+	{ "zero",	PAGE_ZERO },
+	{ "ff",		PAGE_FF },
+	{ "rom",	PAGE_ROMSIG },
+	{ "text",	PAGE_TEXT },
+	{ "entropy",	PAGE_ENTROPY },
+	{ "bad",	PAGE_BAD },
+};
+
+/*
+ * Parse "zero,ff,..." into a class mask.  Returns -1 on an unknown name.
+ */
+static inline int page_classes_parse(const char *spec)
+{
+	char	buf[256], *tok, *save;
+	int	mask = 0;
+	size_t	i;
+
+	strncpy(buf, spec, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < sizeof(page_class_names) / sizeof(page_class_names[0]); i++)
+			if (strcasecmp(tok, page_class_names[i].name) == 0)
+				break;
+		if (i == sizeof(page_class_names) / sizeof(page_class_names[0]))
+			return -1;
+		mask |= page_class_names[i].class;
+	}
+	return mask;
+}
+
+/*
+ * Map an index file read-only.
+ */
+static inline int pageindex_open(struct pageindex *pi, const char *filename)
+{
+	struct stat	sb;
+	void		*p;
+	int		fd;
+
+	memset(pi, 0, sizeof(*pi));
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		perror("open(2)");
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0) {
+		perror("fstat(2)");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)sb.st_size < sizeof(struct pageindex_hdr)) {
+		fprintf(stderr, "%s: not a page index\n", filename);
+		close(fd);
+		return -1;
+	}
+	if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("mmap(2)");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	pi->hdr = p;
+	pi->maplen = sb.st_size;
+	if (memcmp(pi->hdr->magic, PAGEINDEX_MAGIC, 8) != 0 || pi->hdr->pagesize == 0 ||
+	    (pi->hdr->pagesize & (pi->hdr->pagesize - 1)) != 0 ||
+	    pi->hdr->npages > pi->maplen - sizeof(struct pageindex_hdr)) {
+		fprintf(stderr, "%s: not a page index\n", filename);
+		munmap(p, pi->maplen);
+		memset(pi, 0, sizeof(*pi));
+		return -1;
+	}
+	pi->class = (const unsigned char *)(pi->hdr + 1);
+	pi->pagesize = pi->hdr->pagesize;
+	pi->base = pi->hdr->base;
+	pi->npages = pi->hdr->npages;
+	return 0;
+}
+
+/*
+ * Class of the page holding addr, 0 if the index does not cover it.
+ */
+static inline int pageindex_class(const struct pageindex *pi, unsigned long addr)
+{
+	unsigned long	n;
+
+	if (!pi->class || addr < pi->base)
+		return 0;
+	n = (addr - pi->base) / pi->pagesize;
+	return n < pi->npages ? pi->class[n] : 0;
+}
+
+/*
+ * A page is skipped if it was indexed and either has a class in skip, or
+ * need is non-zero and it has none of need.
+ */
+static inline int pageindex_skips(const struct pageindex *pi, unsigned long addr,
+				  int skip, int need)
+{
+	int	c = pageindex_class(pi, addr);
+
+	if (!(c & PAGE_SEEN))
+		return 0;
+	return (c & skip) || (need && !(c & need));
+}
+
+/*
+ * First address in [addr, end) whose page is not skipped, or end.
+ */
+static inline unsigned long pageindex_next(const struct pageindex *pi, unsigned long addr,
+				    unsigned long end, int skip, int need)
+{
+	while (addr < end && pageindex_skips(pi, addr, skip, need))
+		addr = (addr | (pi->pagesize - 1)) + 1;
+	return addr < end ? addr : end;
+}
+
+/*
+ * Start of the first skipped page in (addr, end), or end.
+ */
+static inline unsigned long pageindex_runend(const struct pageindex *pi, unsigned long addr,
+				      unsigned long end, int skip, int need)
+{
+	if (!pi->class)
+		return end;
+	for (addr = (addr | (pi->pagesize - 1)) + 1; addr < end; addr += pi->pagesize)
+		if (pageindex_skips(pi, addr, skip, need))
+			return addr;
+	return end;
+}
+
+#endif /* PAGEINDEX_H */
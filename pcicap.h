@@ -0,0 +1,485 @@
+/*
+ * pcicap.h - Decode the capability and extended capability lists of a
+ * function's config space.
+ *
+ * What each capability is called and which of its registers and bit fields
+ * are worth printing are static const tables, built at compile time:
+ *
+ *	F("name", offset, bytes, shift, bits, format)
+ *
+ * is the bits-wide field at bit shift of the bytes-wide register at offset
+ * from the capability header, printed as HEX, DEC, BOOL, PLUS1 (an N-1
+ * encoded count) or QWORDS (an offset kept in 8-byte units).  A decode is
+ * table lookups, config reads and fprintf(3) straight to the stream:
+ * nothing is allocated, so a whole topology goes in one pass.
+ * Capabilities without a table entry are still listed, by ID.
+ *
+ * Output is text (lspci -vv style, indented under the function) or one
+ * JSON object per capability list, for pcimmio -c / -O json and pcienum.
+ * pcicap_name_at() says which capability a register belongs to, for the
+ * change watcher (cfgwatch.h).
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef PCICAP_H
+#define PCICAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pcicfg.h"
+
+enum { CAPF_HEX, CAPF_DEC, CAPF_BOOL, CAPF_PLUS1, CAPF_QWORDS };
+
+struct capfield {
+	const char	*name;
+	uint16_t	off;
+	uint8_t		bytes;		/* 1, 2, 4 or 8 */
+	uint8_t		shift;
+	uint8_t		bits;
+	uint8_t		fmt;
+};
+
+struct capdesc {
+	const char		*name;
+	const struct capfield	*f;
+	unsigned		nf;
+};
+
+#define F(n, o, b, s, w, fmt)	{ n, o, b, s, w, CAPF_##fmt }
+#define CAP(id, n, tab)		[id] = { n, tab, sizeof(tab) / sizeof(tab[0]) }
+#define CAPNAME(id, n)		[id] = { n, NULL, 0 }
+
+static const struct capfield cap_pm[] = {
+	F("version",		2, 2, 0, 3, DEC),
+	F("pme_support",	2, 2, 11, 5, HEX),
+	F("power_state",	4, 2, 0, 2, DEC),
+	F("pme_enable",		4, 2, 8, 1, BOOL),
+	F("pme_status",		4, 2, 15, 1, BOOL),
+};
+
+static const struct capfield cap_vpd[] = {
+	F("address",		2, 2, 0, 15, HEX),
+};
+
+static const struct capfield cap_msi[] = {
+	F("enable",		2, 2, 0, 1, BOOL),
+	F("vectors_capable",	2, 2, 1, 3, DEC),	/* log2 */
+	F("vectors_enabled",	2, 2, 4, 3, DEC),	/* log2 */
+	F("64bit",		2, 2, 7, 1, BOOL),
+	F("maskable",		2, 2, 8, 1, BOOL),
+	F("address",		4, 4, 0, 32, HEX),
+};
+
+static const struct capfield cap_vendor[] = {
+	F("length",		2, 1, 0, 8, DEC),
+};
+
+static const struct capfield cap_ssvid[] = {
+	F("subsystem_vendor",	4, 2, 0, 16, HEX),
+	F("subsystem_device",	6, 2, 0, 16, HEX),
+};
+
+static const struct capfield cap_pcie[] = {
+	F("version",		2, 2, 0, 4, DEC),
+	F("port_type",		2, 2, 4, 4, DEC),
+	F("slot",		2, 2, 8, 1, BOOL),
+	F("max_payload_supported", 4, 4, 0, 3, DEC),	/* 128 << n */
+	F("flr",		4, 4, 28, 1, BOOL),
+	F("max_payload",	8, 2, 5, 3, DEC),
+	F("max_read_request",	8, 2, 12, 3, DEC),
+	F("correctable_error",	10, 2, 0, 1, BOOL),
+	F("nonfatal_error",	10, 2, 1, 1, BOOL),
+	F("fatal_error",	10, 2, 2, 1, BOOL),
+	F("unsupported_request", 10, 2, 3, 1, BOOL),
+	F("transactions_pending", 10, 2, 5, 1, BOOL),
+	F("link_max_speed",	12, 4, 0, 4, DEC),	/* 1 = 2.5GT/s, 2 = 5, ... */
+	F("link_max_width",	12, 4, 4, 6, DEC),
+	F("aspm_support",	12, 4, 10, 2, DEC),
+	F("port",		12, 4, 24, 8, DEC),
+	F("aspm",		16, 2, 0, 2, DEC),
+	F("link_disable",	16, 2, 4, 1, BOOL),
+	F("link_speed",		18, 2, 0, 4, DEC),
+	F("link_width",		18, 2, 4, 6, DEC),
+	F("link_training",	18, 2, 11, 1, BOOL),
+	F("link_active",	18, 2, 13, 1, BOOL),
+	F("slot_capabilities",	20, 4, 0, 32, HEX),
+	F("slot_status",	26, 2, 0, 16, HEX),
+	F("device_capabilities2", 36, 4, 0, 32, HEX),
+	F("device_control2",	40, 2, 0, 16, HEX),
+	F("link_target_speed",	48, 2, 0, 4, DEC),
+};
+
+static const struct capfield cap_msix[] = {
+	F("table_size",		2, 2, 0, 11, PLUS1),
+	F("function_mask",	2, 2, 14, 1, BOOL),
+	F("enable",		2, 2, 15, 1, BOOL),
+	F("table_bar",		4, 4, 0, 3, DEC),
+	F("table_offset",	4, 4, 3, 29, QWORDS),
+	F("pba_bar",		8, 4, 0, 3, DEC),
+	F("pba_offset",		8, 4, 3, 29, QWORDS),
+};
+
+static const struct capfield cap_af[] = {
+	F("transactions_pending", 3, 1, 0, 1, BOOL),
+	F("flr",		3, 1, 1, 1, BOOL),
+};
+
+static const struct capdesc caps[CFG_CAP_ID_MAX + 1] = {
+	CAP(0x01, "power_management", cap_pm),
+	CAPNAME(0x02, "agp"),
+	CAP(0x03, "vpd", cap_vpd),
+	CAPNAME(0x04, "slot_id"),
+	CAP(0x05, "msi", cap_msi),
+	CAPNAME(0x06, "compactpci_hot_swap"),
+	CAPNAME(0x07, "pci_x"),
+	CAPNAME(0x08, "hypertransport"),
+	CAP(0x09, "vendor_specific", cap_vendor),
+	CAPNAME(0x0a, "debug_port"),
+	CAPNAME(0x0b, "compactpci_crc"),
+	CAPNAME(0x0c, "pci_hot_plug"),
+	CAP(0x0d, "bridge_subsystem_id", cap_ssvid),
+	CAPNAME(0x0e, "agp_8x"),
+	CAPNAME(0x0f, "secure_device"),
+	CAP(0x10, "pci_express", cap_pcie),
+	CAP(0x11, "msi_x", cap_msix),
+	CAPNAME(0x12, "sata"),
+	CAP(0x13, "advanced_features", cap_af),
+	CAPNAME(0x14, "enhanced_allocation"),
+	CAPNAME(0x15, "flattening_portal_bridge"),
+};
+
+static const struct capfield ext_aer[] = {
+	F("uncorrectable_status", 4, 4, 0, 32, HEX),
+	F("uncorrectable_mask",	8, 4, 0, 32, HEX),
+	F("uncorrectable_severity", 12, 4, 0, 32, HEX),
+	F("correctable_status",	16, 4, 0, 32, HEX),
+	F("correctable_mask",	20, 4, 0, 32, HEX),
+	F("first_error_pointer", 24, 4, 0, 5, DEC),
+	F("ecrc_generation",	24, 4, 6, 1, BOOL),
+	F("ecrc_check",		24, 4, 8, 1, BOOL),
+};
+
+static const struct capfield ext_dsn[] = {
+	F("serial",		4, 8, 0, 64, HEX),
+};
+
+static const struct capfield ext_acs[] = {
+	F("capability",		4, 2, 0, 16, HEX),
+	F("control",		6, 2, 0, 16, HEX),
+	F("source_validation",	6, 2, 0, 1, BOOL),
+	F("request_redirect",	6, 2, 2, 1, BOOL),
+	F("completion_redirect", 6, 2, 3, 1, BOOL),
+	F("upstream_forwarding", 6, 2, 4, 1, BOOL),
+	F("p2p_egress_control",	6, 2, 5, 1, BOOL),
+};
+
+static const struct capfield ext_ari[] = {
+	F("next_function",	4, 2, 8, 8, DEC),
+	F("mfvc_function_groups", 6, 2, 0, 1, BOOL),
+	F("function_group",	6, 2, 4, 3, DEC),
+};
+
+static const struct capfield ext_ats[] = {
+	F("invalidate_queue_depth", 4, 2, 0, 5, DEC),
+	F("page_aligned_request", 4, 2, 5, 1, BOOL),
+	F("smallest_translation_unit", 6, 2, 0, 5, DEC),
+	F("enable",		6, 2, 15, 1, BOOL),
+};
+
+static const struct capfield ext_sriov[] = {
+	F("capabilities",	4, 4, 0, 32, HEX),
+	F("vf_enable",		8, 2, 0, 1, BOOL),
+	F("vf_migration",	8, 2, 1, 1, BOOL),
+	F("vf_mse",		8, 2, 3, 1, BOOL),
+	F("ari_hierarchy",	8, 2, 4, 1, BOOL),
+	F("initial_vfs",	12, 2, 0, 16, DEC),
+	F("total_vfs",		14, 2, 0, 16, DEC),
+	F("num_vfs",		16, 2, 0, 16, DEC),
+	F("function_dependency", 18, 1, 0, 8, DEC),
+	F("first_vf_offset",	20, 2, 0, 16, DEC),
+	F("vf_stride",		22, 2, 0, 16, DEC),
+	F("vf_device",		26, 2, 0, 16, HEX),
+	F("supported_page_sizes", 28, 4, 0, 32, HEX),
+	F("system_page_size",	32, 4, 0, 32, HEX),
+};
+
+static const struct capfield ext_pri[] = {
+	F("enable",		4, 2, 0, 1, BOOL),
+	F("outstanding_capacity", 8, 4, 0, 32, DEC),
+	F("outstanding_allocation", 12, 4, 0, 32, DEC),
+};
+
+static const struct capfield ext_rebar[] = {
+	F("sizes",		4, 4, 4, 28, HEX),	/* bit n: 1MB << n */
+	F("bar",		8, 4, 0, 3, DEC),
+	F("bars",		8, 4, 5, 3, DEC),
+	F("size",		8, 4, 8, 6, DEC),	/* 1MB << n */
+};
+
+static const struct capfield ext_ltr[] = {
+	F("max_snoop_latency",	4, 2, 0, 10, DEC),
+	F("max_snoop_scale",	4, 2, 10, 3, DEC),
+	F("max_no_snoop_latency", 6, 2, 0, 10, DEC),
+	F("max_no_snoop_scale",	6, 2, 10, 3, DEC),
+};
+
+static const struct capfield ext_secpcie[] = {
+	F("link_control3",	4, 4, 0, 32, HEX),
+	F("lane_error_status",	8, 4, 0, 32, HEX),
+};
+
+static const struct capfield ext_pasid[] = {
+	F("execute",		4, 2, 1, 1, BOOL),
+	F("privileged",		4, 2, 2, 1, BOOL),
+	F("max_width",		4, 2, 8, 5, DEC),
+	F("enable",		6, 2, 0, 1, BOOL),
+};
+
+static const struct capfield ext_dpc[] = {
+	F("interrupt_message",	4, 2, 0, 5, DEC),
+	F("trigger_enable",	6, 2, 0, 2, DEC),
+	F("status",		8, 2, 0, 16, HEX),
+	F("triggered",		8, 2, 0, 1, BOOL),
+	F("source",		10, 2, 0, 16, HEX),
+};
+
+static const struct capfield ext_l1ss[] = {
+	F("capabilities",	4, 4, 0, 32, HEX),
+	F("control1",		8, 4, 0, 32, HEX),
+	F("control2",		12, 4, 0, 32, HEX),
+};
+
+static const struct capfield ext_ptm[] = {
+	F("requester",		4, 4, 0, 1, BOOL),
+	F("responder",		4, 4, 1, 1, BOOL),
+	F("root",		4, 4, 2, 1, BOOL),
+	F("local_clock_granularity", 4, 4, 8, 8, DEC),
+	F("enable",		8, 4, 0, 1, BOOL),
+	F("root_select",	8, 4, 1, 1, BOOL),
+};
+
+static const struct capfield ext_vendor[] = {
+	F("vsec_id",		4, 2, 0, 16, HEX),
+	F("vsec_rev",		4, 2, 16, 4, DEC),
+	F("vsec_length",	4, 4, 20, 12, DEC),
+};
+
+static const struct capdesc extcaps[CFG_EXTCAP_ID_MAX + 1] = {
+	CAP(0x01, "advanced_error_reporting", ext_aer),
+	CAPNAME(0x02, "virtual_channel"),
+	CAP(0x03, "device_serial_number", ext_dsn),
+	CAPNAME(0x04, "power_budgeting"),
+	CAPNAME(0x05, "root_complex_link_declaration"),
+	CAPNAME(0x06, "root_complex_internal_link_control"),
+	CAPNAME(0x07, "root_complex_event_collector"),
+	CAPNAME(0x08, "multi_function_vc"),
+	CAPNAME(0x09, "virtual_channel_mfvc"),
+	CAPNAME(0x0a, "root_complex_register_block"),
+	CAP(0x0b, "vendor_specific", ext_vendor),
+	CAPNAME(0x0c, "configuration_access_correlation"),
+	CAP(0x0d, "access_control_services", ext_acs),
+	CAP(0x0e, "alternative_routing_id", ext_ari),
+	CAP(0x0f, "address_translation_services", ext_ats),
+	CAP(0x10, "sr_iov", ext_sriov),
+	CAPNAME(0x11, "mr_iov"),
+	CAPNAME(0x12, "multicast"),
+	CAP(0x13, "page_request", ext_pri),
+	CAPNAME(0x14, "amd_reserved"),
+	CAP(0x15, "resizable_bar", ext_rebar),
+	CAPNAME(0x16, "dynamic_power_allocation"),
+	CAPNAME(0x17, "tph_requester"),
+	CAP(0x18, "latency_tolerance_reporting", ext_ltr),
+	CAP(0x19, "secondary_pcie", ext_secpcie),
+	CAPNAME(0x1a, "protocol_multiplexing"),
+	CAP(0x1b, "pasid", ext_pasid),
+	CAPNAME(0x1c, "ln_requester"),
+	CAP(0x1d, "downstream_port_containment", ext_dpc),
+	CAP(0x1e, "l1_pm_substates", ext_l1ss),
+	CAP(0x1f, "precision_time_measurement", ext_ptm),
+	CAPNAME(0x20, "pcie_over_mphy"),
+	CAPNAME(0x21, "frs_queueing"),
+	CAPNAME(0x22, "readiness_time_reporting"),
+	CAPNAME(0x23, "designated_vendor_specific"),
+	CAPNAME(0x24, "vf_resizable_bar"),
+	CAPNAME(0x25, "data_link_feature"),
+	CAPNAME(0x26, "physical_layer_16gt"),
+	CAPNAME(0x27, "lane_margining"),
+	CAPNAME(0x28, "hierarchy_id"),
+	CAPNAME(0x29, "native_pcie_enclosure"),
+	CAPNAME(0x2a, "physical_layer_32gt"),
+	CAPNAME(0x2b, "alternate_protocol"),
+	CAPNAME(0x2c, "system_firmware_intermediary"),
+	CAPNAME(0x2d, "shadow_functions"),
+	CAPNAME(0x2e, "data_object_exchange"),
+	CAPNAME(0x2f, "device_3"),
+	CAPNAME(0x30, "ide"),
+	CAPNAME(0x31, "physical_layer_64gt"),
+	CAPNAME(0x32, "flit_logging"),
+	CAPNAME(0x33, "flit_performance_measurement"),
+	CAPNAME(0x34, "flit_error_injection"),
+};
+
+#undef F
+#undef CAP
+#undef CAPNAME
+
+/*
+ * One field of the capability at cap.  Fields running past len read as 0.
+ */
+static inline uint64_t cap_field(const unsigned char *cfg, size_t len, unsigned cap, const struct capfield *f)
+{
+	unsigned	reg = cap + f->off;
+	uint64_t	v;
+
+	if (reg + f->bytes > len)
+		return 0;
+	if (f->bytes == 8)
+		v = cfg_read32(cfg, reg) | (uint64_t)cfg_read32(cfg, reg + 4) << 32;
+	else if (f->bytes == 4)
+		v = cfg_read32(cfg, reg);
+	else if (f->bytes == 2)
+		v = cfg_read16(cfg, reg);
+	else
+		v = cfg_read8(cfg, reg);
+	v >>= f->shift;
+	if (f->bits < 64)
+		v &= (1ULL << f->bits) - 1;
+	return v;
+}
+
+static inline void cap_fields(FILE *fp, const unsigned char *cfg, size_t len, unsigned cap,
+		       const struct capdesc *d, int json)
+{
+	const struct capfield	*f;
+	uint64_t		v;
+	unsigned		i;
+
+	for (i = 0; d && i < d->nf; i++) {
+		f = &d->f[i];
+		v = cap_field(cfg, len, cap, f);
+		if (f->fmt == CAPF_PLUS1)
+			v++;
+		else if (f->fmt == CAPF_QWORDS)
+			v <<= 3;
+		if (json) {
+			if (f->fmt == CAPF_HEX || f->fmt == CAPF_QWORDS)
+				fprintf(fp, ", \"%s\": \"0x%llx\"", f->name, (unsigned long long)v);
+			else if (f->fmt == CAPF_BOOL)
+				fprintf(fp, ", \"%s\": %s", f->name, v ? "true" : "false");
+			else
+				fprintf(fp, ", \"%s\": %llu", f->name, (unsigned long long)v);
+		} else {
+			if (f->fmt == CAPF_HEX || f->fmt == CAPF_QWORDS)
+				fprintf(fp, " %s=%#llx", f->name, (unsigned long long)v);
+			else
+				fprintf(fp, " %s=%llu", f->name, (unsigned long long)v);
+		}
+	}
+}
+
+/*
+ * Print both capability lists of the len (256 or 4096) bytes at cfg: as
+ * "caps": [...], "extcaps": [...] members if json, else as indented
+ * lines.  The walks stop, like cfg_score()'s, at a pointer out of range
+ * or one already seen.
+ */
+static inline void pcicap_print(FILE *fp, const unsigned char *cfg, size_t len, int json)
+{
+	const struct capdesc	*d;
+	uint64_t		seen[ECAM_FN_SIZE / 4 / 64] = { 0 };
+	unsigned		ptr, id, n = 0, type;
+	uint32_t		h;
+
+	type = cfg_read8(cfg, CFG_HEADER_TYPE) & 0x7f;
+	ptr = cfg_read16(cfg, CFG_STATUS) & CFG_STATUS_CAP_LIST ?
+		cfg_read8(cfg, type == 2 ? CFG_CARDBUS_CAP_PTR : CFG_CAP_PTR) : 0;
+	if (json)
+		fprintf(fp, "\"caps\": [");
+	for (; ptr >= 0x40 && ptr <= 0xfc && !(ptr & 3) && !(seen[0] & 1ULL << (ptr >> 2)); ptr = h >> 8 & 0xff) {
+		seen[0] |= 1ULL << (ptr >> 2);
+		h = cfg_read32(cfg, ptr);
+		id = h & 0xff;
+		d = id <= CFG_CAP_ID_MAX && caps[id].name ? &caps[id] : NULL;
+		if (json)
+			fprintf(fp, "%s{ \"offset\": \"0x%02x\", \"id\": \"0x%02x\", \"name\": \"%s\"", n++ ? ", " : "",
+				ptr, id, d ? d->name : "unknown");
+		else
+			fprintf(fp, "\t[%02x] %s (%02x):", ptr, d ? d->name : "unknown", id);
+		cap_fields(fp, cfg, len, ptr, d, json);
+		fprintf(fp, json ? " }" : "\n");
+	}
+
+	if (json)
+		fprintf(fp, "], \"extcaps\": [");
+	n = 0;
+	ptr = len >= ECAM_FN_SIZE ? CFG_EXTCAP : 0;
+	if (ptr && ((h = cfg_read32(cfg, ptr)) == 0 || h == 0xffffffff))
+		ptr = 0;
+	for (; ptr >= CFG_EXTCAP && ptr <= ECAM_FN_SIZE - 4 && !(ptr & 3) &&
+	       !(seen[ptr >> 8] & 1ULL << (ptr >> 2 & 63)); ptr = h >> 20 & 0xffc) {
+		seen[ptr >> 8] |= 1ULL << (ptr >> 2 & 63);
+		h = cfg_read32(cfg, ptr);
+		id = h & 0xffff;
+		d = id <= CFG_EXTCAP_ID_MAX && extcaps[id].name ? &extcaps[id] : NULL;
+		if (json)
+			fprintf(fp, "%s{ \"offset\": \"0x%03x\", \"id\": \"0x%04x\", \"version\": %u, \"name\": \"%s\"",
+				n++ ? ", " : "", ptr, id, h >> 16 & 0xf, d ? d->name : "unknown");
+		else
+			fprintf(fp, "\t[%03x] %s (%04x v%u):", ptr, d ? d->name : "unknown", id, h >> 16 & 0xf);
+		cap_fields(fp, cfg, len, ptr, d, json);
+		fprintf(fp, json ? " }" : "\n");
+	}
+	if (json)
+		fprintf(fp, "]");
+}
+
+/*
+ * The name of the capability reg falls in (the one starting closest below
+ * it on its own list), with its offset in *start; NULL below 0x40 or when
+ * no capability starts before reg.
+ */
+static inline const char *pcicap_name_at(const unsigned char *cfg, size_t len, unsigned reg, unsigned *start)
+{
+	uint64_t	seen[ECAM_FN_SIZE / 4 / 64] = { 0 };
+	unsigned	ptr, type, best = 0, bestid = 0;
+	uint32_t	h;
+
+	if (reg < CFG_EXTCAP) {
+		type = cfg_read8(cfg, CFG_HEADER_TYPE) & 0x7f;
+		ptr = cfg_read16(cfg, CFG_STATUS) & CFG_STATUS_CAP_LIST ?
+			cfg_read8(cfg, type == 2 ? CFG_CARDBUS_CAP_PTR : CFG_CAP_PTR) : 0;
+		for (; ptr >= 0x40 && ptr <= 0xfc && !(ptr & 3) && !(seen[0] & 1ULL << (ptr >> 2));
+		     ptr = h >> 8 & 0xff) {
+			seen[0] |= 1ULL << (ptr >> 2);
+			h = cfg_read32(cfg, ptr);
+			if (ptr <= reg && ptr > best) {
+				best = ptr;
+				bestid = h & 0xff;
+			}
+		}
+		if (!best)
+			return NULL;
+		*start = best;
+		return bestid <= CFG_CAP_ID_MAX && caps[bestid].name ? caps[bestid].name : "unknown";
+	}
+
+	ptr = len >= ECAM_FN_SIZE ? CFG_EXTCAP : 0;
+	if (ptr && ((h = cfg_read32(cfg, ptr)) == 0 || h == 0xffffffff))
+		ptr = 0;
+	for (; ptr >= CFG_EXTCAP && ptr <= ECAM_FN_SIZE - 4 && !(ptr & 3) &&
+	       !(seen[ptr >> 8] & 1ULL << (ptr >> 2 & 63)); ptr = h >> 20 & 0xffc) {
+		seen[ptr >> 8] |= 1ULL << (ptr >> 2 & 63);
+		h = cfg_read32(cfg, ptr);
+		if (ptr <= reg && ptr > best) {
+			best = ptr;
+			bestid = h & 0xffff;
+		}
+	}
+	if (!best)
+		return NULL;
+	*start = best;
+	return bestid <= CFG_EXTCAP_ID_MAX && extcaps[bestid].name ? extcaps[bestid].name : "unknown";
+}
+
+#endif /* PCICAP_H */
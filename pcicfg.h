@@ -0,0 +1,459 @@
+/*
+ * pcicfg.h - PCI(e) configuration space through the ECAM (MMCONFIG) window.
+ *
+ * PCIe lays every function's 4KB of config space out in one physical
+ * window, found in the ACPI MCFG table:
+ *
+ *	base + (bus << 20 | device << 15 | function << 12) + register
+ *
+ * so the whole window is mapped once and a function is a pointer away, no
+ * syscall per read.  The window comes from /dev/mem, or from a raw image
+ * of it (a file whose offset 0 is bus 0), which lets the walkers run
+ * offline on a capture.
+ *
+ * Reads are 32-bit loads, as the host bridge wants; narrower registers are
+ * shifted out of them.
+ *
+ * Memory that is not config space (a window nothing decodes, a dump of
+ * RAM) is told apart in two steps.  cfg_candidates() looks at a batch of
+ * blocks a vector at a time and keeps the ones whose vendor, device and
+ * header type could be real; cfg_score() then checks each survivor
+ * properly (BAR type bits, bus numbers, the capability and extended
+ * capability chains) and scores it 0 (not config space) to 100.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef PCICFG_H
+#define PCICFG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define ECAM_BUS_SHIFT		20
+#define ECAM_DEV_SHIFT		15
+#define ECAM_FN_SHIFT		12
+#define ECAM_FN_SIZE		4096
+#define ECAM_OFFSET(b, d, f)	((unsigned long)(b) << ECAM_BUS_SHIFT | (unsigned long)(d) << ECAM_DEV_SHIFT | \
+				 (unsigned long)(f) << ECAM_FN_SHIFT)
+#define ECAM_DEFAULT_BASE	0x80000000UL
+
+#define MCFG_PATH		"/sys/firmware/acpi/tables/MCFG"
+
+/* config header registers */
+#define CFG_VENDOR_ID		0x00
+#define CFG_DEVICE_ID		0x02
+#define CFG_COMMAND		0x04
+#define CFG_STATUS		0x06
+#define CFG_REVISION		0x08
+#define CFG_CLASS		0x09	/* 24 bits: class, subclass, prog-if */
+#define CFG_HEADER_TYPE		0x0e
+#define CFG_BAR0		0x10
+#define CFG_SUBSYS_VENDOR	0x2c
+#define CFG_ROM_ADDRESS		0x30	/* type 0; type 1 has it at 0x38 */
+#define CFG_CAP_PTR		0x34
+#define CFG_INTERRUPT_PIN	0x3d
+#define CFG_PRIMARY_BUS		0x18	/* type 1 */
+#define CFG_SECONDARY_BUS	0x19
+#define CFG_SUBORDINATE_BUS	0x1a
+
+#define CFG_CARDBUS_CAP_PTR	0x14	/* type 2 */
+#define CFG_EXTCAP		0x100
+
+#define CFG_STATUS_CAP_LIST	0x0010
+#define CFG_HEADER_MULTIFN	0x80
+
+#define CFG_CAP_ID_MAX		0x15	/* Flattening Portal Bridge */
+#define CFG_EXTCAP_ID_MAX	0x34	/* highest the spec assigns so far */
+
+/*
+ * What cfg_score() made of a block.  why says what disqualified it (score
+ * 0) or is NULL.
+ */
+struct cfgscore {
+	int		score;
+	int		caps;
+	int		extcaps;
+	const char	*why;
+};
+
+struct ecam {
+	int		fd;
+	unsigned char	*map;
+	size_t		len;
+	unsigned long	base;		/* physical address of bus startbus */
+	unsigned	segment;
+	unsigned	startbus;
+	unsigned	endbus;		/* inclusive */
+	int		image;		/* map is a file, not the live window */
+};
+
+static inline uint32_t cfg_read32(const unsigned char *cfg, unsigned reg)
+{
+	return *(const volatile uint32_t *)(cfg + (reg & ~3U));
+}
+
+static inline uint16_t cfg_read16(const unsigned char *cfg, unsigned reg)
+{
+	return cfg_read32(cfg, reg) >> ((reg & 2) * 8);
+}
+
+static inline uint8_t cfg_read8(const unsigned char *cfg, unsigned reg)
+{
+	return cfg_read32(cfg, reg) >> ((reg & 3) * 8);
+}
+
+/*
+ * First allocation of the MCFG table at path: segment 0 if there is one.
+ * Returns -1 if there is no table.
+ */
+static inline int ecam_mcfg(const char *path, unsigned long *base, unsigned *segment,
+		     unsigned *startbus, unsigned *endbus)
+{
+	unsigned char	t[4096], *a;
+	ssize_t		len;
+	int		fd, found = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	len = read(fd, t, sizeof(t));
+	close(fd);
+	if (len < 44 + 16 || memcmp(t, "MCFG", 4) != 0)
+		return -1;
+
+	/* 36-byte ACPI header, 8 reserved, then 16-byte allocations */
+	for (a = t + 44; a + 16 <= t + len; a += 16) {
+		if (found && *segment == 0)
+			break;
+		memcpy(base, a, sizeof(*base));
+		*segment = a[8] | a[9] << 8;
+		*startbus = a[10];
+		*endbus = a[11];
+		found = 1;
+	}
+	return found ? 0 : -1;
+}
+
+/*
+ * Map buses startbus..endbus of the window whose bus 0 is at physical
+ * base from path.  A regular file is taken as an image of the window, and
+ * only the buses it holds are walked.
+ */
+static inline int ecam_open(struct ecam *e, const char *path, unsigned long base, unsigned startbus,
+		     unsigned endbus)
+{
+	struct stat	sb;
+	off_t		off;
+
+	memset(e, 0, sizeof(*e));
+	e->base = base + ((unsigned long)startbus << ECAM_BUS_SHIFT);
+	e->startbus = startbus;
+	e->endbus = endbus;
+	if ((e->fd = open(path, O_RDONLY)) < 0) {
+		perror("open(2)");
+		return -1;
+	}
+	if (fstat(e->fd, &sb) < 0) {
+		perror("fstat(2)");
+		close(e->fd);
+		return -1;
+	}
+	off = e->base;
+	if (S_ISREG(sb.st_mode)) {
+		e->image = 1;
+		off = (off_t)startbus << ECAM_BUS_SHIFT;
+		if ((unsigned long)(sb.st_size >> ECAM_BUS_SHIFT) <= startbus) {
+			fprintf(stderr, "%s: holds no config space for bus %02x\n", path, startbus);
+			close(e->fd);
+			return -1;
+		}
+		if (e->endbus >= (sb.st_size >> ECAM_BUS_SHIFT))
+			e->endbus = (sb.st_size >> ECAM_BUS_SHIFT) - 1;
+	}
+	e->len = (unsigned long)(e->endbus - startbus + 1) << ECAM_BUS_SHIFT;
+	if ((e->map = mmap(NULL, e->len, PROT_READ, MAP_SHARED, e->fd, off)) == MAP_FAILED) {
+		perror("mmap(2)");
+		close(e->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Config space of bus:dev.fn, or NULL if the window does not cover it.
+ */
+static inline const unsigned char *ecam_fn(const struct ecam *e, unsigned bus, unsigned dev, unsigned fn)
+{
+	if (bus < e->startbus || bus > e->endbus || dev > 31 || fn > 7)
+		return NULL;
+	return e->map + ECAM_OFFSET(bus - e->startbus, dev, fn);
+}
+
+/*
+ * The cheap test: vendor and device not 0000 or ffff, a header type of 0,
+ * 1 or 2.  d0 is the dword at 0x00, d3 the one at 0x0c.
+ */
+static inline int cfg_plausible(uint32_t d0, uint32_t d3)
+{
+	return (d0 & 0xffff) != 0 && (d0 & 0xffff) != 0xffff && (d0 >> 16) != 0xffff &&
+	       ((d3 >> 16) & 0x7f) <= 2;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Eight blocks at a time: gather their two dwords and test all eight.
+ */
+__attribute__((target("avx2")))
+static inline size_t cfg_candidates_avx2(const unsigned char *p, size_t n, size_t stride, size_t *out)
+{
+	const __m256i	lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i	lo16 = _mm256_set1_epi32(0xffff), hdr = _mm256_set1_epi32(0x7f0000);
+	const __m256i	zero = _mm256_setzero_si256();
+	const __m256i	maxhdr = _mm256_set1_epi32(0x20000);
+	__m256i		idx = _mm256_mullo_epi32(lane, _mm256_set1_epi32(stride));
+	__m256i		d0, d3, ven, dev, ht, bad;
+	size_t		i, k = 0;
+	unsigned	m;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		d0 = _mm256_i32gather_epi32((const int *)(p + i * stride), idx, 1);
+		d3 = _mm256_i32gather_epi32((const int *)(p + i * stride + 12), idx, 1);
+		ven = _mm256_and_si256(d0, lo16);
+		dev = _mm256_srli_epi32(d0, 16);
+		ht = _mm256_and_si256(d3, hdr);
+		bad = _mm256_or_si256(_mm256_cmpeq_epi32(ven, zero), _mm256_cmpeq_epi32(ven, lo16));
+		bad = _mm256_or_si256(bad, _mm256_cmpeq_epi32(dev, lo16));
+		bad = _mm256_or_si256(bad, _mm256_cmpgt_epi32(ht, maxhdr));
+		m = ~_mm256_movemask_ps(_mm256_castsi256_ps(bad)) & 0xff;
+		while (m) {
+			out[k++] = i + __builtin_ctz(m);
+			m &= m - 1;
+		}
+	}
+	return k;
+}
+#endif
+
+/*
+ * Indices of the blocks among the n at p, stride bytes apart, that pass
+ * cfg_plausible(), into out (room for n).  Returns how many.
+ */
+static inline size_t cfg_candidates(const unsigned char *p, size_t n, size_t stride, size_t *out)
+{
+	size_t		i = 0, k = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	static int	avx2 = -1;
+
+	if (avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2");
+	}
+	if (avx2 && stride * 8 < 1UL << 31) {
+		k = cfg_candidates_avx2(p, n, stride, out);
+		i = n & ~7UL;
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i	lo16 = _mm_set1_epi32(0xffff), hdr = _mm_set1_epi32(0x7f0000);
+	const __m128i	maxhdr = _mm_set1_epi32(0x20000), zero = _mm_setzero_si128();
+	__m128i		d0, d3, ven, bad;
+	unsigned	m;
+
+	for (; i + 4 <= n; i += 4) {
+		d0 = _mm_setr_epi32(cfg_read32(p + i * stride, 0), cfg_read32(p + (i + 1) * stride, 0),
+				    cfg_read32(p + (i + 2) * stride, 0), cfg_read32(p + (i + 3) * stride, 0));
+		d3 = _mm_setr_epi32(cfg_read32(p + i * stride, 12), cfg_read32(p + (i + 1) * stride, 12),
+				    cfg_read32(p + (i + 2) * stride, 12), cfg_read32(p + (i + 3) * stride, 12));
+		ven = _mm_and_si128(d0, lo16);
+		bad = _mm_or_si128(_mm_cmpeq_epi32(ven, zero), _mm_cmpeq_epi32(ven, lo16));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi32(_mm_srli_epi32(d0, 16), lo16));
+		bad = _mm_or_si128(bad, _mm_cmpgt_epi32(_mm_and_si128(d3, hdr), maxhdr));
+		m = ~_mm_movemask_ps(_mm_castsi128_ps(bad)) & 0xf;
+		while (m) {
+			out[k++] = i + __builtin_ctz(m);
+			m &= m - 1;
+		}
+	}
+#endif
+	for (; i < n; i++)
+		if (cfg_plausible(cfg_read32(p + i * stride, 0), cfg_read32(p + i * stride, 12)))
+			out[k++] = i;
+	return k;
+}
+
+/*
+ * Walk the capability list from the pointer at reg.  Returns the number
+ * of capabilities, or -1 with *why set.  *unknown counts IDs past
+ * CFG_CAP_ID_MAX.
+ */
+static inline int cfg_walk_caps(const unsigned char *cfg, unsigned reg, int *unknown, const char **why)
+{
+	uint64_t	seen = 0;
+	unsigned	ptr, n = 0;
+	uint32_t	h;
+
+	for (ptr = cfg_read8(cfg, reg); ptr; ptr = h >> 8 & 0xff) {
+		if (ptr < 0x40 || ptr > 0xfc || (ptr & 3)) {
+			*why = "capability pointer out of range";
+			return -1;
+		}
+		if (seen & 1ULL << (ptr >> 2)) {
+			*why = "capability list loops";
+			return -1;
+		}
+		seen |= 1ULL << (ptr >> 2);
+		h = cfg_read32(cfg, ptr);
+		if ((h & 0xff) == 0 || (h & 0xff) > CFG_CAP_ID_MAX)
+			(*unknown)++;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Same for the extended capabilities from 0x100 (4KB config space only).
+ */
+static inline int cfg_walk_extcaps(const unsigned char *cfg, int *unknown, const char **why)
+{
+	uint64_t	seen[ECAM_FN_SIZE / 4 / 64] = { 0 };
+	unsigned	ptr = CFG_EXTCAP, n = 0;
+	uint32_t	h;
+
+	h = cfg_read32(cfg, ptr);
+	if (h == 0 || h == 0xffffffff)
+		return 0;
+	for (; ptr; ptr = h >> 20 & 0xffc) {
+		if (ptr < CFG_EXTCAP || ptr > ECAM_FN_SIZE - 4 || (ptr & 3)) {
+			*why = "extended capability pointer out of range";
+			return -1;
+		}
+		if (seen[ptr >> 8] & 1ULL << (ptr >> 2 & 63)) {
+			*why = "extended capability list loops";
+			return -1;
+		}
+		seen[ptr >> 8] |= 1ULL << (ptr >> 2 & 63);
+		h = cfg_read32(cfg, ptr);
+		if ((h & 0xffff) > CFG_EXTCAP_ID_MAX || (h >> 16 & 0xf) == 0)
+			(*unknown)++;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Score len bytes (256 or 4096) of would-be config space.  Passing every
+ * hard check is worth 25; the rest comes from things real functions
+ * nearly always have and garbage rarely does.
+ */
+static inline int cfg_score(const unsigned char *cfg, size_t len, struct cfgscore *cs)
+{
+	uint32_t	d0 = cfg_read32(cfg, 0), d3 = cfg_read32(cfg, 12), bar, cmdsts;
+	unsigned	type, nbars, i, zeros = 0, classcode;
+	int		unknown = 0, barsok = 1;
+
+	memset(cs, 0, sizeof(*cs));
+	if ((d0 & 0xffff) == 0 || (d0 & 0xffff) == 0xffff || (d0 >> 16) == 0xffff) {
+		cs->why = "no vendor or device ID";
+		return 0;
+	}
+	if ((type = d3 >> 16 & 0x7f) > 2) {
+		cs->why = "bad header type";
+		return 0;
+	}
+	classcode = cfg_read32(cfg, CFG_REVISION) >> 8;
+	if ((type == 1 && classcode >> 16 != 0x06) || (type == 2 && classcode >> 8 != 0x0607)) {
+		cs->why = "bridge header on a function that is not a bridge";
+		return 0;
+	}
+
+	/* BARs: I/O ones have bit 1 clear, memory ones are not type 11 */
+	nbars = type == 0 ? 6 : type == 1 ? 2 : 1;
+	for (i = 0; i < nbars; i++) {
+		bar = cfg_read32(cfg, CFG_BAR0 + i * 4);
+		if (bar & 1) {
+			if (bar & 2)
+				barsok = 0;
+			continue;
+		}
+		if ((bar & 6) == 6) {
+			cs->why = "reserved BAR type";
+			return 0;
+		}
+		if ((bar & 6) == 4) {
+			if (i == nbars - 1) {
+				cs->why = "64-bit BAR in the last slot";
+				return 0;
+			}
+			i++;
+		}
+	}
+
+	if (cfg_read8(cfg, CFG_INTERRUPT_PIN) > 4) {
+		cs->why = "interrupt pin past INTD";
+		return 0;
+	}
+	if (type == 1 && cfg_read8(cfg, CFG_SUBORDINATE_BUS) != 0 &&
+	    (cfg_read8(cfg, CFG_PRIMARY_BUS) >= cfg_read8(cfg, CFG_SECONDARY_BUS) ||
+	     cfg_read8(cfg, CFG_SECONDARY_BUS) > cfg_read8(cfg, CFG_SUBORDINATE_BUS))) {
+		cs->why = "bridge bus numbers out of order";
+		return 0;
+	}
+
+	cmdsts = cfg_read32(cfg, CFG_COMMAND);
+	if (cmdsts >> 16 & CFG_STATUS_CAP_LIST) {
+		if ((cs->caps = cfg_walk_caps(cfg, type == 2 ? CFG_CARDBUS_CAP_PTR : CFG_CAP_PTR,
+					      &unknown, &cs->why)) < 0)
+			return 0;
+	}
+	if (len >= ECAM_FN_SIZE && (cs->extcaps = cfg_walk_extcaps(cfg, &unknown, &cs->why)) < 0)
+		return 0;
+
+	cs->score = 25;
+	/* reserved: 0x35-0x3b in type 0, 0x35-0x37 in type 1 */
+	if (type != 2 && (cfg_read32(cfg, 0x34) & 0xffffff00) == 0 &&
+	    (type == 1 || (cfg_read32(cfg, 0x38) & 0xffffff) == 0))
+		cs->score += 15;
+	if (classcode >> 16 <= 0x13 || classcode >> 16 == 0xff)
+		cs->score += 10;
+	if (barsok)
+		cs->score += 10;
+	if (cs->caps > 0 && unknown == 0)
+		cs->score += 15;
+	else if (!(cmdsts >> 16 & CFG_STATUS_CAP_LIST) && cfg_read8(cfg, CFG_CAP_PTR) == 0)
+		cs->score += 5;
+	if (cs->extcaps > 0 && unknown == 0)
+		cs->score += 10;
+	if ((cmdsts & 0xf800) == 0 && (cmdsts & 0x70000) == 0)
+		cs->score += 10;
+	for (i = 0x40; i < 0x100; i += 4)
+		zeros += cfg_read32(cfg, i) == 0;
+	if (zeros >= 24)
+		cs->score += 5;
+	if (unknown)
+		cs->score -= 5 * unknown < cs->score - 1 ? 5 * unknown : cs->score - 1;
+	return cs->score;
+}
+
+static inline void ecam_close(struct ecam *e)
+{
+	if (e->map)
+		munmap(e->map, e->len);
+	if (e->fd >= 0)
+		close(e->fd);
+	memset(e, 0, sizeof(*e));
+	e->fd = -1;
+}
+
+#endif /* PCICFG_H */
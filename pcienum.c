@@ -0,0 +1,205 @@
+/*
+ * pcienum(1) - List every PCI function sysfs knows about, fast, like lspci -n.
+ *
+ * - /sys/bus/pci/devices is walked once: config space, class, resources
+ *   and driver of every function, each function's directory opened once
+ *   and its files pread(2) through openat(2) (pcisysfs.h).  -j spreads a
+ *   large topology (SR-IOV hosts, thousands of VFs) over threads.
+ * - The result is cached in -C file (default /run/pcienum.cache) keyed by
+ *   the boot ID, the tree, the user and the list of function names, so
+ *   the next run by the same user on the same boot with the same
+ *   functions maps the cache instead of reading sysfs.  -r rebuilds it anyway, -C '' does without.
+ * - -R dir enumerates another tree laid out like /sys/bus/pci/devices,
+ *   without a cache unless -C names one.
+ * - -v lists each function's resources (BARs and ROM) as sysfs has them,
+ *   -c decodes its capabilities (pcicap.h; extended ones only when the
+ *   4096 bytes of config were readable, i.e. as root).
+ * - -O json prints one object per function.
+ * - -w period then watches the config space of every function through its
+ *   sysfs config file, printing each dword that changed (cfgwatch.h, as
+ *   pcimmio -w does through ECAM), until SIGINT or -n polls.
+ * - A timing line goes to stderr, saying whether the cache was used.
+ *
+ * Usage: pcienum [ -R dir ] [ -C cache ] [ -r ] [ -j jobs ] [ -v ] [ -c ] [ -O text|json ]
+ *               [ -w period [ -n polls ] ]
+ *
+ * Build: cc -O2 -o pcienum pcienum.c -lpthread
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "pcisysfs.h"
+#include "pcicfg.h"
+#include "pcicap.h"
+#include "cfgwatch.h"
+
+int	vflag = 0;
+int	cflag = 0;
+int	jsonout = 0;
+
+static void print_text(const struct pcifn *f)
+{
+	unsigned	i;
+
+	printf("%s %04x: %04x:%04x", f->name, f->class >> 8, f->vendor, f->device);
+	if (f->cfglen > CFG_REVISION)
+		printf(" (rev %02x)", f->config[CFG_REVISION]);
+	if (f->driver[0])
+		printf(" %s", f->driver);
+	printf("\n");
+	if (vflag)
+		for (i = 0; i < f->nres; i++)
+			if (f->res[i][0] || f->res[i][1]) {
+				if (i == 6)
+					printf("\tROM ");
+				else
+					printf("\tBAR%u", i);
+				printf(" %#" PRIx64 "-%#" PRIx64 " flags %#" PRIx64 "\n", f->res[i][0], f->res[i][1],
+				       f->res[i][2]);
+			}
+	if (cflag)
+		pcicap_print(stdout, f->config, f->cfglen, 0);
+}
+
+static void print_json(const struct pcifn *f)
+{
+	unsigned	i;
+	int		n = 0;
+
+	printf("{ \"bdf\": \"%s\", \"vendor\": \"0x%04x\", \"device\": \"0x%04x\", \"class\": \"0x%06x\", ",
+	       f->name, f->vendor, f->device, f->class);
+	if (f->cfglen > CFG_REVISION)
+		printf("\"revision\": %u, ", f->config[CFG_REVISION]);
+	printf("\"driver\": ");
+	if (f->driver[0])
+		printf("\"%s\", ", f->driver);
+	else
+		printf("null, ");
+	printf("\"config_bytes\": %u, \"resources\": [", f->cfglen);
+	for (i = 0; i < f->nres; i++)
+		if (f->res[i][0] || f->res[i][1])
+			printf("%s{ \"index\": %u, \"start\": \"%#" PRIx64 "\", \"end\": \"%#" PRIx64 "\", "
+			       "\"flags\": \"%#" PRIx64 "\" }", n++ ? ", " : "", i, f->res[i][0], f->res[i][1],
+			       f->res[i][2]);
+	printf("], ");
+	pcicap_print(stdout, f->config, f->cfglen, 1);
+	printf(" }\n");
+}
+
+/*
+ * Watch every function through its config file, one descriptor each.
+ */
+static void watch(struct pcienum *e, double period, unsigned long polls)
+{
+	struct cfgwatch	w;
+	struct rlimit	rl;
+	char		path[32];
+	size_t		i;
+	int		fd;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	memset(&w, 0, sizeof(w));
+	w.json = jsonout;
+	for (i = 0; i < e->n; i++) {
+		snprintf(path, sizeof(path), "%s/config", e->fn[i].name);
+		if ((fd = openat(e->dirfd, path, O_RDONLY)) < 0) {
+			fprintf(stderr, "%s/%s: %s\n", e->dir, path, strerror(errno));
+			continue;
+		}
+		if (cfgwatch_add(&w, e->fn[i].name, NULL, fd, e->fn[i].cfglen) < 0)
+			close(fd);
+	}
+	if (w.n)
+		cfgwatch_run(&w, stdout, period, polls);
+	cfgwatch_free(&w);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pcienum	e;
+	struct timespec	t0, t1;
+	char		*dir = SYSFS_PCI_DEVICES, *cache = PCIENUM_CACHE;
+	int		opt, refresh = 0, jobs = 8, rset = 0, cset = 0;
+	unsigned long	polls = 0;
+	double		period = 0;
+	size_t		i;
+
+	while ((opt = getopt(argc, argv, "R:C:O:j:n:w:rvc")) != -1) switch (opt) {
+		case 'R':
+			dir = optarg;
+			rset++;
+			break;
+		case 'C':
+			cache = optarg[0] ? optarg : NULL;
+			cset++;
+			break;
+		case 'r':
+			refresh++;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			if (jobs < 1 || jobs > PCIENUM_MAXJOBS) {
+				fprintf(stderr, "pcienum: -j wants 1-%d\n", PCIENUM_MAXJOBS);
+				exit(1);
+			}
+			break;
+		case 'w':
+			if ((period = strtod(optarg, NULL)) <= 0) {
+				fprintf(stderr, "pcienum: -w wants a period in seconds\n");
+				exit(1);
+			}
+			break;
+		case 'n':
+			polls = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			vflag++;
+			break;
+		case 'c':
+			cflag++;
+			break;
+		case 'O':
+			if (strcmp(optarg, "json") == 0)
+				jsonout = 1;
+			else if (strcmp(optarg, "text") == 0)
+				jsonout = 0;
+			else {
+				fprintf(stderr, "pcienum: -O wants text or json\n");
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: pcienum [ -R dir ] [ -C cache ] [ -r ] [ -j jobs ] [ -v ] [ -c ] [ -O text|json ]\n");
+			fprintf(stderr, "               [ -w period [ -n polls ] ]\n");
+			exit(1);
+	}
+
+	if (rset && !cset)
+		cache = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (pcienum_open(&e, dir, cache, jobs, refresh) < 0)
+		exit(1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < e.n; i++)
+		if (e.fn[i].cfglen)
+			(jsonout ? print_json : print_text)(&e.fn[i]);
+
+	fprintf(stderr, "       %zu functions from %s in %.2f ms.\n", e.n, e.cached ? cache : dir,
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+	if (e.errors)
+		fprintf(stderr, "       %d functions unreadable, cache not written.\n", e.errors);
+	if (period > 0)
+		watch(&e, period, polls);
+	opt = e.n ? 0 : 1;
+	pcienum_close(&e);
+	exit(opt);
+}
@@ -9,6 +9,33 @@
  *
  * - New features:  Locates 0xaa55 header (checks + 18 for a pointer to the PDS structure, starting with 'PCIR')
  * -                The above should help locate ROMs throughout system memory, using memmem(3).
+ * - SIGBUS/SIGSEGV on an unreadable page no longer kills the search: the page goes into
+ *   the -S skip map and the search resumes past it.  Known bad pages are never touched.
+ * - -R /proc/iomem (or /sys/firmware/memmap, or a saved copy) limits the search to the
+ *   -T region types (default ram,rom); holes and MMIO windows are skipped.
+ * - -X index from pageindex(1): only pages that held a 55 aa are searched.
+ * - Only -g aligned (default 2KB) candidates are looked at, and the whole header is
+ *   validated (pcirom.h): PCIR via the +0x18 pointer, PDS length and revision, image
+ *   length, checksum.  ROMs are saved as <physical address>.rom.
+ * - The whole image chain is walked up to the last-image bit.  Each image is saved as
+ *   <address>.<n>.<code type> (x86, openfirmware, hppa, efi) and described in
+ *   <address>.catalog, EFI images with their subsystem, machine, compression and PE offset.
+ * - Sweeps any physical range, not just the first 64KB: -A base -L limit (e.g. the 32-bit
+ *   MMIO hole, or BAR-assigned expansion ROM windows with -R /proc/iomem -T pci,bar,rom)
+ *   is mapped one -W window at a time on -j threads.  A window reads up to 2MB past its
+ *   end for ROMs that start in it; headers found twice (in two windows, or inside a ROM
+ *   already found) are dropped.  -F reads an image of memory instead of /dev/mem.
+ *
+ * - -C dir: content-addressed store (romstore.h) instead of a file per hit.  Each ROM
+ *   and each image is stored once under its hash; <dir>/index maps address to hash.
+ * - -D file: every ROM found goes into one dump container (dumpfile.h) as an extent at
+ *   its physical address, labelled with its vendor:device, instead of a file per hit.
+ * - -I db: a romdb(1) fingerprint database.  Each ROM found is named by its image hash,
+ *   else by its PCIR fields, in the report, its catalog and the store index.
+ * - Files and containers are written by an outpipe.h writer thread (io_uring when the
+ *   kernel has it) and made durable by one syncfs(2) at the end.
+ *
+ * Usage: pcifindrom -A 0x80000000 -L 0x80000000 -R /proc/iomem -T pci,bar,rom,reserved -j 8
  * 
  */
 #define _GNU_SOURCE
@@ -19,8 +46,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
+#include "memfault.h"
+#include "iomem.h"
+#include "pageindex.h"
+#include "pcirom.h"
+#include "romstore.h"
+#include "romdb.h"
+#include "outpipe.h"
+#include "dumpfile.h"
+
 /*
  * PCI bit encodings of pci_phys_hi of PCI 1275 address cell.
  */
@@ -66,25 +104,349 @@
 #define PCI_PDS_INDICATOR       0x15    /* Indicates if image is last in ROM */
 
 /*
- * PCI Memory search size.
+ * PCI Memory search size (default -L).
  */
 #define PCI_MEMORY_ROM_SIZE	0x10000
 
+#define DEFAULT_WINDOW		(16UL << 20)
+#define ROM_SPAN		(2UL << 20)	/* how far a ROM may run past its window */
+#define MAX_JOBS		1024
+
+struct window {
+	unsigned long	ws;
+	unsigned long	we;
+	unsigned long	hi;
+};
+
+/*
+ * A ROM found by a worker, with a copy of its readable bytes.
+ */
+struct found {
+	unsigned long	addr;
+	unsigned long	total;
+	unsigned long	avail;
+	int		nimg;
+	struct pcirom	img[PCIROM_MAX_IMAGES];
+	char		*bytes;
+};
+
 int 		iflag = 0;
 int 		aflag = 0;
 unsigned 	flataddr = 0;
-unsigned long   haystacklen = 0;
+char		*skipfile = NULL;
+struct skipmap	skip;
+char		*regionfile = NULL;
+int		regionmask = REGION_DEFAULT;
+char		*indexfile = NULL;
+struct pageindex pidx;
+unsigned long	align = PCIROM_ALIGN;
+
+int		scanfd;
+unsigned long	pagesize;
+unsigned long	window = DEFAULT_WINDOW;
+int		jobs = 1;
+struct window	*windows;
+unsigned long	nwindows, nexttake = 0;
+struct found	*found;
+unsigned long	nfound = 0, foundcap = 0;
+pthread_mutex_t	foundlock = PTHREAD_MUTEX_INITIALIZER;
+int		errors = 0;
+char		*storedir = NULL;
+struct romstore	store;
+unsigned long	storefailed = 0;
+char		*dumpfile = NULL;
+struct dumpw	dump;
+struct outpipe	out;
+char		*dbfile = NULL;
+struct romdb	db;
+
+/*
+ * Queue len bytes at p for filename; the writer closes it.
+ */
+static void save_file(const char *filename, const char *p, unsigned long len)
+{
+	int	fd;
+
+	if ((fd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0) {
+		perror("open(2)");
+		exit(1);
+	}
+	outpipe_write(&out, fd, 0, p, len, 1);
+}
+
+/*
+ * Save the ROM at physical addr as <addr>.rom, every image of its chain
+ * as <addr>.<n>.<code type>, and what each image is in <addr>.catalog.
+ * With -C they go to the store instead, the catalog as index comments;
+ * with -D the chain is one extent of the container.
+ * Only the avail readable bytes are written.  Returns the chain length.
+ */
+static unsigned long save_rom(unsigned long addr, const char *loc, unsigned long avail,
+			      struct pcirom *img, int nimg)
+{
+	char		filename[512], hash[ROMSTORE_HASHLEN + 1], label[32];
+	const char	*ident = NULL, *how = NULL;
+	unsigned long	total, len;
+	FILE		*cat;
+	int		i;
+
+	total = img[nimg - 1].offset + img[nimg - 1].length;
+	if (dbfile)
+		ident = romdb_identify(&db, loc, total < avail ? total : avail, &img[0], &how);
+	if (dumpfile) {
+		snprintf(label, sizeof(label), "rom %04x:%04x", img[0].vendor, img[0].device);
+		if (dumpw_add(&dump, addr, loc, total < avail ? total : avail, DUMP_SRC_ROM,
+			      total > avail ? DUMP_F_SHORT : 0, label) < 0)
+			__sync_fetch_and_add(&errors, 1);
+		fprintf(stderr, "     Found PCI Option ROM!! Loc @ %#lx, %d image%s, %#lx bytes.  Added to %s.\n",
+				addr, nimg, nimg == 1 ? "" : "s", total, dumpfile);
+		if (ident)
+			fprintf(stderr, "       Identified (%s): %s\n", how, ident);
+		for (i = 0; i < nimg; i++) {
+			fprintf(stderr, "       ");
+			pcirom_catalog(stderr, &img[i], i);
+		}
+		return total;
+	}
+	if (storedir) {
+		if (romstore_put(&store, loc, total < avail ? total : avail, addr, "rom", hash) < 0) {
+			storefailed++;
+			__sync_fetch_and_add(&errors, 1);
+		}
+		fprintf(stderr, "     Found PCI Option ROM!! Loc @ %#lx, %d image%s, %#lx bytes.  Stored as %s.\n",
+				addr, nimg, nimg == 1 ? "" : "s", total, hash);
+		if (ident) {
+			fprintf(stderr, "       Identified (%s): %s\n", how, ident);
+			fprintf(store.index, "# identity (%s): %s\n", how, ident);
+		}
+		for (i = 0; i < nimg; i++) {
+			fprintf(stderr, "       ");
+			pcirom_catalog(stderr, &img[i], i);
+			fprintf(store.index, "# ");
+			pcirom_catalog(store.index, &img[i], i);
+
+			if (img[i].offset >= avail)
+				continue;
+			len = avail - img[i].offset;
+			snprintf(filename, sizeof(filename), "image%d.%s", i,
+					PCIROM_NAME(pcirom_codetypes, img[i].codetype));
+			if (romstore_put(&store, loc + img[i].offset, img[i].length < len ? img[i].length : len,
+					 addr + img[i].offset, filename, NULL) < 0) {
+				storefailed++;
+				__sync_fetch_and_add(&errors, 1);
+			}
+		}
+		return total;
+	}
+
+	snprintf(filename, sizeof(filename), "%lx.rom", addr);
+	save_file(filename, loc, total < avail ? total : avail);
+	fprintf(stderr, "     Found PCI Option ROM!! Loc @ %#lx, %d image%s, %#lx bytes.  Saved to %s.\n",
+			addr, nimg, nimg == 1 ? "" : "s", total, filename);
+	if (ident)
+		fprintf(stderr, "       Identified (%s): %s\n", how, ident);
+
+	snprintf(filename, sizeof(filename), "%lx.catalog", addr);
+	if ((cat = fopen(filename, "w")) == NULL) {
+		perror("fopen(3)");
+		exit(1);
+	}
+	fprintf(cat, "# PCI option ROM at %#lx, %d images, %#lx bytes\n", addr, nimg, total);
+	if (ident)
+		fprintf(cat, "# identity (%s): %s\n", how, ident);
+
+	for (i = 0; i < nimg; i++) {
+		fprintf(stderr, "       ");
+		pcirom_catalog(stderr, &img[i], i);
+		pcirom_catalog(cat, &img[i], i);
+
+		if (img[i].offset >= avail)
+			continue;
+		len = avail - img[i].offset;
+		snprintf(filename, sizeof(filename), "%lx.%d.%s", addr, i,
+				PCIROM_NAME(pcirom_codetypes, img[i].codetype));
+		save_file(filename, loc + img[i].offset, img[i].length < len ? img[i].length : len);
+	}
+	fclose(cat);
+	return total;
+}
+
+/*
+ * Cut every planned region into windows.  A window owns the candidates
+ * starting in [ws, we) and maps up to ROM_SPAN more so the ROMs starting
+ * near its end can still be read whole.
+ */
+static int plan_windows(struct regions *plan)
+{
+	unsigned long	ws, we, end;
+	size_t		i;
+	int		pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		nwindows = 0;
+		for (i = 0; i < plan->n; i++) {
+			end = plan->r[i].end;
+			for (ws = plan->r[i].start; ws < end; ws = we) {
+				we = (end - ws > window) ? ws + window : end;
+				if (pass) {
+					windows[nwindows].ws = ws;
+					windows[nwindows].we = we;
+					windows[nwindows].hi = (end - we > ROM_SPAN) ? we + ROM_SPAN : end;
+				}
+				nwindows++;
+			}
+		}
+		if (!pass && (windows = calloc(nwindows ? nwindows : 1, sizeof(*windows))) == NULL) {
+			perror("calloc(3)");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void add_found(struct found *f)
+{
+	struct found	*v;
+
+	pthread_mutex_lock(&foundlock);
+	if (nfound == foundcap) {
+		foundcap = foundcap ? foundcap * 2 : 16;
+		if ((v = realloc(found, foundcap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		found = v;
+	}
+	found[nfound++] = *f;
+	pthread_mutex_unlock(&foundlock);
+}
+
+/*
+ * Check every aligned candidate starting in window k.  Every valid header
+ * is kept, even one inside a ROM found earlier: the windows are scanned
+ * out of order, so overlaps are only sorted out once they are all done.
+ */
+static int scan_window(unsigned long k)
+{
+	volatile unsigned long	ws = windows[k].ws;
+	unsigned long		we = windows[k].we;
+	unsigned long		hi = windows[k].hi;
+	unsigned long		mapaddr, maplen;
+	unsigned long		pos, bad, availend, idxstop, fault, n;
+	volatile unsigned long	stop, resume;	/* live across the sigsetjmp() */
+	const unsigned char	*loc;
+	unsigned char		*mem;
+	char * volatile		copy = NULL;
+	struct found		f;
+
+	mapaddr = ws & ~(pagesize - 1);
+	maplen = hi - mapaddr;
+	if ((mem = mmap(NULL, maplen, PROT_READ, MAP_SHARED, scanfd, (off_t)mapaddr)) == MAP_FAILED) {
+		perror("mmap(2)");
+		return -1;
+	}
+
+	pos = ws;
+	while (pos < we) {
+		/*
+		 * Search only up to the next known bad page, then hop over it.
+		 * Headers may be read up to the bad page even past the window.
+		 */
+		bad = skipmap_next(&skip, pos);
+		if (bad <= pos) {
+			pos = bad + pagesize;
+			continue;
+		}
+		stop = bad < we ? bad : we;
+		resume = bad < we ? bad + pagesize : we;
+		availend = bad < hi ? bad : hi;
+
+		/*
+		 * Hop over indexed pages without a signature.  Aligned
+		 * candidates never straddle a page.
+		 */
+		n = pageindex_next(&pidx, pos, stop, 0, PAGE_ROMSIG);
+		if (n != pos) {
+			pos = n;
+			continue;
+		}
+		idxstop = pageindex_runend(&pidx, pos, stop, 0, PAGE_ROMSIG);
+		if (idxstop < stop)
+			stop = resume = idxstop;
+
+		memfault_armed = 1;
+		if (sigsetjmp(memfault_jmp, 1) != 0) {
+			fault = (unsigned long)memfault_addr;
+			if (fault < (unsigned long)mem || fault >= (unsigned long)mem + maplen) {
+				fprintf(stderr, "pcifindrom: fault at %p outside the window\n", (void *)fault);
+				abort();
+			}
+			fault = mapaddr + (fault - (unsigned long)mem);
+			if (skipmap_add(&skip, fault))
+				fprintf(stderr, "      Unreadable page at %#lx, added to skip map.\n", fault & ~(pagesize - 1));
+			free(copy);
+			copy = NULL;
+			continue;
+		}
+
+		if ((loc = pcirom_find(mem + (pos - mapaddr), mem + (stop - mapaddr),
+				       mem + (availend - mapaddr), pos, align, &f.img[0])) == NULL) {
+			memfault_armed = 0;
+			pos = resume;
+			continue;
+		}
+
+		f.addr = mapaddr + (loc - mem);
+		f.nimg = pcirom_walk(loc, availend - f.addr, f.img, PCIROM_MAX_IMAGES);
+		f.total = f.img[f.nimg - 1].offset + f.img[f.nimg - 1].length;
+		f.avail = f.total < availend - f.addr ? f.total : availend - f.addr;
+		if ((copy = malloc(f.avail)) == NULL) {
+			perror("malloc(3)");
+			exit(1);
+		}
+		memcpy(copy, loc, f.avail);
+		memfault_armed = 0;
+
+		f.bytes = copy;
+		copy = NULL;
+		add_found(&f);
+		pos = f.addr + align;
+	}
+
+	munmap(mem, maplen);
+	return 0;
+}
+
+static void *worker(void *arg)
+{
+	unsigned long	k;
+
+	(void)arg;
+	while ((k = __sync_fetch_and_add(&nexttake, 1)) < nwindows)
+		if (scan_window(k) < 0)
+			__sync_fetch_and_add(&errors, 1);
+	return NULL;
+}
+
+static int found_cmp(const void *a, const void *b)
+{
+	const struct found *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
 
 int main(int argc, char **argv)
 {
         int              opt;
-        int              fd;
         int    	         i;
-        char             *rmem, *mem, *loc;
-	unsigned         ofs;
-	unsigned short   hdr = 0xAA55;
+	char		 *filename = "/dev/mem";
+	unsigned long	 addr = 0, limit = PCI_MEMORY_ROM_SIZE, n, keptend = 0;
+	unsigned long	 nroms = 0;
+	struct regions	 iomem = { 0 }, plan = { 0 };
+	pthread_t	 tid[MAX_JOBS];
+	size_t		 r;
 
-        while ((opt = getopt(argc, argv, "i:a:")) != -1) switch (opt) {
+        while ((opt = getopt(argc, argv, "i:a:A:C:D:F:I:L:W:g:j:R:S:T:X:")) != -1) switch (opt) {
                 case 'i':
                         iflag++;        /* Iterate through all ROM memory. */
                         break;
@@ -92,111 +454,163 @@ int main(int argc, char **argv)
                         aflag++;
                         flataddr = strtoul(optarg, NULL, 0);
                         break;
+                case 'A':
+                        addr = strtoul(optarg, NULL, 0);
+                        break;
+                case 'L':
+                        limit = strtoul(optarg, NULL, 0);
+                        break;
+                case 'F':
+                        filename = optarg;
+                        break;
+                case 'C':
+                        storedir = optarg;
+                        break;
+                case 'D':
+                        dumpfile = optarg;
+                        break;
+                case 'I':
+                        dbfile = optarg;
+                        break;
+                case 'W':
+                        window = strtoul(optarg, NULL, 0);
+                        break;
+                case 'j':
+                        jobs = strtoul(optarg, NULL, 0);
+                        if (jobs < 1 || jobs > MAX_JOBS) {
+                                fprintf(stderr, "pcifindrom: -j wants 1..%d\n", MAX_JOBS);
+                                exit(1);
+                        }
+                        break;
+                case 'R':
+                        regionfile = optarg;
+                        break;
+                case 'S':
+                        skipfile = optarg;
+                        break;
+                case 'X':
+                        indexfile = optarg;
+                        break;
+                case 'g':
+                        align = strtoul(optarg, NULL, 0);
+                        if (align < 2 || (align & (align - 1))) {
+                                fprintf(stderr, "pcifindrom: -g wants a power of two (512, 2048)\n");
+                                exit(1);
+                        }
+                        break;
+                case 'T':
+                        if ((regionmask = region_types_parse(optarg)) <= 0) {
+                                fprintf(stderr, "pcifindrom: bad -T '%s'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                default:
+                        fprintf(stderr, "Usage: pcifindrom [ -F /dev/mem ] [ -A base ] [ -L limit ] [ -W window ] [ -j jobs ]\n");
+                        fprintf(stderr, "                  [ -g align ] [ -R /proc/iomem [ -T rom,pci,bar,... ] ] [ -S skipmap ] [ -X pageindex ]\n");
+                        fprintf(stderr, "                  [ -C storedir | -D dumpfile ] [ -I romdb ]\n");
+                        exit(1);
         }
 
         if (!aflag)
                 flataddr = 0;
 
+	pagesize = getpagesize();
+	window = (window + pagesize - 1) & ~(pagesize - 1);
+	if (window == 0)
+		window = DEFAULT_WINDOW;
+
 	/*
-	 * Open /dev/mem cdev.
+	 * Plan which parts of the search area hold RAM/ROM worth searching.
 	 */
+	if (regionfile) {
+		if (regions_load(&iomem, regionfile) < 0 ||
+		    regions_plan(&iomem, regionmask, addr, limit, &plan) < 0)
+			exit(1);
+	} else if (regions_paint(&plan, addr, addr + limit, REGION_ALL) < 0) {
+		exit(1);
+	}
 
-        if ((fd = open("/dev/mem", O_RDWR)) < 0) {
-                perror("open(2)");
-                exit(1);
-        }
+	skipmap_init(&skip, pagesize);
+	if (skipfile)
+		skipmap_load(&skip, skipfile);
+	if (memfault_install() < 0)
+		exit(1);
+
+	if (indexfile) {
+		if (pageindex_open(&pidx, indexfile) < 0)
+			exit(1);
+		for (n = 0; n < pidx.npages; n++)
+			if (pidx.class[n] & PAGE_BAD)
+				skipmap_add(&skip, pidx.base + n * pidx.pagesize);
+		skip.dirty = 0;
+	}
 
-        /*
-         * mmap(2) 4GB of address space (32-bits full)
-         * Starting at the lowest address containing a ROM (usually PCI_VGA_ROM_START).
-         */
-        if ((mem =
-                mmap(NULL,
-		PCI_MEMORY_ROM_SIZE,
-	//	0x1000000,
-                PROT_READ|PROT_WRITE,
-                MAP_SHARED,
-                fd, (off_t)0L)) == NULL) {
-                perror("mmap(2)");
+	/*
+	 * Open /dev/mem cdev (or an image of it).
+	 */
+        if ((scanfd = open(filename, O_RDONLY)) < 0) {
+                perror("open(2)");
                 exit(1);
         }
+	if (plan_windows(&plan) < 0)
+		exit(1);
+	if (storedir && romstore_open(&store, storedir, "pcifindrom") < 0)
+		exit(1);
+	if (dbfile && romdb_open(&db, dbfile) < 0)
+		exit(1);
+	if (outpipe_start(&out, 1UL << 20) < 0)
+		exit(1);
+	if (dumpfile && dumpw_open(&dump, dumpfile, "pcifindrom", &out) < 0)
+		exit(1);
 
 	fprintf(stderr, "\n"
 		"Build without CONFIG_STRICT_DEVMEM kernel configuration setting!\n\n");
 
-	fprintf(stderr, "      Page Size = %d bytes (%#x).\n", getpagesize(), getpagesize());
-	fprintf(stderr, "      Mmap(2) of /dev/mem 4GB (%#x bytes) @ %p.  File desc = %d, PROT_READ|PROT_WRITE\n", PCI_MEMORY_ROM_SIZE, mem, fd);
-	fprintf(stderr, "           Searching for PCI Option ROM / Expansion ROM header (0xAA55)\n");
-	
-	haystacklen = PCI_MEMORY_ROM_SIZE;
-	rmem = mem;
-
-	for (;;) { 
-		int		romfd;
-		char 		filename[512], *ptr;
-		unsigned short 	*shptr;
-		unsigned	*pds;
-		unsigned	totalsz;
-		unsigned short  units;
-
-		hdr = 0xAA55;
-
-		printf("Calling memmem(%p, %zu, %p, %zu)...\n", mem, haystacklen, &hdr, sizeof(hdr));;
-		if ((loc = memmem(mem, haystacklen, &hdr, sizeof(hdr))) == NULL) {
-			fprintf(stderr, "\n     Finished search!\n");
-			munmap(rmem, PCI_MEMORY_ROM_SIZE);
-			close(fd);
-		}
-	
-		shptr = (unsigned short *) (loc + PCI_ROM_PCI_DATA_STRUCT_PTR);
-		pds = (unsigned *)shptr;
-                fprintf(stderr, "      PDS = loc + 0x18 (%p = %p + 0x18)\n", pds, loc);
-		fprintf(stderr, "      PDS dereferenced = %#x\n", *pds);
-
-                /*
-                 * Validate the PCI Data Structure Signature.
-                 * 0x52494350 = "PCIR"
-                 */
-
-		if (strncmp((char *)pds, "PCIR", 4) != 0) {
-			mem = loc + sizeof(hdr);
-			continue;
-		}
-
-		printf("     PCIR at %p (offset %p)!\n", ptr, ptr - rmem);
+	fprintf(stderr, "      Page Size = %lu bytes (%#lx).\n", pagesize, pagesize);
+	fprintf(stderr, "      Sweeping %s %#lx-%#lx: %lu windows of up to %#lx bytes on %d thread%s.\n",
+			filename, addr, addr + limit - 1, nwindows, window, jobs, jobs == 1 ? "" : "s");
+	if (regionfile)
+		for (r = 0; r < plan.n; r++)
+			fprintf(stderr, "           %#018lx-%#018lx  %s\n", plan.r[r].start, plan.r[r].end - 1,
+					region_name(plan.r[r].type));
+	fprintf(stderr, "           Searching for PCI Option ROM / Expansion ROM header (0xAA55) every %#lx bytes\n", align);
 
-		/*
-		 * Found a 0xAA55 where 0x18 bytes past is a pointer to a PDS struct starting with 'PCIR'.
-		 * 0x10 bytes later is the length of the ROM in 512 byte units.
-		 */
-		ptr += 0x10;
-		units = *(unsigned short *)&ptr[0];
-		totalsz = units * 512;
-		fprintf(stderr, "     PCIR PDS String Located at offset 0x0 from pointer at offset 0x18.\n");
-		fprintf(stderr, "     Units = %d * 512 byte blocks.  Total size = %d.\n", units, totalsz);	
-	
-		sprintf(filename, "%x.rom", loc);
-		if ((romfd = open(filename, O_RDWR)) < 0) {
-			perror("open(2)");
+	for (i = 0; i < jobs; i++)
+		if ((errno = pthread_create(&tid[i], NULL, worker, NULL)) != 0) {
+			perror("pthread_create(3)");
 			exit(1);
 		}
+	for (i = 0; i < jobs; i++)
+		pthread_join(tid[i], NULL);
 
-		/*
-		 * Write out (unsigned)units * 512 of data at 'loc' to ROM file descriptor.
-		 */
-		(void)write(romfd, loc, totalsz);
-		close(romfd);
-	
-		/*
-		 * Increment mem, decrement haystacklen.
-		 */
-		unsigned long tmp = (unsigned long)(loc + totalsz) - (unsigned long)rmem;
-
-		fprintf(stderr, "     Found PCI Option ROM!! Loc @ %p (Offset = %lu).  Saved to %s.\n", loc, (unsigned long)loc - (unsigned long)mem, filename);
-                mem = loc + totalsz;
-                haystacklen -= tmp;
+	/*
+	 * In address order, a header inside a ROM already kept (a later
+	 * image of its chain, or a copy of one) is not a ROM of its own.
+	 */
+	qsort(found, nfound, sizeof(*found), found_cmp);
+	for (n = 0; n < nfound; n++) {
+		if (found[n].addr >= keptend) {
+			save_rom(found[n].addr, found[n].bytes, found[n].avail, found[n].img, found[n].nimg);
+			keptend = found[n].addr + found[n].total;
+			nroms++;
+		}
+		free(found[n].bytes);
+	}
+	fprintf(stderr, "\n     Finished search!  %lu ROM%s.\n", nroms, nroms == 1 ? "" : "s");
+	if (storedir) {
+		fprintf(stderr, "     Store %s: %lu new objects (%lu bytes), %lu already there, %lu failed.\n",
+				storedir, store.stored, store.bytes, store.deduped, storefailed);
+		if (romstore_close(&store) < 0)
+			errors++;
 	}
+	if (dumpfile && dumpw_close(&dump) < 0)
+		errors++;
+	if (outpipe_finish(&out, 1) < 0)
+		errors++;
+	fprintf(stderr, "     Wrote %lu bytes in %lu batches through %s.\n", out.bytes, out.batches, out.engine);
+	close(scanfd);
 
-        close(fd);
-        exit(0);
+	if (skipfile)
+		skipmap_save(&skip, skipfile);
+        exit(errors ? 1 : 0);
 }
@@ -15,6 +15,9 @@
  * - The write(2) syscall is used to dereference the entire memory space (nbytes)...
  *   TODO: Check if the same behavior occurs with my own dereferences (read dereferences), if not, 
  *	   this might be specific to the write(2) syscall or syscall context behavior touch this memory.
+ * - -D: outfile is a dump container (dumpfile.h) holding the mapping as one extent at the
+ *   BAR's physical address (from the device's sysfs resource file), so findmem -F outfile
+ *   reports hits at bus addresses.  The bytes still go out through write(2).
  *         
  * 
  *    - JS 04/2016
@@ -31,27 +34,63 @@
 
 #include <sys/mman.h>
 
+#include "dumpfile.h"
+
 #define PAGE_SIZE        getpagesize()
 #define ROUND_PAGE(x)    ((void *)(((unsigned long)(x)) & ~((unsigned long)(PAGE_SIZE - 1))))      
 
+/*
+ * Physical start of .../resourceN, from line N of .../resource, or 0.
+ */
+static unsigned long resource_start(const char *pcidev)
+{
+        char            path[512], line[256], *p;
+        unsigned long   start = 0;
+        unsigned        n, i;
+        FILE            *fp;
+
+        if ((p = strrchr(pcidev, '/')) == NULL || sscanf(p, "/resource%u", &n) != 1)
+                return 0;
+        snprintf(path, sizeof(path), "%.*s/resource", (int)(p - pcidev), pcidev);
+        if ((fp = fopen(path, "r")) == NULL)
+                return 0;
+        for (i = 0; fgets(line, sizeof(line), fp) != NULL; i++)
+                if (i == n) {
+                        start = strtoul(line, NULL, 0);
+                        break;
+                }
+        fclose(fp);
+        return start;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr, "Usage: %s [-D] [-N nbytes] /sys/devices/pciXXXX:XX/path/resourceN outfile\n", prog);
+        fprintf(stderr, "Usage: %s [-D] [-N nbytes] [-c pcictlr] [-b pcibus] [-l pcilun] [-f pcifn] [-r pciresource] outfile\n", prog);
+        exit(1);
+}
+
 int main(int argc, char **argv)
 {
         int             opt;
         unsigned        ctrlr, bus, lun, fn, resnum;
         int             fd, savefd;
         unsigned        nbytes = 0;
+        int             dflag = 0, clamped = 0;
+        unsigned long   phys;
+        struct dumpw    dump;
         char            *mem;
         char            *filename;
         char            pcidev[512];
         struct  stat    sb;
 
-        if (argc < 3) {
-                fprintf(stderr, "Usage: %s [-N nbytes] /sys/devices/pciXXXX:XX/path/resourceN outfile\n", argv[0]);
-                fprintf(stderr, "Usage: %s [-N nbytes] [-c pcictlr] [-b pcibus] [-l pcilun] [-f pcifn] [-r pciresource] outfile\n", argv[0]);
-                exit(1);
-        }
+        if (argc < 3)
+                usage(argv[0]);
 
-        while ((opt = getopt(argc, argv, "N:c:b:l:f:r:")) != -1) switch(opt) {
+        while ((opt = getopt(argc, argv, "DN:c:b:l:f:r:")) != -1) switch(opt) {
+                case 'D':
+                        dflag++;
+                        break;
                 case 'N':
                         nbytes = strtoul(optarg, NULL, 0);
                         break;
@@ -72,6 +111,11 @@ int main(int argc, char **argv)
                         break;
         }
 
+	/* outfile follows the resource path, or is all there is */
+	if (optind >= argc || (argv[optind][0] == '/' && optind + 1 >= argc))
+		usage(argv[0]);
+	filename = argv[optind][0] == '/' ? argv[optind + 1] : argv[optind];
+
 	if (optind > 0) 
 		if (argv[optind][0] == '/') {
 			strncpy(pcidev, argv[optind], 510);
@@ -90,8 +134,6 @@ int main(int argc, char **argv)
                 exit(1);
         }
 
-        filename = argv[2];
-
         if (lstat(pcidev, &sb) != 0) {
                 perror("lstat(2)");
                 exit(1);
@@ -100,6 +142,15 @@ int main(int argc, char **argv)
         if (nbytes == 0) 
                 nbytes = (unsigned)sb.st_size;
 
+        /*
+         * A container extent holds what the resource has, no more: past its
+         * end the mapping only faults.  Asking for more marks it short.
+         */
+        if (dflag && nbytes > sb.st_size) {
+                nbytes = (unsigned)sb.st_size;
+                clamped = 1;
+        }
+
         fprintf(stderr, "\n"
                         "       Opened sysfs resource: %s.  File desc=%d\n", pcidev, fd);
         fprintf(stderr, "       Mmap(2) with PROT_READ and MAP_SHARED returns memory mapped file @ %p\n", mem);
@@ -112,6 +163,23 @@ int main(int argc, char **argv)
                 exit(1);
         }
 
+	/*
+	 * Or write it as an extent of a container, at its bus address.
+	 */
+        if (dflag) {
+                phys = resource_start(pcidev);
+                fprintf(stderr, "       Writing %zu bytes at %#lx to dump container %s.\n",
+                                (size_t)nbytes, phys, filename);
+                if (dumpw_open(&dump, filename, "pcimmap-ex", NULL) < 0 ||
+                    dumpw_add(&dump, phys, mem, (size_t)nbytes, DUMP_SRC_BAR,
+                              clamped ? DUMP_F_SHORT : 0, strrchr(pcidev, '/') + 1) < 0 ||
+                    dumpw_close(&dump) < 0)
+                        exit(1);
+                (void) munmap(mem, (size_t)nbytes);
+                close(fd);
+                exit(0);
+        }
+
 	/*
 	 * Open the output file. 
 	 */
@@ -0,0 +1,449 @@
+/*
+ * pcimmio(1) - Walk PCI(e) config space through the memory-mapped ECAM window.
+ *
+ * - No IN/OUT to 0xcf8/0xcfc and no /sys/bus/pci: the MMCONFIG window
+ *   (0x80000000-0x90000000 by default, or where the ACPI MCFG table says)
+ *   is mmap(2)ed once from /dev/mem and every bus:device.function is found
+ *   by shifting (pcicfg.h).  Devices the host bridge hides from the normal
+ *   enumeration (Intel DEVHIDE) may still answer here.
+ * - Every bus in the window is walked, not just the ones bridges point to.
+ *   A device is probed at function 0, and at 1..7 if it is multi-function
+ *   (-a probes all eight anyway).
+ * - -F image walks a raw capture of the window instead, offline.  Its
+ *   offset 0 is bus 0.
+ * - -x dumps the first 64 bytes of each function's config space, -xx 256,
+ *   -xxx all 4096.
+ * - -c decodes each function's capabilities and extended capabilities
+ *   (PCIe, MSI/MSI-X, AER, SR-IOV, ACS, ...; the tables are in pcicap.h).
+ *   -O json prints one object per function, capabilities included, so a
+ *   whole topology is one line per function of JSON.
+ * - Every function found is scored by the pcicfg.h classifier (0-100, 0
+ *   being not config space at all) and ones under -m (default 1) are
+ *   reported as rejected, with the reason, instead of listed.
+ * - -s scans every -z byte block (4096, or 256 for plain PCI copies) of
+ *   the window, or with -L of any [-A, -A + L) of the file (a RAM dump,
+ *   /dev/mem), for config space: a vector pre-filter over batches of
+ *   blocks, then the scalar classifier on the survivors.  Blocks scoring
+ *   -m (default 50) or more are listed best first.
+ * - -w period watches every function the walk listed: each is polled
+ *   every period seconds (fractions allowed) and every dword that changed
+ *   is printed with the time and the register or capability it is in
+ *   (-O json: one object per change), until SIGINT or -n polls.  Only the
+ *   header and the blocks that held something are read, and the period
+ *   stretches rather than let the watch take over 1% of a core
+ *   (cfgwatch.h).  SIGUSR1 prints the last CFGW_RING changes to stderr.
+ * - SIGBUS/SIGSEGV on a function's page is reported and the walk goes on.
+ * - A timing line goes to stderr: the walk costs a load per register, not
+ *   a pread(2) of a sysfs config file.
+ *
+ * Usage: pcimmio [ -F /dev/mem | -F image ] [ -A base ] [ -b lo[-hi] ] [ -a ] [ -x[x[x]] ] [ -m min ]
+ *                [ -c ] [ -O text|json ] [ -w period [ -n polls ] ]
+ *        pcimmio -s [ -F file ] [ -A addr -L len ] [ -z 256|4096 ] [ -m min ]
+ *
+ * Build: cc -O2 -o pcimmio pcimmio.c
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "memfault.h"
+#include "pcicfg.h"
+#include "pcicap.h"
+#include "cfgwatch.h"
+
+#define SCAN_BATCH	(64UL << 10)	/* bytes of blocks pre-filtered at a time */
+
+/*
+ * A block -s kept.
+ */
+struct found {
+	unsigned long	addr;
+	uint32_t	id;
+	uint32_t	class;
+	uint8_t		hdr;
+	struct cfgscore	cs;
+};
+
+char		*filename = "/dev/mem";
+int		aflag = 0;
+int		xflag = 0;
+int		cflag = 0;
+int		jsonout = 0;
+int		minscore = -1;
+double		period = 0;
+struct cfgwatch	watch;
+struct found	*found;
+size_t		nfound, foundcap;
+
+static void hexdump(const unsigned char *cfg, unsigned len)
+{
+	unsigned	reg, i;
+	uint32_t	v;
+
+	for (reg = 0; reg < len; reg += 16) {
+		printf("%03x:", reg);
+		for (i = 0; i < 16; i += 4) {
+			v = cfg_read32(cfg, reg + i);
+			printf(" %02x %02x %02x %02x", v & 0xff, v >> 8 & 0xff, v >> 16 & 0xff, v >> 24);
+		}
+		printf("\n");
+	}
+	printf("\n");
+}
+
+static void watch_add(const struct ecam *e, unsigned bus, unsigned dev, unsigned fn, const unsigned char *cfg)
+{
+	char	name[16];
+
+	snprintf(name, sizeof(name), "%04x:%02x:%02x.%x", e->segment, bus, dev, fn);
+	if (cfgwatch_add(&watch, name, cfg, -1, ECAM_FN_SIZE) < 0)
+		exit(1);
+}
+
+/*
+ * Print bus:dev.fn if something answers there.  Returns its header type,
+ * or -1 if nothing does.
+ */
+static int probe(const struct ecam *e, unsigned bus, unsigned dev, unsigned fn, unsigned long *found)
+{
+	const unsigned char	*cfg = ecam_fn(e, bus, dev, fn);
+	struct cfgscore		cs;
+	uint32_t		id, class;
+	uint8_t			hdr;
+
+	memfault_armed = 1;
+	if (sigsetjmp(memfault_jmp, 1) != 0) {
+		fprintf(stderr, "%04x:%02x:%02x.%x: unreadable (fault at %p)\n", e->segment, bus, dev, fn,
+				memfault_addr);
+		return -1;
+	}
+	id = cfg_read32(cfg, CFG_VENDOR_ID);
+	if ((id & 0xffff) == 0xffff || (id & 0xffff) == 0) {
+		memfault_armed = 0;
+		return -1;
+	}
+	class = cfg_read32(cfg, CFG_REVISION);
+	hdr = cfg_read8(cfg, CFG_HEADER_TYPE);
+	if (cfg_score(cfg, ECAM_FN_SIZE, &cs) < minscore) {
+		memfault_armed = 0;
+		fprintf(stderr, "%04x:%02x:%02x.%x %04x:%04x rejected, score %d%s%s\n", e->segment, bus, dev, fn,
+				id & 0xffff, id >> 16, cs.score, cs.why ? ": " : "", cs.why ? cs.why : "");
+		return -1;
+	}
+	if (period > 0)
+		watch_add(e, bus, dev, fn, cfg);
+
+	if (jsonout) {
+		printf("{ \"bdf\": \"%04x:%02x:%02x.%x\", \"vendor\": \"0x%04x\", \"device\": \"0x%04x\", "
+		       "\"revision\": %u, \"class\": \"0x%06x\", \"header_type\": %u, \"multifunction\": %s, "
+		       "\"score\": %d, ", e->segment, bus, dev, fn, id & 0xffff, id >> 16, class & 0xff, class >> 8,
+		       hdr & 0x7f, hdr & CFG_HEADER_MULTIFN ? "true" : "false", cs.score);
+		pcicap_print(stdout, cfg, ECAM_FN_SIZE, 1);
+		printf(" }\n");
+		memfault_armed = 0;
+		(*found)++;
+		return hdr;
+	}
+	printf("%04x:%02x:%02x.%x %04x:%04x rev %02x class %06x hdr %02x score %d%s\n", e->segment, bus, dev, fn,
+	       id & 0xffff, id >> 16, class & 0xff, class >> 8, hdr & 0x7f, cs.score,
+	       hdr & CFG_HEADER_MULTIFN ? " multi" : "");
+	if (cflag)
+		pcicap_print(stdout, cfg, ECAM_FN_SIZE, 0);
+	if (xflag)
+		hexdump(cfg, xflag == 1 ? 64 : xflag == 2 ? 256 : ECAM_FN_SIZE);
+	memfault_armed = 0;
+	(*found)++;
+	return hdr;
+}
+
+static void keep(const unsigned char *cfg, unsigned long addr, size_t len)
+{
+	struct found	*f;
+	struct cfgscore	cs;
+
+	if (cfg_score(cfg, len, &cs) < minscore)
+		return;
+	if (nfound == foundcap) {
+		foundcap = foundcap ? foundcap * 2 : 256;
+		if ((f = realloc(found, foundcap * sizeof(*f))) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		found = f;
+	}
+	f = &found[nfound++];
+	f->addr = addr;
+	f->id = cfg_read32(cfg, CFG_VENDOR_ID);
+	f->class = cfg_read32(cfg, CFG_REVISION) >> 8;
+	f->hdr = cfg_read8(cfg, CFG_HEADER_TYPE);
+	f->cs = cs;
+}
+
+static int found_cmp(const void *a, const void *b)
+{
+	const struct found *x = a, *y = b;
+
+	if (x->cs.score != y->cs.score)
+		return y->cs.score - x->cs.score;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/*
+ * Pre-filter and score n blocks at p.  Returns how many got past the
+ * pre-filter, or -1 if a page faulted.
+ */
+static long scan_batch(const unsigned char *p, size_t n, unsigned long addr, size_t bsize)
+{
+	size_t	idx[SCAN_BATCH / 256];
+	size_t	k, i;
+
+	memfault_armed = 1;
+	if (sigsetjmp(memfault_jmp, 1) != 0)
+		return -1;
+	k = cfg_candidates(p, n, bsize, idx);
+	for (i = 0; i < k; i++)
+		keep(p + idx[i] * bsize, addr + idx[i] * bsize, bsize);
+	memfault_armed = 0;
+	return k;
+}
+
+/*
+ * Score every bsize block of the len bytes mapped at p, which sit at
+ * address addr.  A batch that faults is done again a block at a time,
+ * leaving out the ones that fault.  Returns the number of blocks that got
+ * past the pre-filter.
+ */
+static unsigned long scan(const unsigned char *p, size_t len, unsigned long addr, size_t bsize)
+{
+	unsigned long	passed = 0;
+	size_t		off, n, i;
+	long		k;
+
+	for (off = 0; off < len; off += n * bsize) {
+		n = (len - off < SCAN_BATCH ? len - off : SCAN_BATCH) / bsize;
+		if (n == 0)
+			break;
+		if ((k = scan_batch(p + off, n, addr + off, bsize)) >= 0) {
+			passed += k;
+			continue;
+		}
+		fprintf(stderr, "       Fault at %#lx, going through its batch a block at a time.\n",
+				addr + ((unsigned char *)memfault_addr - p));
+		for (i = 0; i < n; i++)
+			if ((k = scan_batch(p + off + i * bsize, 1, addr + off + i * bsize, bsize)) > 0)
+				passed += k;
+	}
+	return passed;
+}
+
+int main(int argc, char **argv)
+{
+	struct ecam	e;
+	struct timespec	t0, t1;
+	struct stat	sb;
+	unsigned long	base = ECAM_DEFAULT_BASE, probed = 0, nfunc = 0, limit = 0, passed, off;
+	unsigned	segment = 0, lo = 0, hi = 255, bus, dev, fn;
+	unsigned long	polls = 0;
+	int		opt, hdr, aset = 0, bset = 0, sflag = 0, bdf = 0, fd;
+	size_t		bsize = ECAM_FN_SIZE, i;
+	const unsigned char *map;
+	double		us;
+	char		*p;
+
+	while ((opt = getopt(argc, argv, "F:A:L:O:b:m:n:w:sz:acx")) != -1) switch (opt) {
+		case 'F':
+			filename = optarg;
+			break;
+		case 'A':
+			base = strtoul(optarg, NULL, 0);
+			aset++;
+			break;
+		case 'b':
+			lo = hi = strtoul(optarg, &p, 0);
+			if (*p == '-')
+				hi = strtoul(p + 1, NULL, 0);
+			if (lo > hi || hi > 255) {
+				fprintf(stderr, "pcimmio: -b wants lo-hi within 0-255\n");
+				exit(1);
+			}
+			bset++;
+			break;
+		case 'L':
+			limit = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			minscore = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			if ((period = strtod(optarg, NULL)) <= 0) {
+				fprintf(stderr, "pcimmio: -w wants a period in seconds\n");
+				exit(1);
+			}
+			break;
+		case 'n':
+			polls = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sflag++;
+			break;
+		case 'z':
+			bsize = strtoul(optarg, NULL, 0);
+			if (bsize != 256 && bsize != ECAM_FN_SIZE) {
+				fprintf(stderr, "pcimmio: -z wants 256 or 4096\n");
+				exit(1);
+			}
+			break;
+		case 'a':
+			aflag++;
+			break;
+		case 'x':
+			xflag++;
+			break;
+		case 'c':
+			cflag++;
+			break;
+		case 'O':
+			if (strcmp(optarg, "json") == 0)
+				jsonout = 1;
+			else if (strcmp(optarg, "text") == 0)
+				jsonout = 0;
+			else {
+				fprintf(stderr, "pcimmio: -O wants text or json\n");
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: pcimmio [ -F /dev/mem | -F image ] [ -A base ] [ -b lo[-hi] ] [ -a ] [ -x[x[x]] ] [ -m min ]\n");
+			fprintf(stderr, "               [ -c ] [ -O text|json ] [ -w period [ -n polls ] ]\n");
+			fprintf(stderr, "       pcimmio -s [ -F file ] [ -A addr -L len ] [ -z 256|4096 ] [ -m min ]\n");
+			exit(1);
+	}
+	if (minscore < 0)
+		minscore = sflag ? 50 : 1;
+	if (memfault_install() < 0)
+		exit(1);
+
+	/*
+	 * -s -L: any range of any file, its offset being the address.
+	 */
+	if (sflag && limit) {
+		off = base & ~((unsigned long)getpagesize() - 1);
+		limit += base - off;
+		if ((fd = open(filename, O_RDONLY)) < 0) {
+			perror("open(2)");
+			exit(1);
+		}
+		if ((map = mmap(NULL, limit, PROT_READ, MAP_SHARED, fd, off)) == MAP_FAILED) {
+			perror("mmap(2)");
+			exit(1);
+		}
+		(void)madvise((void *)map, limit, MADV_SEQUENTIAL);
+		fprintf(stderr, "       Scanning %#lx-%#lx of %s for config space in %zu byte blocks.\n",
+				off, off + limit - 1, filename, bsize);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		passed = scan(map, limit, off, bsize);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		munmap((void *)map, limit);
+		close(fd);
+		goto report;
+	}
+
+	/*
+	 * Where the window is: -A, else the MCFG table, else the default.
+	 * An image is not this host's window, so the table is no use for it.
+	 */
+	if (stat(filename, &sb) == 0 && S_ISREG(sb.st_mode)) {
+		if (!bset)
+			hi = 255;
+	} else if (!aset || !bset) {
+		unsigned long	mbase;
+		unsigned	mseg, mlo, mhi;
+
+		if (ecam_mcfg(MCFG_PATH, &mbase, &mseg, &mlo, &mhi) == 0) {
+			if (!aset) {
+				base = mbase;
+				segment = mseg;
+			}
+			if (!bset) {
+				lo = mlo;
+				hi = mhi;
+			}
+			fprintf(stderr, "       MCFG: segment %u, buses %02x-%02x at %#lx.\n", mseg, mlo, mhi, mbase);
+		}
+	}
+
+	if (ecam_open(&e, filename, base, lo, hi) < 0)
+		exit(1);
+	e.segment = segment;
+
+	if (sflag) {
+		fprintf(stderr, "       Scanning buses %02x-%02x of %s for config space in %zu byte blocks.\n",
+				e.startbus, e.endbus, filename, bsize);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		passed = scan(e.map, e.len, e.base, bsize);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		limit = e.len;
+		base = e.base;
+		lo = e.startbus;
+		bdf = bsize == ECAM_FN_SIZE;
+		ecam_close(&e);
+		goto report;
+	}
+
+	if (e.image)
+		fprintf(stderr, "       Walking buses %02x-%02x of the ECAM image %s (%#zx bytes mapped).\n",
+				e.startbus, e.endbus, filename, e.len);
+	else
+		fprintf(stderr, "       Walking buses %02x-%02x of the ECAM window at %#lx-%#lx through %s.\n",
+				e.startbus, e.endbus, e.base, e.base + e.len - 1, filename);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (bus = e.startbus; bus <= e.endbus; bus++)
+		for (dev = 0; dev < 32; dev++) {
+			probed++;
+			hdr = probe(&e, bus, dev, 0, &nfunc);
+			if (hdr < 0 && !aflag)
+				continue;
+			if (!aflag && !(hdr & CFG_HEADER_MULTIFN))
+				continue;
+			for (fn = 1; fn < 8; fn++) {
+				probed++;
+				probe(&e, bus, dev, fn, &nfunc);
+			}
+		}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+	fprintf(stderr, "       %lu functions found, %lu probed on %u buses in %.1f us (%.3f us per probe).\n",
+			nfunc, probed, e.endbus - e.startbus + 1, us, probed ? us / probed : 0.0);
+
+	if (period > 0 && nfunc) {
+		watch.json = jsonout;
+		cfgwatch_run(&watch, stdout, period, polls);
+		cfgwatch_free(&watch);
+	}
+
+	ecam_close(&e);
+	exit(nfunc ? 0 : 1);
+
+report:
+	qsort(found, nfound, sizeof(*found), found_cmp);
+	for (i = 0; i < nfound; i++) {
+		printf("0x%016lx score %3d %04x:%04x class %06x hdr %02x caps %d ext %d", found[i].addr,
+		       found[i].cs.score, found[i].id & 0xffff, found[i].id >> 16, found[i].class,
+		       found[i].hdr & 0x7f, found[i].cs.caps, found[i].cs.extcaps);
+		if (bdf) {
+			off = found[i].addr - base;
+			printf(" %04x:%02x:%02x.%x", segment, (unsigned)(lo + (off >> ECAM_BUS_SHIFT)),
+			       (unsigned)(off >> ECAM_DEV_SHIFT & 31), (unsigned)(off >> ECAM_FN_SHIFT & 7));
+		}
+		printf("\n");
+	}
+	us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+	fprintf(stderr, "       %lu blocks, %lu past the pre-filter, %zu scoring %d or more, in %.1f ms (%.0f MB/s).\n",
+			limit / bsize, passed, nfound, minscore, us / 1e3, us > 0 ? limit / us : 0.0);
+	exit(nfound ? 0 : 1);
+}
@@ -6,6 +6,25 @@
  * - Rewritten to use mmap(2)
  * - VGA ROMs are at 0xc0000 - 0xc7fff (on 2kb boundaries)
  * - Non-VGA ROMs are at 0xc8000 - 0xf0000 (on 2kb boundaries)
+ * - Unreadable pages (SIGBUS/SIGSEGV) are zero-filled in the dump and kept in the
+ *   -S skip map instead of killing the run.  Known bad pages are never touched.
+ * - -X index from pageindex(1): pages it saw as all 0x00 or all 0xff are filled in
+ *   without reading /dev/mem at all.
+ * - -C dir: content-addressed store (romstore.h) instead of a <addr>.rom per step.  The
+ *   55 aa chain is walked as for -r and each real image is stored once, at its own size;
+ *   an area with no image in it at all is stored once whole instead.  <dir>/index maps
+ *   each address to its hash.
+ * - -D file: one dump container (dumpfile.h) instead of a <addr>.rom per step (or -C), holding
+ *   the VGA and expansion ROM areas once each as extents at their physical addresses.
+ *   findmem -F file scans it; each <addr>.rom is just 64KB of it from <addr>.
+ * - Output goes through outpipe.h: this thread copies from /dev/mem into a ring of
+ *   buffers while a writer thread drains it (io_uring if the kernel has it), and one
+ *   syncfs(2) at the end replaces the fsync(2) that used to follow every 2KB step.
+ * - -r: real images only.  A 2KB step is kept only if it starts 55 aa with a non-zero
+ *   length byte at +0x02 (512-byte units) and its bytes sum to zero; each image is
+ *   written once at its own size as <addr>.rom (or into -C / -D) and the walk carries
+ *   on after it.  Tens of KB instead of 95 64KB files.
+ * - -I db with -r: name each image from a romdb(1) fingerprint database.
  * 
  */
 #include <stdio.h>
@@ -17,6 +36,14 @@
 #include <strings.h>
 #include <sys/mman.h>
 
+#include "memfault.h"
+#include "pageindex.h"
+#include "pcirom.h"
+#include "romstore.h"
+#include "romdb.h"
+#include "outpipe.h"
+#include "dumpfile.h"
+
 #define VGA_ROM_START           0xC0000
 #define VGA_ROM_END             0xC7FFF
 
@@ -26,18 +53,246 @@
 #define STEP                    2048
 #define LENGTH			65535
 
+#define MAP_LENGTH		0x100000	/* first 1MB covers every dump */
+#define IMAGE_MAX		(255 * 512)	/* length byte at +0x02 */
+#define AREA_END		MAP_LENGTH	/* last 64KB window ends below here */
+
 #define ROUND_DOWN(n)           ((n) & (~(STEP-1))
 #define ROUND_UP(n)             (((n) + STEP-1) & (~(STEP-1)))
 
 unsigned flataddr = 0;
 unsigned step     = STEP;
 
+char		*skipfile = NULL;
+struct skipmap	skip;
+char		*indexfile = NULL;
+struct pageindex pidx;
+char		*storedir = NULL;
+struct romstore	store;
+char		*dumpfile = NULL;
+struct outpipe	out;
+int		rflag = 0;
+char		*dbfile = NULL;
+struct romdb	db;
+char		imgbuf[IMAGE_MAX];
+
+/*
+ * Copy n bytes of one page under the fault guard.  Nothing here is live
+ * across the jump.  Returns -1 if the page faulted.
+ */
+static int copy_page(char *dst, const char *src, size_t n)
+{
+        memfault_armed = 1;
+        if (sigsetjmp(memfault_jmp, 1) != 0)
+                return -1;
+        memcpy(dst, src, n);
+        memfault_armed = 0;
+        return 0;
+}
+
+/*
+ * Copy len bytes at physical address phys (mem maps physical 0) into dst
+ * a page at a time.  Pages in the skip map, or that fault, read as zeros.
+ * Pages the index saw uniform are filled from it.  Returns the number of
+ * pages zero-filled.
+ */
+static int copy_guarded(char *dst, char *mem, unsigned long phys, size_t len)
+{
+        unsigned long   pagesize = getpagesize();
+        unsigned long   page, fault;
+        size_t          n;
+        int             bad = 0;
+
+        while (len > 0) {
+                page = phys & ~(pagesize - 1);
+                n = page + pagesize - phys;
+                if (n > len)
+                        n = len;
+
+                if (skipmap_next(&skip, phys) == page) {
+                        memset(dst, 0, n);
+                        bad++;
+                } else if (pageindex_class(&pidx, phys) & (PAGE_ZERO | PAGE_FF)) {
+                        memset(dst, (pageindex_class(&pidx, phys) & PAGE_FF) ? 0xff : 0, n);
+                } else if (copy_page(dst, mem + phys, n) < 0) {
+                        fault = (unsigned long)memfault_addr - (unsigned long)mem;
+                        if (skipmap_add(&skip, fault))
+                                fprintf(stderr, "Unreadable page at %#lx, added to skip map.\n", page);
+                        memset(dst, 0, n);
+                        bad++;
+                }
+
+                dst += n;
+                phys += n;
+                len -= n;
+        }
+        return bad;
+}
+
+/*
+ * Copy [start, end) out of mem and append it to the container as one
+ * extent.
+ */
+static int dump_area(struct dumpw *w, char *mem, unsigned long start, unsigned long end,
+                     const char *label)
+{
+        char    *buf;
+        int     bad, error;
+
+        if ((buf = malloc(end - start)) == NULL) {
+                perror("malloc(3)");
+                return -1;
+        }
+        bad = copy_guarded(buf, mem, start, end - start);
+        error = dumpw_add(w, start, buf, end - start, DUMP_SRC_DEVMEM,
+                          bad ? DUMP_F_ZEROFILL : 0, label);
+        free(buf);
+        return error;
+}
+
+/*
+ * -C: store [start, end) as one object, for an area without any image.
+ */
+static int store_area(char *mem, unsigned long start, unsigned long end, const char *label)
+{
+        char    *buf;
+        int     error;
+
+        if ((buf = malloc(end - start)) == NULL) {
+                perror("malloc(3)");
+                return -1;
+        }
+        copy_guarded(buf, mem, start, end - start);
+        error = romstore_put(&store, buf, end - start, start, label, NULL);
+        free(buf);
+        return error;
+}
+
+/*
+ * -r: save the image of len bytes at addr to the container, the store or
+ * <addr>.rom.
+ */
+static int save_image(struct dumpw *w, unsigned long addr, const char *img, unsigned long len)
+{
+        char    filename[512];
+        int     romfd;
+
+        if (w)
+                return dumpw_add(w, addr, img, len, DUMP_SRC_ROM, 0,
+                                 addr < NON_VGA_ROM_START ? "vga" : "expansion");
+        if (storedir)
+                return romstore_put(&store, img, len, addr, "image", NULL);
+
+        sprintf(filename, "%lx.rom", addr);
+        if ((romfd = open(filename, O_CREAT|O_WRONLY|O_TRUNC, 0600)) < 0) {
+                perror("open(2)");
+                fprintf(stderr, "filename was %s\n", filename);
+                return -1;
+        }
+        outpipe_write(&out, romfd, 0, img, len, 1);
+        return 0;
+}
+
+/*
+ * -r: walk both areas on 2KB steps, saving each image that holds up and
+ * resuming at the first step after it.  Returns the number saved, and
+ * per area (VGA, expansion) in perarea if it is not NULL.
+ */
+static int dump_images(char *mem, struct dumpw *w, int perarea[2])
+{
+        unsigned long   addr, len;
+        struct pcirom   rom;
+        const char      *ident, *how;
+        int             nimg = 0, pcir;
+
+        for (addr = VGA_ROM_START; addr < NON_VGA_ROM_END; addr += STEP) {
+                copy_guarded(imgbuf, mem, addr, 3);
+                if ((unsigned char)imgbuf[0] != 0x55 || (unsigned char)imgbuf[1] != 0xaa ||
+                    imgbuf[2] == 0)
+                        continue;
+
+                len = (unsigned char)imgbuf[2] * 512UL;
+                if (addr + len > MAP_LENGTH)
+                        len = MAP_LENGTH - addr;
+                if (copy_guarded(imgbuf, mem, addr, len) != 0) {
+                        fprintf(stderr, "%#lx: 55 aa, %#lx bytes, unreadable pages, skipped.\n", addr, len);
+                        continue;
+                }
+                if ((pcirom_sum((unsigned char *)imgbuf, len) & 0xff) != 0) {
+                        fprintf(stderr, "%#lx: 55 aa, %#lx bytes, bad checksum, skipped.\n", addr, len);
+                        continue;
+                }
+
+                fprintf(stderr, "%#lx: %#lx bytes, ", addr, len);
+                if ((pcir = pcirom_check((unsigned char *)imgbuf, len, &rom)) != 0)
+                        pcirom_catalog(stderr, &rom, 0);
+                else
+                        fprintf(stderr, "no PCI data structure (legacy ROM)\n");
+                if (dbfile && (ident = romdb_identify(&db, imgbuf, len, pcir ? &rom : NULL, &how)) != NULL)
+                        fprintf(stderr, "%#lx: identified (%s): %s\n", addr, how, ident);
+                if (save_image(w, addr, imgbuf, len) < 0)
+                        return -1;
+                if (perarea)
+                        perarea[addr >= NON_VGA_ROM_START]++;
+                nimg++;
+                addr = ROUND_UP(addr + len) - STEP;
+        }
+        return nimg;
+}
+
 int main(int argc, char **argv)
 {
         int     opt;
         int     fd;
         int     i;
+        unsigned long n;
         char    *mem;
+        struct outbuf *b;
+
+        while ((opt = getopt(argc, argv, "C:D:I:S:X:r")) != -1) switch (opt) {
+                case 'S':
+                        skipfile = optarg;
+                        break;
+                case 'X':
+                        indexfile = optarg;
+                        break;
+                case 'C':
+                        storedir = optarg;
+                        break;
+                case 'D':
+                        dumpfile = optarg;
+                        break;
+                case 'r':
+                        rflag++;
+                        break;
+                case 'I':
+                        dbfile = optarg;
+                        break;
+        }
+        if (storedir && dumpfile) {
+                fprintf(stderr, "pcireadrom: -C and -D are alternatives, give one\n");
+                exit(1);
+        }
+
+        skipmap_init(&skip, getpagesize());
+        if (skipfile)
+                skipmap_load(&skip, skipfile);
+        if (memfault_install() < 0)
+                exit(1);
+
+        if (indexfile) {
+                if (pageindex_open(&pidx, indexfile) < 0)
+                        exit(1);
+                for (n = 0; n < pidx.npages; n++)
+                        if (pidx.class[n] & PAGE_BAD)
+                                skipmap_add(&skip, pidx.base + n * pidx.pagesize);
+                skip.dirty = 0;
+        }
+
+        if (storedir && romstore_open(&store, storedir, "pcireadrom") < 0)
+                exit(1);
+        if (dbfile && romdb_open(&db, dbfile) < 0)
+                exit(1);
 
         if ((fd = open("/dev/mem", O_RDWR)) < 0) {
                 perror("open(2)");
@@ -50,7 +305,7 @@ int main(int argc, char **argv)
          */
         if ((mem =
                 mmap(NULL,
-                0xF0010,
+                MAP_LENGTH,
                 PROT_READ|PROT_WRITE,
                 MAP_SHARED,
                 fd, (off_t)0L)) == NULL) {
@@ -58,6 +313,59 @@ int main(int argc, char **argv)
                 exit(1);
         }
 
+        if (outpipe_start(&out, LENGTH) < 0)
+                exit(1);
+
+        /*
+         * Only what parses as an image, once each.
+         */
+        if (rflag || storedir) {
+                struct dumpw    w;
+                int             nimg, perarea[2] = { 0, 0 };
+
+                if (dumpfile && dumpw_open(&w, dumpfile, "pcireadrom", &out) < 0)
+                        exit(1);
+                if ((nimg = dump_images(mem, dumpfile ? &w : NULL, perarea)) < 0 ||
+                    (dumpfile && dumpw_close(&w) < 0) || outpipe_finish(&out, 1) < 0)
+                        exit(1);
+                fprintf(stderr, "%d image%s saved.\n", nimg, nimg == 1 ? "" : "s");
+
+                /*
+                 * -C without -r: the raw bytes of an area no image was found in.
+                 */
+                if (storedir && !rflag &&
+                    ((!perarea[0] && store_area(mem, VGA_ROM_START, NON_VGA_ROM_START, "vga") < 0) ||
+                     (!perarea[1] && store_area(mem, NON_VGA_ROM_START, AREA_END, "expansion") < 0)))
+                        exit(1);
+                if (storedir) {
+                        fprintf(stderr, "Store %s: %lu new objects (%lu bytes), %lu already there.\n",
+                                        storedir, store.stored, store.bytes, store.deduped);
+                        if (romstore_close(&store) < 0)
+                                exit(1);
+                }
+                if (skipfile)
+                        skipmap_save(&skip, skipfile);
+                close(fd);
+                exit(0);
+        }
+
+        /*
+         * A container holds each area once; the 64KB windows overlap it 32 deep.
+         */
+        if (dumpfile) {
+                struct dumpw    w;
+
+                if (dumpw_open(&w, dumpfile, "pcireadrom", &out) < 0 ||
+                    dump_area(&w, mem, VGA_ROM_START, NON_VGA_ROM_START, "vga") < 0 ||
+                    dump_area(&w, mem, NON_VGA_ROM_START, AREA_END, "expansion") < 0 ||
+                    dumpw_close(&w) < 0 || outpipe_finish(&out, 1) < 0)
+                        exit(1);
+                if (skipfile)
+                        skipmap_save(&skip, skipfile);
+                close(fd);
+                exit(0);
+        }
+
         /*
          * Iterate and dump each 2KB region to a .ROM file
          */
@@ -78,16 +386,12 @@ int main(int argc, char **argv)
                 }
 
                 /*
-                 * Write 64KB.
+                 * Queue 64KB; the writer closes the file.
                  */
-                if (write(romfd, mem + i, LENGTH) < 0) {
-                        perror("write(2)");
-                        close(romfd);
-                        continue;
-                }
-
-                fsync(romfd);
-                close(romfd);
+                b = outpipe_get(&out);
+                copy_guarded(b->data, mem, i, LENGTH);
+                b->len = LENGTH;
+                outpipe_put(&out, romfd, 0, 1);
         }
 
         /*
@@ -109,19 +413,21 @@ int main(int argc, char **argv)
                 }
 
                 /*
-                 * Write 64KB.
+                 * Queue 64KB; the writer closes the file.
                  */
-                if (write(romfd, mem + i, LENGTH) < 0) {
-                        perror("write(2)");
-                        close(romfd);
-                        continue;
-                }
-
-                fsync(romfd);
-                close(romfd);
+                b = outpipe_get(&out);
+                copy_guarded(b->data, mem, i, LENGTH);
+                b->len = LENGTH;
+                outpipe_put(&out, romfd, 0, 1);
         }
 
 
+        if (outpipe_finish(&out, 1) < 0)
+                exit(1);
+
+        if (skipfile)
+                skipmap_save(&skip, skipfile);
+
         close(fd);
         exit(0);
 }
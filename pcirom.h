@@ -0,0 +1,323 @@
+/*
+ * pcirom.h - Find and validate PCI expansion ROM headers in a buffer.
+ *
+ * Option ROM images start on 512-byte boundaries (the first image of a
+ * ROM on 2KB), so only aligned candidates are looked at.  A candidate is
+ * kept only if the whole header holds up:
+ *
+ *	55 aa signature
+ *	pointer at +0x18 is DWORD aligned, past the ROM header and readable
+ *	'PCIR' at that pointer
+ *	PDS length >= 0x18, PDS revision <= 3
+ *	image length (512-byte units) non-zero and covering the whole PDS
+ *	x86 (code type 0) images sum to zero mod 256
+ *
+ * The signature test rejects nearly every candidate with one 16-bit load;
+ * the survivors have their fixed fields checked together without
+ * branching, and only then is the image summed (AVX2 32 bytes a step when
+ * the CPU has it, else SSE2 16).  pcirom_parse() is the same check without
+ * the checksum verdict, for tools that want to report a bad sum.
+ *
+ * A ROM is a chain of images, each one starting right where the last one
+ * ended, until one has the last-image bit (0x80) in its PDS indicator.
+ * pcirom_walk() follows the chain; each image's code type says what it
+ * holds (x86 BIOS code, Open Firmware, EFI driver...).  EFI images carry
+ * their own header fields after the signature:
+ *
+ *	+0x02	initialization size (512-byte units)
+ *	+0x04	0x00000ef1
+ *	+0x08	EFI subsystem
+ *	+0x0a	machine type
+ *	+0x0c	compression type (0 none, 1 EFI compressed)
+ *	+0x16	offset of the PE/COFF image
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef PCIROM_H
+#define PCIROM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define PCIROM_ALIGN		2048	/* first image of a ROM */
+#define PCIROM_IMAGE_ALIGN	512	/* later images in a chain */
+#define PCIROM_PDS_PTR		0x18
+#define PCIROM_PDS_MIN		0x18	/* PDS fields we read */
+#define PCIROM_MAX_IMAGES	16
+
+#define PCIROM_CODE_X86		0x00
+#define PCIROM_CODE_OPENFW	0x01
+#define PCIROM_CODE_HPPA	0x02
+#define PCIROM_CODE_EFI		0x03
+#define PCIROM_LAST_IMAGE	0x80
+#define PCIROM_EFI_SIGNATURE	0x0ef1
+
+/*
+ * What one valid header says.  sum is the image's byte sum mod 256, or
+ * -1 if the image runs past the readable bytes.
+ */
+struct pcirom {
+	unsigned	pds;		/* offset of 'PCIR' */
+	unsigned	pdslen;
+	unsigned	revision;
+	unsigned	vendor;
+	unsigned	device;
+	unsigned	classcode;
+	unsigned long	length;		/* bytes */
+	unsigned	coderev;	/* vendor's code revision level */
+	unsigned	codetype;
+	unsigned	indicator;
+	int		sum;
+	unsigned long	offset;		/* from the first image */
+	/* code type 3 only, efisig says whether the rest is real */
+	int		efisig;
+	unsigned	efiinit;	/* bytes */
+	unsigned	efisubsystem;
+	unsigned	efimachine;
+	unsigned	eficompression;
+	unsigned	efipe;
+};
+
+struct pcirom_name {
+	unsigned	code;
+	const char	*name;
+};
+
+static const struct pcirom_name pcirom_codetypes[] = {
+	{ PCIROM_CODE_X86,	"x86" },
+	{ PCIROM_CODE_OPENFW,	"openfirmware" },
+	{ PCIROM_CODE_HPPA,	"hppa" },
+	{ PCIROM_CODE_EFI,	"efi" },
+};
+
+static const struct pcirom_name pcirom_efisubsystems[] = {
+	{ 10,	"application" },
+	{ 11,	"boot-driver" },
+	{ 12,	"runtime-driver" },
+	{ 13,	"rom" },
+}, pcirom_efimachines[] = {
+	{ 0x014c,	"ia32" },
+	{ 0x0200,	"ia64" },
+	{ 0x0ebc,	"ebc" },
+	{ 0x8664,	"x64" },
+	{ 0x01c2,	"arm" },
+	{ 0xaa64,	"aarch64" },
+	{ 0x5032,	"riscv32" },
+	{ 0x5064,	"riscv64" },
+	{ 0x6264,	"loongarch64" },
+};
+
+#define PCIROM_NAME(table, v)	pcirom_name((table), sizeof(table) / sizeof((table)[0]), (v))
+
+static inline const char *pcirom_name(const struct pcirom_name *t, size_t n, unsigned code)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		if (t[i].code == code)
+			return t[i].name;
+	return "unknown";
+}
+
+static inline uint16_t pcirom_le16(const unsigned char *p)
+{
+	uint16_t	v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t pcirom_le32(const unsigned char *p)
+{
+	uint32_t	v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Byte sum of len bytes, len a multiple of 32.
+ */
+__attribute__((target("avx2")))
+static inline unsigned long pcirom_sum_avx2(const unsigned char *p, size_t len)
+{
+	__m256i		acc = _mm256_setzero_si256(), zero = _mm256_setzero_si256();
+	__m128i		s;
+	size_t		i;
+
+	for (i = 0; i < len; i += 32)
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(p + i)), zero));
+	s = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	return (unsigned long)_mm_cvtsi128_si64(s) + (unsigned long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));
+}
+#endif
+
+/*
+ * Byte sum of len bytes.
+ */
+static inline unsigned long pcirom_sum(const unsigned char *p, size_t len)
+{
+	unsigned long	sum = 0;
+	size_t		i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	static int	avx2 = -1;
+
+	if (avx2 < 0) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2");
+	}
+	if (avx2 && len >= 32) {
+		i = len & ~(size_t)31;
+		sum = pcirom_sum_avx2(p, i);
+	}
+#endif
+#ifdef __SSE2__
+	__m128i		acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(p + i)), zero));
+	sum += (unsigned long)_mm_cvtsi128_si64(acc) +
+	       (unsigned long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+	for (; i < len; i++)
+		sum += p[i];
+	return sum;
+}
+
+/*
+ * Parse the header at p, with avail bytes readable from p.  Fills rom and
+ * returns 1 if the header is sane, whatever the image sums to.
+ */
+static inline int pcirom_parse(const unsigned char *p, size_t avail, struct pcirom *rom)
+{
+	const unsigned char	*pds;
+	unsigned		ptr;
+	int			ok;
+
+	if (avail < PCIROM_PDS_PTR + 2 || pcirom_le16(p) != 0xaa55)
+		return 0;
+
+	ptr = pcirom_le16(p + PCIROM_PDS_PTR);
+	if ((ptr & 3) != 0 || ptr < PCIROM_PDS_PTR + 2 || ptr + PCIROM_PDS_MIN > avail)
+		return 0;
+	pds = p + ptr;
+
+	rom->pds = ptr;
+	rom->vendor = pcirom_le16(pds + 0x04);
+	rom->device = pcirom_le16(pds + 0x06);
+	rom->pdslen = pcirom_le16(pds + 0x0a);
+	rom->revision = pds[0x0c];
+	rom->classcode = pds[0x0d] | pds[0x0e] << 8 | pds[0x0f] << 16;
+	rom->length = (unsigned long)pcirom_le16(pds + 0x10) * 512;
+	rom->coderev = pcirom_le16(pds + 0x12);
+	rom->codetype = pds[0x14];
+	rom->indicator = pds[0x15];
+
+	ok = (pcirom_le32(pds) == 0x52494350);		/* "PCIR" */
+	ok &= (rom->pdslen >= PCIROM_PDS_MIN);
+	ok &= (rom->revision <= 3);
+	ok &= (rom->length != 0);
+	ok &= (ptr + rom->pdslen <= rom->length);
+	if (!ok)
+		return 0;
+
+	rom->sum = -1;
+	if (rom->length <= avail)
+		rom->sum = pcirom_sum(p, rom->length) & 0xff;
+
+	rom->offset = 0;
+	rom->efisig = 0;
+	if (rom->codetype == PCIROM_CODE_EFI) {
+		rom->efisig = (pcirom_le32(p + 0x04) == PCIROM_EFI_SIGNATURE);
+		rom->efiinit = pcirom_le16(p + 0x02) * 512;
+		rom->efisubsystem = pcirom_le16(p + 0x08);
+		rom->efimachine = pcirom_le16(p + 0x0a);
+		rom->eficompression = pcirom_le16(p + 0x0c);
+		rom->efipe = pcirom_le16(p + 0x16);
+	}
+	return 1;
+}
+
+/*
+ * Validate the header at p: sane, and an x86 image must sum to zero.
+ * Fills rom and returns 1 if it is a ROM image.
+ */
+static inline int pcirom_check(const unsigned char *p, size_t avail, struct pcirom *rom)
+{
+	return pcirom_parse(p, avail, rom) && !(rom->codetype == PCIROM_CODE_X86 && rom->sum > 0);
+}
+
+/*
+ * Follow the image chain from the header at p.  Stops at the last-image
+ * bit, at an image that does not validate, at the end of the readable
+ * bytes or after max images.  Returns the number of images, 0 if p is not
+ * a ROM at all.
+ */
+static inline int pcirom_walk(const unsigned char *p, size_t avail, struct pcirom *img, int max)
+{
+	unsigned long	off = 0;
+	int		n;
+
+	for (n = 0; n < max && off < avail; n++) {
+		if (!pcirom_check(p + off, avail - off, &img[n]))
+			break;
+		img[n].offset = off;
+		off += img[n].length;
+		if (img[n].indicator & PCIROM_LAST_IMAGE) {
+			n++;
+			break;
+		}
+	}
+	return n;
+}
+
+/*
+ * One catalog line for image i of a chain.
+ */
+static inline void pcirom_catalog(FILE *fp, const struct pcirom *img, int i)
+{
+	fprintf(fp, "image %d offset %#lx length %#lx code %s (%#x) vendor %04x device %04x "
+		"class %06x pds-revision %u last %s checksum %s",
+		i, img->offset, img->length, PCIROM_NAME(pcirom_codetypes, img->codetype),
+		img->codetype, img->vendor, img->device, img->classcode, img->revision,
+		(img->indicator & PCIROM_LAST_IMAGE) ? "yes" : "no",
+		img->sum < 0 ? "unknown" : img->sum == 0 ? "ok" : "not-zero");
+	if (img->codetype == PCIROM_CODE_EFI) {
+		if (img->efisig)
+			fprintf(fp, " efi-subsystem %s (%u) machine %s (%#x) compression %s pe-offset %#x init-size %#x",
+				PCIROM_NAME(pcirom_efisubsystems, img->efisubsystem), img->efisubsystem,
+				PCIROM_NAME(pcirom_efimachines, img->efimachine), img->efimachine,
+				img->eficompression == 0 ? "none" :
+				img->eficompression == 1 ? "efi" : "unknown",
+				img->efipe, img->efiinit);
+		else
+			fprintf(fp, " efi-signature missing");
+	}
+	fprintf(fp, "\n");
+}
+
+/*
+ * First valid ROM header at an align-aligned address in [p, stop), where
+ * p is at address addr and bytes up to availend may be read.
+ */
+static inline const unsigned char *pcirom_find(const unsigned char *p, const unsigned char *stop,
+					const unsigned char *availend, unsigned long addr,
+					unsigned long align, struct pcirom *rom)
+{
+	const unsigned char	*q;
+
+	for (q = p + ((align - (addr & (align - 1))) & (align - 1)); q + 2 <= stop; q += align)
+		if (q[0] == 0x55 && q[1] == 0xaa && pcirom_check(q, availend - q, rom))
+			return q;
+	return NULL;
+}
+
+#endif /* PCIROM_H */
@@ -0,0 +1,371 @@
+/*
+ * pcisysfs.h - Enumerate PCI functions from sysfs, once per boot.
+ *
+ * /sys/bus/pci/devices is read once: for every function its config space
+ * (4096 bytes as root, 64 otherwise), class, resource table and driver.
+ * Each function directory is opened once and its files are read with
+ * openat(2)/pread(2) relative to it, and a topology of hundreds of
+ * functions is split over a pool of threads.
+ *
+ * The result is saved as a cache file of fixed-size records: a header with
+ * the boot ID (/proc/sys/kernel/random/boot_id) and a key hashing the
+ * sorted function names, the directory enumerated and the effective uid,
+ * then one struct pcifn per function.  A later run reads the directory
+ * (cheap), and if the boot and the key still match it mmap(2)s the cache
+ * and is done: no config space is read at all.  A reboot, a hotplug or
+ * SR-IOV VFs coming or going changes the key and the cache is rebuilt.
+ * The uid is in the key because root reads all 4096 bytes of config and
+ * other users 64; the file is created 0600 so it does not hand root's
+ * reads to anyone else, and a user who cannot write it goes without.
+ * Config space changing under a function is not noticed; -r rebuilds,
+ * and pcienum -w / pcimmio -w watch for that.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef PCISYSFS_H
+#define PCISYSFS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SYSFS_PCI_DEVICES	"/sys/bus/pci/devices"
+#define BOOT_ID_PATH		"/proc/sys/kernel/random/boot_id"
+#define PCIENUM_CACHE		"/run/pcienum.cache"
+#define PCIENUM_MAGIC		"PCIENUM2"
+#define PCIENUM_MAXRES		7	/* BARs 0-5 and the ROM */
+#define PCIENUM_MAXJOBS		64
+
+struct pcifn {
+	char		name[16];	/* 0000:00:1f.3 */
+	char		driver[32];
+	uint16_t	vendor;
+	uint16_t	device;
+	uint32_t	class;
+	uint32_t	cfglen;		/* bytes of config read */
+	uint32_t	nres;
+	uint64_t	res[PCIENUM_MAXRES][3];	/* start, end, flags */
+	unsigned char	config[4096];
+};
+
+struct pcienum_hdr {
+	char		magic[8];
+	char		bootid[40];
+	uint64_t	key;
+	uint64_t	created;
+	uint32_t	n;
+	uint32_t	reclen;		/* sizeof(struct pcifn) */
+};
+
+struct pcienum {
+	const char	*dir;
+	int		dirfd;
+	char		(*names)[16];
+	size_t		n;
+	uint64_t	key;		/* names, dir and euid */
+	char		bootid[40];
+	struct pcifn	*fn;
+	void		*map;		/* the cache, when it was used */
+	size_t		maplen;
+	int		cached;
+	size_t		nexttake;	/* thread pool */
+	int		errors;
+};
+
+static inline int pcienum_name_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+static inline uint64_t pcienum_fnv(uint64_t h, const void *p, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ ((const unsigned char *)p)[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/*
+ * The sorted names of the functions in e->dir, and the cache key: an
+ * FNV-1a hash of them, the real path of the directory and the euid.
+ */
+static inline int pcienum_list(struct pcienum *e)
+{
+	struct dirent	*de;
+	size_t		cap = 0;
+	char		(*v)[16], *real;
+	uid_t		euid = geteuid();
+	DIR		*d;
+	int		fd;
+
+	if ((e->dirfd = open(e->dir, O_RDONLY | O_DIRECTORY)) < 0 || (fd = dup(e->dirfd)) < 0) {
+		fprintf(stderr, "%s: %s\n", e->dir, strerror(errno));
+		return -1;
+	}
+	if ((d = fdopendir(fd)) == NULL) {
+		fprintf(stderr, "%s: %s\n", e->dir, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(e->names[0]))
+			continue;
+		if (e->n == cap) {
+			cap = cap ? cap * 2 : 256;
+			if ((v = realloc(e->names, cap * sizeof(*v))) == NULL) {
+				perror("realloc(3)");
+				closedir(d);
+				return -1;
+			}
+			e->names = v;
+		}
+		strcpy(e->names[e->n++], de->d_name);
+	}
+	closedir(d);
+	qsort(e->names, e->n, sizeof(e->names[0]), pcienum_name_cmp);
+
+	e->key = pcienum_fnv(0xcbf29ce484222325ULL, e->names, e->n * sizeof(e->names[0]));
+	real = realpath(e->dir, NULL);
+	e->key = pcienum_fnv(e->key, real ? real : e->dir, strlen(real ? real : e->dir) + 1);
+	free(real);
+	e->key = pcienum_fnv(e->key, &euid, sizeof(euid));
+	return 0;
+}
+
+static inline void pcienum_bootid(char bootid[40])
+{
+	ssize_t	k = -1;
+	int	fd;
+
+	memset(bootid, 0, 40);
+	if ((fd = open(BOOT_ID_PATH, O_RDONLY)) >= 0) {
+		k = read(fd, bootid, 39);
+		close(fd);
+	}
+	if (k <= 0)
+		strcpy(bootid, "unknown");
+	bootid[strcspn(bootid, "\n")] = '\0';
+}
+
+static inline ssize_t pcienum_readat(int dirfd, const char *file, void *buf, size_t len)
+{
+	ssize_t	k;
+	int	fd;
+
+	if ((fd = openat(dirfd, file, O_RDONLY)) < 0)
+		return -1;
+	k = pread(fd, buf, len, 0);
+	close(fd);
+	return k;
+}
+
+/*
+ * Everything about one function, from its directory under dirfd.
+ */
+static inline int pcienum_read(int dirfd, const char *name, struct pcifn *f)
+{
+	char		buf[4096], *p, *q;
+	ssize_t		k;
+	int		fd;
+
+	memset(f, 0, sizeof(*f));
+	strcpy(f->name, name);
+	if ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+	if ((k = pcienum_readat(fd, "config", f->config, sizeof(f->config))) < 0) {
+		close(fd);
+		return -1;
+	}
+	f->cfglen = k;
+	if (k >= 4) {
+		f->vendor = f->config[0] | f->config[1] << 8;
+		f->device = f->config[2] | f->config[3] << 8;
+	}
+	if ((k = pcienum_readat(fd, "class", buf, sizeof(buf) - 1)) > 0) {
+		buf[k] = '\0';
+		f->class = strtoul(buf, NULL, 16);
+	}
+	if ((k = pcienum_readat(fd, "resource", buf, sizeof(buf) - 1)) > 0) {
+		buf[k] = '\0';
+		for (p = buf; f->nres < PCIENUM_MAXRES && (q = strchr(p, '\n')) != NULL; p = q + 1) {
+			*q = '\0';
+			if (sscanf(p, "%" SCNx64 " %" SCNx64 " %" SCNx64, &f->res[f->nres][0], &f->res[f->nres][1],
+				   &f->res[f->nres][2]) != 3)
+				break;
+			f->nres++;
+		}
+	}
+	if ((k = readlinkat(fd, "driver", buf, sizeof(buf) - 1)) > 0) {
+		buf[k] = '\0';
+		p = strrchr(buf, '/');
+		snprintf(f->driver, sizeof(f->driver), "%.31s", p ? p + 1 : buf);
+	}
+	close(fd);
+	return 0;
+}
+
+static inline void *pcienum_worker(void *arg)
+{
+	struct pcienum	*e = arg;
+	size_t		k;
+
+	while ((k = __sync_fetch_and_add(&e->nexttake, 1)) < e->n)
+		if (pcienum_read(e->dirfd, e->names[k], &e->fn[k]) < 0) {
+			fprintf(stderr, "%s/%s: %s\n", e->dir, e->names[k], strerror(errno));
+			__sync_fetch_and_add(&e->errors, 1);
+		}
+	return NULL;
+}
+
+/*
+ * Read every function on jobs threads (fewer for small topologies).
+ */
+static inline int pcienum_scan(struct pcienum *e, int jobs)
+{
+	pthread_t	tid[PCIENUM_MAXJOBS];
+	int		i;
+
+	if ((e->fn = calloc(e->n ? e->n : 1, sizeof(*e->fn))) == NULL) {
+		perror("calloc(3)");
+		return -1;
+	}
+	if (jobs > PCIENUM_MAXJOBS)
+		jobs = PCIENUM_MAXJOBS;
+	if ((size_t)jobs > e->n / 32 + 1)
+		jobs = e->n / 32 + 1;
+	e->nexttake = 0;
+	for (i = 1; i < jobs; i++)
+		if ((errno = pthread_create(&tid[i], NULL, pcienum_worker, e)) != 0) {
+			perror("pthread_create(3)");
+			jobs = i;
+			break;
+		}
+	pcienum_worker(e);
+	for (i = 1; i < jobs; i++)
+		pthread_join(tid[i], NULL);
+	return 0;
+}
+
+/*
+ * Use the cache at path if it is this boot's and lists the same functions.
+ */
+static inline int pcienum_load(struct pcienum *e, const char *path)
+{
+	const struct pcienum_hdr *h;
+	struct stat		sb;
+	int			fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(*h) ||
+	    (e->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		e->map = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	e->maplen = sb.st_size;
+	h = e->map;
+	if (memcmp(h->magic, PCIENUM_MAGIC, 8) != 0 || h->reclen != sizeof(struct pcifn) ||
+	    strncmp(h->bootid, e->bootid, sizeof(h->bootid)) != 0 || h->key != e->key ||
+	    h->n != e->n || e->maplen < sizeof(*h) + (size_t)h->n * sizeof(struct pcifn)) {
+		munmap(e->map, e->maplen);
+		e->map = NULL;
+		return -1;
+	}
+	e->fn = (struct pcifn *)((char *)e->map + sizeof(*h));
+	e->cached = 1;
+	return 0;
+}
+
+/*
+ * Write the cache to a temporary name and rename it over path, so a
+ * reader never maps half of one.  Where the user may not write, quietly
+ * don't.
+ */
+static inline int pcienum_save(struct pcienum *e, const char *path)
+{
+	struct pcienum_hdr	h;
+	char			tmp[1100];
+	FILE			*fp;
+	int			fd;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PCIENUM_MAGIC, 8);
+	memcpy(h.bootid, e->bootid, sizeof(h.bootid));
+	h.key = e->key;
+	h.created = time(NULL);
+	h.n = e->n;
+	h.reclen = sizeof(struct pcifn);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+		if (errno != EACCES && errno != EPERM && errno != EROFS)
+			fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (fwrite(&h, sizeof(h), 1, fp) != 1 || (e->n && fwrite(e->fn, sizeof(*e->fn), e->n, fp) != e->n) ||
+	    fclose(fp) != 0) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path) < 0) {
+		perror("rename(2)");
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Enumerate dir: from the cache at path (NULL for none) when it is still
+ * good and refresh is 0, else from sysfs on jobs threads, saving the cache.
+ */
+static inline int pcienum_open(struct pcienum *e, const char *dir, const char *path, int jobs, int refresh)
+{
+	memset(e, 0, sizeof(*e));
+	e->dir = dir;
+	pcienum_bootid(e->bootid);
+	if (pcienum_list(e) < 0)
+		return -1;
+	if (path && !refresh && pcienum_load(e, path) == 0)
+		return 0;
+	if (pcienum_scan(e, jobs) < 0)
+		return -1;
+	if (path && !e->errors)
+		pcienum_save(e, path);
+	return 0;
+}
+
+static inline void pcienum_close(struct pcienum *e)
+{
+	if (e->map)
+		munmap(e->map, e->maplen);
+	else
+		free(e->fn);
+	free(e->names);
+	if (e->dirfd >= 0)
+		close(e->dirfd);
+	memset(e, 0, sizeof(*e));
+	e->dirfd = -1;
+}
+
+#endif /* PCISYSFS_H */
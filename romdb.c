@@ -0,0 +1,318 @@
+/*
+ * romdb(1) - Build and query the option ROM fingerprint database (romdb.h).
+ *
+ * - romdb -o db spec ...: build db from spec files ("-" is stdin), one
+ *   entry per line, '#' comments:
+ *	image <romstore id> <name>			32 hex digits, as in a
+ *							romstore index
+ *	pcir <vendor> <device> <class> <type> <rev|*> <name>	hex fields
+ *	file <path> <name>				a ROM file: its image,
+ *							and its PCIR fields
+ *   Names run to the end of the line.  Where entries repeat, the first
+ *   one wins.
+ * - romdb -d db rom ...: identify ROM files, one "<path> <how> <name>"
+ *   line each (how is image, pcir, pcir-anyrev or - for unknown).
+ * - pcifindrom -I db and pcireadrom -I db tag every ROM they find.
+ *
+ * Usage: romdb -o roms.db fleet.spec && romdb -d roms.db *.rom
+ *
+ * Build: cc -O2 -o romdb romdb.c
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "romdb.h"
+
+#define BUCKETBITS_MAX	24
+
+struct bentry {
+	struct romdb_entry	e;
+	unsigned long		seq;	/* input order, for "first one wins" */
+};
+
+struct bentry	*ents;
+unsigned long	nents, entcap;
+char		*pool;
+size_t		poollen, poolcap;
+
+static void *map_file(const char *path, size_t *len)
+{
+	struct stat	sb;
+	void		*p;
+	int		fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "romdb: %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	*len = sb.st_size;
+	p = *len ? mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "romdb: %s: mmap(2): %s\n", path, strerror(errno));
+		return NULL;
+	}
+	return *len ? p : (void *)"";
+}
+
+static void add(uint32_t kind, uint64_t key, uint64_t check, const char *name)
+{
+	struct bentry	*v;
+	size_t		n = strlen(name) + 1;
+	char		*q;
+
+	if (nents == entcap) {
+		entcap = entcap ? entcap * 2 : 4096;
+		if ((v = realloc(ents, entcap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		ents = v;
+	}
+	if (poollen + n > poolcap) {
+		poolcap = (poollen + n) * 2;
+		if ((q = realloc(pool, poolcap)) == NULL) {
+			perror("realloc(3)");
+			exit(1);
+		}
+		pool = q;
+	}
+	if (poollen > UINT32_MAX - n) {
+		fprintf(stderr, "romdb: names past 4GB\n");
+		exit(1);
+	}
+
+	ents[nents].e.key = key;
+	ents[nents].e.check = check;
+	ents[nents].e.kind = kind;
+	ents[nents].e.name = poollen;
+	ents[nents].seq = nents;
+	nents++;
+	memcpy(pool + poollen, name, n);
+	poollen += n;
+}
+
+/*
+ * One spec line.  Returns -1 if it does not parse.
+ */
+static int spec_line(char *line)
+{
+	unsigned	vendor, device, classcode, type, rev;
+	char		kind[16], arg[4096], revs[16];
+	struct pcirom	rom;
+	uint64_t	key, check;
+	size_t		len;
+	void		*p;
+	int		n;
+
+	line[strcspn(line, "\n")] = '\0';
+	if (line[strspn(line, " \t")] == '#' || line[strspn(line, " \t")] == '\0')
+		return 0;
+	if (sscanf(line, "%15s%n", kind, &n) != 1)
+		return -1;
+	line += n;
+
+	if (strcmp(kind, "image") == 0) {
+		char	hi[17], lo[17];
+
+		if (sscanf(line, " %16[0-9a-fA-F]%16[0-9a-fA-F] %n", hi, lo, &n) != 2 ||
+		    strlen(hi) != 16 || strlen(lo) != 16 || line[n] == '\0')
+			return -1;
+		add(ROMDB_IMAGE, strtoull(hi, NULL, 16), strtoull(lo, NULL, 16), line + n);
+	} else if (strcmp(kind, "pcir") == 0) {
+		if (sscanf(line, " %x %x %x %x %15s %n", &vendor, &device, &classcode, &type, revs, &n) != 5 ||
+		    line[n] == '\0')
+			return -1;
+		rev = strcmp(revs, "*") == 0 ? ROMDB_ANYREV : strtoul(revs, NULL, 16);
+		romdb_pcir_key(vendor, device, classcode, type, rev, &key, &check);
+		add(ROMDB_PCIR, key, check, line + n);
+	} else if (strcmp(kind, "file") == 0) {
+		if (sscanf(line, " %4095s %n", arg, &n) != 1 || line[n] == '\0')
+			return -1;
+		if ((p = map_file(arg, &len)) == NULL)
+			return -1;
+		romdb_image_key(p, len, &key, &check);
+		add(ROMDB_IMAGE, key, check, line + n);
+		if (pcirom_parse(p, len, &rom)) {
+			romdb_pcir_key(rom.vendor, rom.device, rom.classcode, rom.codetype, rom.coderev,
+				       &key, &check);
+			add(ROMDB_PCIR, key, check, line + n);
+		}
+		if (len)
+			munmap(p, len);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static int bentry_cmp(const void *a, const void *b)
+{
+	const struct bentry	*x = a, *y = b;
+
+	if (x->e.key != y->e.key)
+		return x->e.key < y->e.key ? -1 : 1;
+	if (x->e.kind != y->e.kind)
+		return x->e.kind < y->e.kind ? -1 : 1;
+	if (x->e.check != y->e.check)
+		return x->e.check < y->e.check ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void write_all(FILE *fp, const void *p, size_t len)
+{
+	if (len && fwrite(p, len, 1, fp) != 1) {
+		perror("fwrite(3)");
+		exit(1);
+	}
+}
+
+static void build(const char *out)
+{
+	struct romdb_hdr	h;
+	uint32_t		*bucket;
+	unsigned long		i, j, b, nb;
+	size_t			n, len;
+	char			*newpool;
+	FILE			*fp;
+
+	/* sort, then keep the first of each run of equal entries */
+	qsort(ents, nents, sizeof(*ents), bentry_cmp);
+	for (i = j = 0; i < nents; i++)
+		if (j == 0 || ents[i].e.key != ents[j - 1].e.key || ents[i].e.kind != ents[j - 1].e.kind ||
+		    ents[i].e.check != ents[j - 1].e.check)
+			ents[j++] = ents[i];
+	nents = j;
+
+	/* names of the entries dropped go too */
+	if ((newpool = malloc(poollen ? poollen : 1)) == NULL) {
+		perror("malloc(3)");
+		exit(1);
+	}
+	for (i = 0, n = 0; i < nents; i++) {
+		len = strlen(pool + ents[i].e.name) + 1;
+		memcpy(newpool + n, pool + ents[i].e.name, len);
+		ents[i].e.name = n;
+		n += len;
+	}
+	free(pool);
+	pool = newpool;
+	poollen = n;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, ROMDB_MAGIC, 8);
+	while (h.bucketbits < BUCKETBITS_MAX && (1UL << h.bucketbits) < nents)
+		h.bucketbits++;
+	nb = (1UL << h.bucketbits) + 1;
+	h.nentries = nents;
+	h.entries = (sizeof(h) + nb * sizeof(uint32_t) + 7) & ~7UL;
+	h.strings = h.entries + nents * sizeof(struct romdb_entry);
+	h.stringslen = poollen;
+
+	if ((bucket = calloc(nb, sizeof(*bucket))) == NULL) {
+		perror("calloc(3)");
+		exit(1);
+	}
+	for (i = 0, b = 0; b < nb; b++) {
+		while (i < nents && (h.bucketbits ? ents[i].e.key >> (64 - h.bucketbits) : 0) < b)
+			i++;
+		bucket[b] = i;
+	}
+
+	if ((fp = fopen(out, "w")) == NULL) {
+		perror("fopen(3)");
+		exit(1);
+	}
+	write_all(fp, &h, sizeof(h));
+	write_all(fp, bucket, nb * sizeof(*bucket));
+	write_all(fp, "\0\0\0\0\0\0\0", h.entries - sizeof(h) - nb * sizeof(*bucket));
+	for (i = 0; i < nents; i++)
+		write_all(fp, &ents[i].e, sizeof(ents[i].e));
+	write_all(fp, pool, poollen);
+	if (fclose(fp) != 0) {
+		perror("fclose(3)");
+		exit(1);
+	}
+	free(bucket);
+	fprintf(stderr, "romdb: %lu entries in %lu buckets, %zu bytes of names, written to %s\n",
+		nents, nb - 1, poollen, out);
+}
+
+static int identify(const struct romdb *db, const char *path)
+{
+	struct pcirom	rom;
+	const char	*name, *how = "-";
+	size_t		len;
+	void		*p;
+
+	if ((p = map_file(path, &len)) == NULL)
+		return -1;
+	name = romdb_identify(db, p, len, pcirom_parse(p, len, &rom) ? &rom : NULL, &how);
+	printf("%s %s %s\n", path, name ? how : "-", name ? name : "unknown");
+	if (len)
+		munmap(p, len);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct romdb	db;
+	char		line[8192];
+	char		*out = NULL, *dbfile = NULL;
+	unsigned long	lineno;
+	FILE		*fp;
+	int		opt, i, errors = 0;
+
+	while ((opt = getopt(argc, argv, "o:d:")) != -1) switch (opt) {
+		case 'o':
+			out = optarg;
+			break;
+		case 'd':
+			dbfile = optarg;
+			break;
+		default:
+			break;
+	}
+	if (!out == !dbfile || optind == argc) {
+		fprintf(stderr, "Usage: romdb -o db spec ...\n");
+		fprintf(stderr, "       romdb -d db rom ...\n");
+		exit(1);
+	}
+
+	if (dbfile) {
+		if (romdb_open(&db, dbfile) < 0)
+			exit(1);
+		for (i = optind; i < argc; i++)
+			if (identify(&db, argv[i]) < 0)
+				errors++;
+		exit(errors ? 1 : 0);
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (strcmp(argv[i], "-") == 0) {
+			fp = stdin;
+		} else if ((fp = fopen(argv[i], "r")) == NULL) {
+			fprintf(stderr, "romdb: %s: %s\n", argv[i], strerror(errno));
+			exit(1);
+		}
+		for (lineno = 1; fgets(line, sizeof(line), fp) != NULL; lineno++)
+			if (spec_line(line) < 0) {
+				fprintf(stderr, "romdb: %s:%lu: bad line\n", argv[i], lineno);
+				errors++;
+			}
+		if (fp != stdin)
+			fclose(fp);
+	}
+	if (errors)
+		exit(1);
+	build(out);
+	exit(0);
+}
@@ -0,0 +1,192 @@
+/*
+ * romdb.h - Fingerprint database of known option ROMs.
+ *
+ * Two kinds of entry map a key to a name ("Intel UHD 630 VBIOS 1040"):
+ *
+ *	image	the whole ROM, by the XXH64 of its bytes (seed 0, the first
+ *		half of its romstore.h id; the second half must match too)
+ *	pcir	PCI data structure fields: vendor, device, class code, code
+ *		type and code revision, or any revision (ROMDB_ANYREV)
+ *
+ * The file, built by romdb(1), is a header, a bucket table, the entries
+ * sorted by key and a string pool:
+ *
+ *	struct romdb_hdr
+ *	uint32_t bucket[(1 << bucketbits) + 1]	first entry of each bucket
+ *	struct romdb_entry entry[nentries]
+ *	names, NUL-terminated
+ *
+ * Keys are 64-bit hashes, so the top bucketbits bits spread entries
+ * evenly and a lookup reads one bucket of about one entry: O(1) however
+ * many millions there are, straight out of the mmap(2)ed file.  An image
+ * match is tried before a PCIR match.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef ROMDB_H
+#define ROMDB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcirom.h"
+#include "romstore.h"
+
+#define ROMDB_MAGIC	"ROMDB001"
+#define ROMDB_IMAGE	1
+#define ROMDB_PCIR	2
+#define ROMDB_ANYREV	0xffffffffU
+#define ROMDB_SEED	2	/* PCIR keys; 0 and 1 are the image halves */
+
+struct romdb_hdr {
+	char		magic[8];
+	uint32_t	bucketbits;
+	uint32_t	flags;		/* reserved, 0 */
+	uint64_t	nentries;
+	uint64_t	entries;	/* file offset */
+	uint64_t	strings;	/* file offset */
+	uint64_t	stringslen;
+};
+
+/*
+ * check is the second image hash, or the packed PCIR fields, so a key
+ * collision is never taken for a match.
+ */
+struct romdb_entry {
+	uint64_t	key;
+	uint64_t	check;
+	uint32_t	kind;
+	uint32_t	name;		/* offset in the string pool */
+};
+
+struct romdb {
+	unsigned char			*map;
+	size_t				len;
+	const struct romdb_hdr		*hdr;
+	const uint32_t			*bucket;
+	const struct romdb_entry	*e;
+	const char			*strings;
+};
+
+static inline void romdb_image_key(const void *p, size_t len, uint64_t *key, uint64_t *check)
+{
+	*key = xxh64(p, len, 0);
+	*check = xxh64(p, len, 1);
+}
+
+/*
+ * The revision is hashed but not in check: it would not fit, and a
+ * wrong revision changes the key anyway.
+ */
+static inline void romdb_pcir_key(unsigned vendor, unsigned device, unsigned classcode, unsigned codetype,
+			   unsigned coderev, uint64_t *key, uint64_t *check)
+{
+	uint64_t	k[2];
+
+	*check = (uint64_t)vendor << 48 | (uint64_t)device << 32 | (uint64_t)(classcode & 0xffffff) << 8 |
+		 (codetype & 0xff);
+	k[0] = *check;
+	k[1] = coderev;
+	*key = xxh64(k, sizeof(k), ROMDB_SEED);
+}
+
+static inline int romdb_open(struct romdb *db, const char *path)
+{
+	const struct romdb_hdr	*h;
+	struct stat		sb;
+	uint64_t		nb;
+	int			fd;
+
+	memset(db, 0, sizeof(*db));
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror("open(2)");
+		return -1;
+	}
+	if (fstat(fd, &sb) < 0) {
+		perror("fstat(2)");
+		close(fd);
+		return -1;
+	}
+	if ((size_t)sb.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s: not a ROM database\n", path);
+		close(fd);
+		return -1;
+	}
+	if ((db->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("mmap(2)");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	db->len = sb.st_size;
+
+	h = db->hdr = (const struct romdb_hdr *)db->map;
+	nb = (1ULL << h->bucketbits) + 1;
+	if (memcmp(h->magic, ROMDB_MAGIC, 8) != 0 || h->bucketbits > 30 ||
+	    sizeof(*h) + nb * sizeof(uint32_t) > h->entries || h->entries > db->len ||
+	    h->nentries > (db->len - h->entries) / sizeof(struct romdb_entry) ||
+	    h->strings < h->entries + h->nentries * sizeof(struct romdb_entry) ||
+	    h->strings > db->len || h->stringslen > db->len - h->strings ||
+	    (h->stringslen && db->map[h->strings + h->stringslen - 1] != '\0')) {
+		fprintf(stderr, "%s: not a ROM database, or a damaged one\n", path);
+		munmap(db->map, db->len);
+		memset(db, 0, sizeof(*db));
+		return -1;
+	}
+	db->bucket = (const uint32_t *)(db->map + sizeof(*h));
+	db->e = (const struct romdb_entry *)(db->map + h->entries);
+	db->strings = (const char *)(db->map + h->strings);
+	return 0;
+}
+
+/*
+ * Name of the entry of kind with key and check, or NULL.
+ */
+static inline const char *romdb_lookup(const struct romdb *db, uint32_t kind, uint64_t key, uint64_t check)
+{
+	uint64_t	b, i, end;
+
+	if (!db->map || db->hdr->nentries == 0)
+		return NULL;
+	b = db->hdr->bucketbits ? key >> (64 - db->hdr->bucketbits) : 0;
+	end = db->bucket[b + 1] < db->hdr->nentries ? db->bucket[b + 1] : db->hdr->nentries;
+	for (i = db->bucket[b]; i < end && db->e[i].key <= key; i++)
+		if (db->e[i].key == key && db->e[i].check == check && db->e[i].kind == kind &&
+		    db->e[i].name < db->hdr->stringslen)
+			return db->strings + db->e[i].name;
+	return NULL;
+}
+
+/*
+ * Who made the len bytes at p, whose first image header is rom (NULL if
+ * it has none).  *how says which kind of entry matched.
+ */
+static inline const char *romdb_identify(const struct romdb *db, const void *p, size_t len,
+				  const struct pcirom *rom, const char **how)
+{
+	const char	*name;
+	uint64_t	key, check;
+
+	romdb_image_key(p, len, &key, &check);
+	if ((name = romdb_lookup(db, ROMDB_IMAGE, key, check)) != NULL) {
+		*how = "image";
+		return name;
+	}
+	if (rom == NULL)
+		return NULL;
+	*how = "pcir";
+	romdb_pcir_key(rom->vendor, rom->device, rom->classcode, rom->codetype, rom->coderev, &key, &check);
+	if ((name = romdb_lookup(db, ROMDB_PCIR, key, check)) != NULL)
+		return name;
+	*how = "pcir-anyrev";
+	romdb_pcir_key(rom->vendor, rom->device, rom->classcode, rom->codetype, ROMDB_ANYREV, &key, &check);
+	return romdb_lookup(db, ROMDB_PCIR, key, check);
+}
+
+#endif /* ROMDB_H */
@@ -0,0 +1,158 @@
+/*
+ * romstore.h - Content-addressed store for dumped ROM images.
+ *
+ * Instead of one file per hit, every image is named by its hash and
+ * written once:
+ *
+ *	<dir>/objects/ab/ab12...ef	the bytes, one file per distinct image
+ *	<dir>/index			"<address> <length> <hash> <label>" lines
+ *
+ * The index is appended to, one "# <tool> <host> <time>" header per run,
+ * so one store can collect dumps from a fleet of hosts; identical ROMs
+ * cost one object however many hosts and addresses they were seen at.
+ *
+ * The hash is XXH64 (xxh64.h) with seeds 0 and 1 side by side (128 bits), so no
+ * library is needed.  Objects are written to a temporary name and
+ * renamed, so a half-written one is never taken for a stored image, and
+ * romstore_close() issues one syncfs(2) on the store, so a run's objects
+ * and index lines are on disk once it returns.
+ *
+ * Header only, so every tool still builds from its one .c file.
+ */
+#ifndef ROMSTORE_H
+#define ROMSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "xxh64.h"
+
+#define ROMSTORE_HASHLEN	32	/* hex digits */
+
+struct romstore {
+	char		*dir;
+	FILE		*index;
+	unsigned long	stored;		/* new objects */
+	unsigned long	deduped;	/* already there */
+	unsigned long	bytes;		/* written */
+};
+
+static inline void romstore_hash(const void *p, size_t len, char hash[ROMSTORE_HASHLEN + 1])
+{
+	snprintf(hash, ROMSTORE_HASHLEN + 1, "%016llx%016llx",
+		 (unsigned long long)xxh64(p, len, 0), (unsigned long long)xxh64(p, len, 1));
+}
+
+static inline int romstore_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir(2)");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open (creating if need be) the store at dir and start a run in its
+ * index.
+ */
+static inline int romstore_open(struct romstore *rs, const char *dir, const char *tool)
+{
+	char	path[1024], host[256];
+	time_t	now = time(NULL);
+
+	memset(rs, 0, sizeof(*rs));
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	if (romstore_mkdir(dir) < 0 || romstore_mkdir(path) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/index", dir);
+	if ((rs->index = fopen(path, "a")) == NULL) {
+		perror("fopen(3)");
+		return -1;
+	}
+	if (gethostname(host, sizeof(host)) < 0)
+		strcpy(host, "unknown");
+	host[sizeof(host) - 1] = '\0';
+	fprintf(rs->index, "# %s %s %ld\n", tool, host, (long)now);
+	rs->dir = strdup(dir);
+	return 0;
+}
+
+/*
+ * Store len bytes at p, seen at address addr, unless an object with the
+ * same hash is already there.  hash may be NULL.
+ */
+static inline int romstore_put(struct romstore *rs, const void *p, size_t len, unsigned long addr,
+			const char *label, char *hash)
+{
+	char	h[ROMSTORE_HASHLEN + 1], path[1024], tmp[1100];
+	int	fd;
+
+	romstore_hash(p, len, h);
+	if (hash)
+		memcpy(hash, h, sizeof(h));
+	fprintf(rs->index, "%#lx %#zx %s %s\n", addr, len, h, label);
+
+	snprintf(path, sizeof(path), "%s/objects/%.2s", rs->dir, h);
+	if (romstore_mkdir(path) < 0)
+		return -1;
+	snprintf(path, sizeof(path), "%s/objects/%.2s/%s", rs->dir, h, h);
+	if (access(path, F_OK) == 0) {
+		rs->deduped++;
+		return 0;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	if ((fd = open(tmp, O_CREAT|O_WRONLY|O_TRUNC, 0644)) < 0) {
+		perror("open(2)");
+		return -1;
+	}
+	if (write(fd, p, len) != (ssize_t)len) {
+		perror("write(2)");
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0) {
+		perror("rename(2)");
+		unlink(tmp);
+		return -1;
+	}
+	rs->stored++;
+	rs->bytes += len;
+	return 0;
+}
+
+static inline int romstore_close(struct romstore *rs)
+{
+	int	error = 0, fd;
+
+	if (rs->index && fclose(rs->index) != 0) {
+		perror("fclose(3)");
+		error = -1;
+	}
+	rs->index = NULL;
+	if (rs->dir) {
+		if ((fd = open(rs->dir, O_RDONLY | O_DIRECTORY)) < 0 || syscall(__NR_syncfs, fd) < 0) {
+			perror("syncfs(2)");
+			error = -1;
+		}
+		if (fd >= 0)
+			close(fd);
+	}
+	free(rs->dir);
+	rs->dir = NULL;
+	return error;
+}
+
+#endif /* ROMSTORE_H */
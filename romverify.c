@@ -0,0 +1,392 @@
+/*
+ * romverify(1) - Check a corpus of dumped ROMs in one parallel pass.
+ *
+ * - Walks every file and directory argument (nftw(3), symlinks not
+ *   followed) and checks every regular file in it: ROMs from pcireadrom,
+ *   pcifindrom, findrom, romstore objects, anything.
+ * - Files are mmap(2)ed and checked on -j threads.  Image sums are the
+ *   pcirom.h kernels (AVX2 or SSE2), so a corpus goes at memory speed.
+ * - The image chain is walked from offset 0 (pcirom.h) and each file gets
+ *   one status:
+ *	ok		images up to the last-image bit, x86 ones summing to 0
+ *	legacy		no PCI data structure, but 55 aa, a length byte at
+ *			+0x02 and a zero sum over that length
+ *	part-chain	whole images, but the file ends where the chain goes
+ *			on (one <addr>.<n>.<type> image out of a chain)
+ *	not-rom		no 55 aa at offset 0 (text, empty dumps, ...)
+ *	bad-header	55 aa but neither a sane PCIR structure nor a length
+ *	bad-checksum	an x86 image (or a legacy ROM) does not sum to 0
+ *	truncated	an image runs past the end of the file
+ *	broken-chain	an image without the last-image bit is followed by
+ *			something that is not an image
+ * - Dump containers (dumpfile.h) have each ROM extent checked, reported
+ *   as <file>@<address>.
+ * - The report goes to stdout, one line per problem (-a: per file), as
+ *   CSV or -O json (one object per line):
+ *	path,status,size,images,offset,detail
+ *   offset is where in the file the problem is.  A summary goes to
+ *   stderr.  Exits 1 if anything is corrupt.
+ *
+ * Usage: romverify -j 8 -O json /srv/roms > report.jsonl
+ *
+ * Build: cc -O2 -o romverify romverify.c -lpthread
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcirom.h"
+#include "dumpfile.h"
+
+#define MAX_JOBS	1024
+
+enum {
+	ST_OK,
+	ST_LEGACY,
+	ST_PART,
+	ST_NOTROM,
+	ST_BADHEADER,
+	ST_BADSUM,
+	ST_TRUNCATED,
+	ST_BROKEN,
+	ST_MAX
+};
+
+static const char *status_names[ST_MAX] = {
+	"ok", "legacy", "part-chain", "not-rom", "bad-header", "bad-checksum", "truncated", "broken-chain"
+};
+
+#define CORRUPT(st)	((st) >= ST_BADHEADER)
+
+struct verdict {
+	int		status;
+	int		images;
+	unsigned long	offset;
+	char		detail[96];
+};
+
+/*
+ * One file's report, built by the worker that checked it and printed in
+ * the order the files were found once every worker is done.
+ */
+struct job {
+	char		*path;
+	char		*report;
+	size_t		reportlen;
+	unsigned long	bytes;
+	unsigned long	count[ST_MAX];
+};
+
+struct job	*jobs_v;
+unsigned long	njobs, jobcap, nexttake = 0;
+int		jobs = 1;
+int		aflag = 0;
+int		jsonout = 0;
+
+/*
+ * Walk the chain at p and say what it is.
+ */
+static void verify(const unsigned char *p, size_t size, struct verdict *v)
+{
+	struct pcirom	img;
+	unsigned long	off = 0, len, sum;
+
+	memset(v, 0, sizeof(*v));
+	if (size < 3 || p[0] != 0x55 || p[1] != 0xaa) {
+		v->status = ST_NOTROM;
+		return;
+	}
+
+	for (;;) {
+		v->offset = off;
+		if (!pcirom_parse(p + off, size - off, &img)) {
+			if (v->images > 0) {
+				v->status = ST_BROKEN;
+				snprintf(v->detail, sizeof(v->detail), "image %d is not an image", v->images);
+				return;
+			}
+			len = p[2] * 512UL;
+			if (len == 0) {
+				v->status = ST_BADHEADER;
+				snprintf(v->detail, sizeof(v->detail), "no PCIR and length byte 0");
+			} else if (len > size) {
+				v->status = ST_TRUNCATED;
+				snprintf(v->detail, sizeof(v->detail), "legacy ROM of %#lx bytes", len);
+			} else if ((sum = pcirom_sum(p, len) & 0xff) != 0) {
+				v->status = ST_BADSUM;
+				snprintf(v->detail, sizeof(v->detail), "legacy ROM sums to %#lx", sum);
+			} else {
+				v->status = ST_LEGACY;
+			}
+			return;
+		}
+
+		v->images++;
+		if (img.sum < 0) {
+			v->status = ST_TRUNCATED;
+			snprintf(v->detail, sizeof(v->detail), "image %d is %#lx bytes, %#lx in file",
+				 v->images - 1, img.length, size - off);
+			return;
+		}
+		if (img.codetype == PCIROM_CODE_X86 && img.sum != 0) {
+			v->status = ST_BADSUM;
+			snprintf(v->detail, sizeof(v->detail), "image %d sums to %#x", v->images - 1, img.sum);
+			return;
+		}
+		off += img.length;
+		if (img.indicator & PCIROM_LAST_IMAGE) {
+			v->status = ST_OK;
+			return;
+		}
+		if (off == size) {
+			v->offset = off;
+			v->status = ST_PART;
+			snprintf(v->detail, sizeof(v->detail), "file ends after image %d, not the last",
+				 v->images - 1);
+			return;
+		}
+	}
+}
+
+static void json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++)
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	fputc('"', fp);
+}
+
+static void csv_string(FILE *fp, const char *s)
+{
+	if (!strpbrk(s, ",\"\n")) {
+		fputs(s, fp);
+		return;
+	}
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"')
+			fputc('"', fp);
+		fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+static void report(FILE *fp, const char *path, size_t size, const struct verdict *v)
+{
+	if (jsonout) {
+		fprintf(fp, "{\"path\":");
+		json_string(fp, path);
+		fprintf(fp, ",\"status\":\"%s\",\"size\":%zu,\"images\":%d,\"offset\":%lu,\"detail\":",
+			status_names[v->status], size, v->images, v->offset);
+		json_string(fp, v->detail);
+		fprintf(fp, "}\n");
+	} else {
+		csv_string(fp, path);
+		fprintf(fp, ",%s,%zu,%d,%#lx,", status_names[v->status], size, v->images, v->offset);
+		csv_string(fp, v->detail);
+		fprintf(fp, "\n");
+	}
+}
+
+static void check(struct job *j, FILE *fp, const char *path, const unsigned char *p, size_t size)
+{
+	struct verdict	v;
+
+	verify(p, size, &v);
+	j->count[v.status]++;
+	if (aflag || CORRUPT(v.status))
+		report(fp, path, size, &v);
+}
+
+/*
+ * A container's ROM extents, each as if it were a file of its own.
+ */
+static void check_container(struct job *j, FILE *fp, const unsigned char *map, size_t size)
+{
+	const struct dump_trailer	*t = (const struct dump_trailer *)(map + size - sizeof(*t));
+	const struct dump_extent	*e;
+	char				name[4200];
+	unsigned long			i;
+
+	if (size < DUMP_HEADER_SIZE + sizeof(*t) || memcmp(t->magic, DUMP_TRAILER_MAGIC, 8) != 0 ||
+	    t->table > size - sizeof(*t) ||
+	    t->nextents > (size - sizeof(*t) - t->table) / sizeof(*e)) {
+		struct verdict	v = { .status = ST_TRUNCATED, .detail = "dump container without its table" };
+
+		j->count[v.status]++;
+		report(fp, j->path, size, &v);
+		return;
+	}
+	e = (const struct dump_extent *)(map + t->table);
+	for (i = 0; i < t->nextents; i++) {
+		if (e[i].source != DUMP_SRC_ROM || e[i].offset > t->table ||
+		    e[i].len > t->table - e[i].offset)
+			continue;
+		snprintf(name, sizeof(name), "%s@%#llx", j->path, (unsigned long long)e[i].addr);
+		check(j, fp, name, map + e[i].offset, e[i].len);
+	}
+}
+
+static void check_file(struct job *j)
+{
+	struct stat	sb;
+	unsigned char	*map = NULL;
+	FILE		*fp;
+	int		fd;
+
+	if ((fp = open_memstream(&j->report, &j->reportlen)) == NULL) {
+		perror("open_memstream(3)");
+		exit(1);
+	}
+	if ((fd = open(j->path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		fprintf(stderr, "romverify: %s: %s\n", j->path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		fclose(fp);
+		return;
+	}
+	if (sb.st_size > 0 &&
+	    (map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "romverify: %s: mmap(2): %s\n", j->path, strerror(errno));
+		close(fd);
+		fclose(fp);
+		return;
+	}
+	close(fd);
+	j->bytes = sb.st_size;
+
+	if (map && (size_t)sb.st_size >= 8 && memcmp(map, DUMP_MAGIC, 8) == 0)
+		check_container(j, fp, map, sb.st_size);
+	else
+		check(j, fp, j->path, map, sb.st_size);
+
+	if (map)
+		munmap(map, sb.st_size);
+	fclose(fp);
+}
+
+static void *worker(void *arg)
+{
+	unsigned long	k;
+
+	(void)arg;
+	while ((k = __sync_fetch_and_add(&nexttake, 1)) < njobs)
+		check_file(&jobs_v[k]);
+	return NULL;
+}
+
+static int add_file(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+	struct job	*v;
+
+	(void)sb;
+	(void)ftw;
+	if (type != FTW_F)
+		return 0;
+	if (njobs == jobcap) {
+		jobcap = jobcap ? jobcap * 2 : 1024;
+		if ((v = realloc(jobs_v, jobcap * sizeof(*v))) == NULL) {
+			perror("realloc(3)");
+			return -1;
+		}
+		jobs_v = v;
+	}
+	memset(&jobs_v[njobs], 0, sizeof(*jobs_v));
+	if ((jobs_v[njobs].path = strdup(path)) == NULL) {
+		perror("strdup(3)");
+		return -1;
+	}
+	njobs++;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t	tid[MAX_JOBS];
+	struct timespec	t0, t1;
+	unsigned long	count[ST_MAX] = { 0 }, bytes = 0, k, corrupt = 0;
+	double		secs;
+	int		opt, i, s;
+
+	while ((opt = getopt(argc, argv, "aj:O:")) != -1) switch (opt) {
+		case 'a':
+			aflag++;
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			if (jobs < 1 || jobs > MAX_JOBS) {
+				fprintf(stderr, "romverify: -j wants 1..%d\n", MAX_JOBS);
+				exit(1);
+			}
+			break;
+		case 'O':
+			if (strcmp(optarg, "json") == 0) {
+				jsonout = 1;
+			} else if (strcmp(optarg, "csv") != 0) {
+				fprintf(stderr, "romverify: -O wants csv or json\n");
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: romverify [ -a ] [ -j jobs ] [ -O csv|json ] file|dir ...\n");
+			exit(1);
+	}
+	if (optind == argc) {
+		fprintf(stderr, "Usage: romverify [ -a ] [ -j jobs ] [ -O csv|json ] file|dir ...\n");
+		exit(1);
+	}
+
+	for (i = optind; i < argc; i++)
+		if (nftw(argv[i], add_file, 64, FTW_PHYS) != 0) {
+			fprintf(stderr, "romverify: %s: %s\n", argv[i], strerror(errno));
+			exit(1);
+		}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < jobs; i++)
+		if ((errno = pthread_create(&tid[i], NULL, worker, NULL)) != 0) {
+			perror("pthread_create(3)");
+			exit(1);
+		}
+	for (i = 0; i < jobs; i++)
+		pthread_join(tid[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (!jsonout)
+		printf("path,status,size,images,offset,detail\n");
+	for (k = 0; k < njobs; k++) {
+		if (jobs_v[k].reportlen)
+			fwrite(jobs_v[k].report, 1, jobs_v[k].reportlen, stdout);
+		for (s = 0; s < ST_MAX; s++)
+			count[s] += jobs_v[k].count[s];
+		bytes += jobs_v[k].bytes;
+		free(jobs_v[k].report);
+		free(jobs_v[k].path);
+	}
+	free(jobs_v);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf(stderr, "romverify: %lu files, %.1f MB in %.2fs (%.0f MB/s) on %d thread%s:",
+		njobs, bytes / 1e6, secs, secs > 0 ? bytes / 1e6 / secs : 0.0, jobs, jobs == 1 ? "" : "s");
+	for (s = 0; s < ST_MAX; s++) {
+		fprintf(stderr, " %lu %s", count[s], status_names[s]);
+		if (CORRUPT(s))
+			corrupt += count[s];
+	}
+	fprintf(stderr, "\n");
+	exit(corrupt ? 1 : 0);
+}